@@ -46,6 +46,7 @@
 */
 #include "AUInstrumentBase.h"
 #include "AUMIDIDefs.h"
+#include "SynthEventQueueSize.h"
 
 #if DEBUG
 	#define DEBUG_PRINT 0
@@ -55,7 +56,10 @@
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-const UInt32 kEventQueueSize = 1024;
+// Render cycles are split at event offsets, but no sub-block is shorter than this
+// (except the last one in a cycle). Note-ons within a sub-block are still sample
+// accurate, since notes start at their own offset within the sub-block.
+const UInt32 kMinSubBlockFrames = 16;
 
 AUInstrumentBase::AUInstrumentBase(
 							AudioComponentInstance			inInstance, 
@@ -65,9 +69,11 @@ AUInstrumentBase::AUInstrumentBase(
 							UInt32							numParts)
 	: MusicDeviceBase(inInstance, numInputs, numOutputs, numGroups), 
 	mAbsoluteSampleFrame(0),
-	mEventQueue(kEventQueueSize),
+	mRenderCycleStartFrame(0),
+	mEventQueue(kEventQueueSize, kMaxEventQueueSize),
 	mNumNotes(0),
 	mNumActiveNotes(0),
+	mNumSoundingNotes(0),
 	mMaxActiveNotes(0),
 	mNotes(0),
 	mNoteSize(0),
@@ -118,6 +124,17 @@ void		AUInstrumentBase::SetNotes(UInt32 inNumNotes, UInt32 inMaxActiveNotes, Syn
 #if DEBUG_PRINT_NOTE
 	printf("AUInstrumentBase::SetNotes %d %d %p %d\n", inNumNotes, inMaxActiveNotes, inNotes, inNoteDataSize);
 #endif
+	// forget the previous notes
+	mFreeNotes.Empty();
+	mNumActiveNotes = 0;
+	mNumSoundingNotes = 0;
+	UInt32 numGroups = Groups().GetNumberOfElements();
+	for (UInt32 j = 0; j < numGroups; ++j)
+	{
+		SynthGroupElement *group = (SynthGroupElement*)Groups().GetElement(j);
+		group->Reset();
+	}
+	
 	mNumNotes = inNumNotes;
 	mMaxActiveNotes = inMaxActiveNotes;
 	mNoteSize = inNoteDataSize;
@@ -131,6 +148,17 @@ void		AUInstrumentBase::SetNotes(UInt32 inNumNotes, UInt32 inMaxActiveNotes, Syn
 	}
 }
 
+void		AUInstrumentBase::SetMaxActiveNotes(UInt32 inMaxActiveNotes, UInt32 inFrame)
+{
+	mMaxActiveNotes = inMaxActiveNotes;
+	while (NumActiveNotes() > MaxActiveNotes())
+	{
+		UInt32 numActiveNotes = NumActiveNotes();
+		VoiceStealing(inFrame, false);
+		if (NumActiveNotes() == numActiveNotes) break; // nothing left to release
+	}
+}
+
 UInt32		AUInstrumentBase::CountActiveNotes()
 {
 	// debugging tool.
@@ -157,6 +185,7 @@ void		AUInstrumentBase::AddFreeNote(SynthNote* inNote)
 	printf("AUInstrumentBase::AddFreeNote (%p)  mNumActiveNotes %lu\n", inNote, mNumActiveNotes);
 #endif
 	mFreeNotes.AddNote(inNote);
+	--mNumSoundingNotes;
 }
 
 OSStatus			AUInstrumentBase::Initialize()
@@ -204,7 +233,9 @@ OSStatus			AUInstrumentBase::Reset(			AudioUnitScope 					inScope,
 			mFreeNotes.AddNote(note);
 		}
 		mNumActiveNotes = 0;
+		mNumSoundingNotes = 0;
 		mAbsoluteSampleFrame = 0;
+		mSilentTimeout.Reset();
 
 		// empty lists.
 		UInt32 numGroups = Groups().GetNumberOfElements();
@@ -217,7 +248,7 @@ OSStatus			AUInstrumentBase::Reset(			AudioUnitScope 					inScope,
 	return MusicDeviceBase::Reset(inScope, inElement);
 }
 
-void		AUInstrumentBase::PerformEvents(const AudioTimeStamp& inTimeStamp)
+UInt32		AUInstrumentBase::PerformEvents(const AudioTimeStamp& inTimeStamp, UInt32 inEndFrame, UInt32 inNumberFrames)
 {
 #if DEBUG_PRINT_RENDER
 	printf("AUInstrumentBase::PerformEvents\n");
@@ -227,6 +258,13 @@ void		AUInstrumentBase::PerformEvents(const AudioTimeStamp& inTimeStamp)
 	
 	while ((event = mEventQueue.ReadItem()) != NULL)
 	{
+			// events are performed in queue order, so an event with an earlier offset
+			// than the one before it in the queue waits for that one. Offsets past
+			// the end of the cycle are performed in the last sub-block.
+		UInt32 offset = event->GetOffsetSampleFrame();
+		if (offset >= inNumberFrames) offset = inNumberFrames - 1;
+		if (offset >= inEndFrame) return offset;
+		
 #if DEBUG_PRINT_RENDER
 		printf("event %08X %d\n", event, event->GetEventType());
 #endif
@@ -272,17 +310,13 @@ void		AUInstrumentBase::PerformEvents(const AudioTimeStamp& inTimeStamp)
 		
 		mEventQueue.AdvanceReadPtr();
 	}
+	return inNumberFrames;
 }
 
 														
-OSStatus			AUInstrumentBase::Render(   AudioUnitRenderActionFlags &	ioActionFlags,
-												const AudioTimeStamp &			inTimeStamp,
-												UInt32							inNumberFrames)
+void				AUInstrumentBase::PrepareOutputBuffers(UInt32 inNumberFrames)
 {
-	PerformEvents(inTimeStamp);
-
-	AUScope &outputs = Outputs();
-	UInt32 numOutputs = outputs.GetNumberOfElements();
+	UInt32 numOutputs = Outputs().GetNumberOfElements();
 	for (UInt32 j = 0; j < numOutputs; ++j)
 	{
 		GetOutput(j)->PrepareBuffer(inNumberFrames);	// AUBase::DoRenderBus() only does this for the first output element
@@ -292,18 +326,61 @@ OSStatus			AUInstrumentBase::Render(   AudioUnitRenderActionFlags &	ioActionFlag
 			memset(bufferList.mBuffers[k].mData, 0, bufferList.mBuffers[k].mDataByteSize);
 		}
 	}
+}
+
+OSStatus			AUInstrumentBase::Render(   AudioUnitRenderActionFlags &	ioActionFlags,
+												const AudioTimeStamp &			inTimeStamp,
+												UInt32							inNumberFrames)
+{
+	AUScope &outputs = Outputs();
+	mRenderCycleStartFrame = (SInt64)inTimeStamp.mSampleTime;
 	
+	if (IsSilent(inNumberFrames))
+	{
+			// there is nothing to render. The flag lets the host skip the units after this one,
+			// but the buffers must still hold silence for hosts that ignore it.
+		UInt32 numOutputs = outputs.GetNumberOfElements();
+		for (UInt32 j = 0; j < numOutputs; ++j)
+		{
+			AUBufferList::ZeroBuffer(GetOutput(j)->PrepareBuffer(inNumberFrames));
+		}
+		ioActionFlags |= kAudioUnitRenderAction_OutputIsSilence;
+		mAbsoluteSampleFrame += inNumberFrames;
+		return noErr;
+	}
+	ioActionFlags &= ~kAudioUnitRenderAction_OutputIsSilence;
+	
+	PrepareOutputBuffers(inNumberFrames);
+	
+		// render up to the next event, perform the events at that offset and continue from there
 	UInt32 numGroups = Groups().GetNumberOfElements();
-	for (UInt32 j = 0; j < numGroups; ++j)
+	UInt32 frame = 0;
+	while (frame < inNumberFrames)
 	{
-		SynthGroupElement *group = (SynthGroupElement*)Groups().GetElement(j);
-		OSStatus err = group->Render((SInt64)inTimeStamp.mSampleTime, inNumberFrames, outputs);
-		if (err) return err;
+		UInt32 endFrame = PerformEvents(inTimeStamp, frame + kMinSubBlockFrames, inNumberFrames);
+		
+		for (UInt32 j = 0; j < numGroups; ++j)
+		{
+			SynthGroupElement *group = (SynthGroupElement*)Groups().GetElement(j);
+			OSStatus err = group->Render(mRenderCycleStartFrame + frame, endFrame - frame, outputs);
+			if (err) return err;
+		}
+		frame = endFrame;
 	}
 	mAbsoluteSampleFrame += inNumberFrames;
 	return noErr;
 }
 
+bool				AUInstrumentBase::IsSilent(UInt32 inNumberFrames)
+{
+	bool silent = mNumSoundingNotes == 0 && mEventQueue.ReadItem() == NULL;
+	
+		// like AUEffectBase, take latency and tail time into account before flagging silence
+	UInt32 silentTimeoutFrames = UInt32(GetOutput(0)->GetStreamFormat().mSampleRate * (GetLatency() + GetTailTime()));
+	mSilentTimeout.Process(inNumberFrames, silentTimeoutFrames, silent);
+	return silent;
+}
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //	AUInstrumentBase::ValidFormat
 //
@@ -441,7 +518,11 @@ OSStatus			AUInstrumentBase::StartNote(	MusicDeviceInstrumentID 	inInstrument,
 	else
 	{
 		SynthEvent *event = mEventQueue.WriteItem();
-		if (!event) return -1; // queue full
+		if (!event)
+		{
+			mEventQueue.DropItem(); // the queue is full
+			return -1;
+		}
 
 		event->Set(
 			SynthEvent::kEventType_NoteOn,
@@ -451,7 +532,7 @@ OSStatus			AUInstrumentBase::StartNote(	MusicDeviceInstrumentID 	inInstrument,
 			&inParams
 		);
 		
-		mEventQueue.AdvanceWritePtr();
+		mEventQueue.AdvanceWritePtr(event);
 	}
 	return err;
 }
@@ -475,7 +556,11 @@ OSStatus			AUInstrumentBase::StopNote( MusicDeviceGroupID 			inGroupID,
 	else
 	{
 		SynthEvent *event = mEventQueue.WriteItem();
-		if (!event) return -1; // queue full
+		if (!event)
+		{
+			mEventQueue.DropItem(); // the queue is full
+			return -1;
+		}
 
 		event->Set(
 			SynthEvent::kEventType_NoteOff,
@@ -485,7 +570,7 @@ OSStatus			AUInstrumentBase::StopNote( MusicDeviceGroupID 			inGroupID,
 			NULL
 		);
 		
-		mEventQueue.AdvanceWritePtr();
+		mEventQueue.AdvanceWritePtr(event);
 	}
 	return err;
 }
@@ -529,11 +614,15 @@ OSStatus	AUInstrumentBase::SendPedalEvent(MusicDeviceGroupID inGroupID, UInt32 i
 	else
 	{
 		SynthEvent *event = mEventQueue.WriteItem();
-		if (!event) return -1; // queue full
+		if (!event)
+		{
+			mEventQueue.DropItem(); // the queue is full
+			return -1;
+		}
 
 		event->Set(inEventType, inGroupID, 0, 0, NULL);
 		
-		mEventQueue.AdvanceWritePtr();
+		mEventQueue.AdvanceWritePtr(event);
 	}
 	return noErr;
 }
@@ -662,6 +751,7 @@ SynthNote*  AUInstrumentBase::GetAFreeNote(UInt32 inFrame)
 	if (note)
 	{
 		mFreeNotes.RemoveNote(note);
+		++mNumSoundingNotes;
 		return note;
 	}
 	
@@ -699,6 +789,7 @@ SynthNote*  AUInstrumentBase::VoiceStealing(UInt32 inFrame, bool inKillIt)
 #endif
 					note->Kill(inFrame);
 					group->mNoteList[i].RemoveNote(note);
+					group->RemoveNoteID(note);
 					if (i != kNoteState_FastReleased)
 						DecNumActiveNotes();
 					return note;
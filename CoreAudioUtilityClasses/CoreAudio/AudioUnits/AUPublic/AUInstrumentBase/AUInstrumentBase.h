@@ -53,14 +53,15 @@
 #include <CoreAudio/CoreAudio.h>
 #include <libkern/OSAtomic.h>
 #include "MusicDeviceBase.h"
-#include "LockFreeFIFO.h"
+#include "AUSilentTimeout.h"
+#include "LockFreeMPSCQueue.h"
 #include "SynthEvent.h"
 #include "SynthNote.h"
 #include "SynthElement.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-typedef LockFreeFIFOWithFree<SynthEvent> SynthEventQueue;
+typedef LockFreeMPSCQueue<SynthEvent> SynthEventQueue;
 
 class AUInstrumentBase : public MusicDeviceBase
 {
@@ -162,6 +163,12 @@ public:
 						}
 	
 	SynthNote*			GetAFreeNote(UInt32 inFrame);
+	
+			// the sample time of the first frame of the current render cycle. Render cycles are
+			// split into sub-blocks at event offsets; a sub-block that is rendered at
+			// inAbsoluteSampleFrame starts inAbsoluteSampleFrame - RenderCycleStartFrame()
+			// frames into the output buffers.
+	SInt64				RenderCycleStartFrame() const { return mRenderCycleStartFrame; }
 	void				AddFreeNote(SynthNote* inNote);
 	
 	friend class SynthGroupElement;
@@ -172,17 +179,36 @@ protected:
 	
 	// call SetNotes in your Initialize() method to give the base class your note structures and to set the maximum 
 	// number of active notes. inNoteData should be an array of size inMaxActiveNotes.
+	// SetNotes can be called again, when the AU is not rendering, to replace the notes; all notes are stopped.
 	void				SetNotes(UInt32 inNumNotes, UInt32 inMaxActiveNotes, SynthNote* inNotes, UInt32 inNoteSize);
 	
-	void				PerformEvents(   const AudioTimeStamp &			inTimeStamp);
+			// changes the maximum number of active notes while rendering. If more notes are active than
+			// the new maximum, the quietest ones are fast released at inFrame.
+	void				SetMaxActiveNotes(UInt32 inMaxActiveNotes, UInt32 inFrame);
+	
+			// called at the start of each render cycle. The default prepares the output buffers and
+			// clears them, so that the notes can add to them. Override it to skip the clearing if
+			// the notes don't add to the output buffers, and every frame of them is written later.
+	virtual void		PrepareOutputBuffers(UInt32 inNumberFrames);
+	
+			// performs the queued events whose offsets are before inEndFrame, and returns the
+			// offset of the first event that is left in the queue, or inNumberFrames
+	UInt32				PerformEvents(   const AudioTimeStamp &			inTimeStamp,
+										 UInt32							inEndFrame,
+										 UInt32							inNumberFrames);
 	OSStatus			SendPedalEvent(MusicDeviceGroupID inGroupID, UInt32 inEventType, UInt32 inOffsetSampleFrame);
 	virtual SynthNote*  VoiceStealing(UInt32 inFrame, bool inKillIt);
 	UInt32				MaxActiveNotes() const { return mMaxActiveNotes; }
 	UInt32				NumActiveNotes() const { return mNumActiveNotes; }
+			// the number of notes that aren't free, including fast released ones
+	UInt32				NumSoundingNotes() const { return mNumSoundingNotes; }
 	void				IncNumActiveNotes() { ++mNumActiveNotes; }
 	void				DecNumActiveNotes() { --mNumActiveNotes; }
 	UInt32				CountActiveNotes();
 	
+			// the number of note and pedal events that were dropped because the event queue was full
+	UInt64				DroppedEventCount() const { return mEventQueue.GetDroppedItems(); }
+	
 	SynthPartElement *	GetPartElement (AudioUnitElement inPartElement);
 	
 			// this call throws if there's no assigned element for the group ID
@@ -190,6 +216,12 @@ protected:
 	virtual SynthGroupElement *	GetElForNoteID (NoteInstanceID inNoteID);
 
 	SInt64 mAbsoluteSampleFrame;
+	SInt64 mRenderCycleStartFrame;
+
+			// returns true when no note is sounding and no event is waiting, for longer than the
+			// latency and tail time of the unit. Render then skips the notes and flags the
+			// output as silent.
+	bool				IsSilent(UInt32 inNumberFrames);
 
 	
 private:
@@ -200,11 +232,14 @@ private:
 	
 	UInt32 mNumNotes;
 	UInt32 mNumActiveNotes;
+	UInt32 mNumSoundingNotes;
 	UInt32 mMaxActiveNotes;
 	SynthNote* mNotes;	
 	SynthNoteList mFreeNotes;
 	UInt32 mNoteSize;
 	
+	AUSilentTimeout	mSilentTimeout;
+	
 	AUScope			mPartScope;
 	const UInt32	mInitNumPartEls;
 };
@@ -44,15 +44,33 @@
  Copyright (C) 2013 Apple Inc. All Rights Reserved. 
   
 */
-#include <libkern/OSAtomic.h>
+#ifndef __LockFreeFIFO_h__
+#define __LockFreeFIFO_h__
+
+#include <stdint.h>
+#include <atomic>
+#include "HSCacheLine.h"
+
+// Single producer, single consumer ring buffers built on C++11 atomics, so that
+// they work on any platform. The producer publishes an item with a release
+// store of the write index, and the consumer picks it up with an acquire load;
+// the read index is handed back the same way.
+//
+// The indices that each side writes are kept on separate cache lines with
+// HSCacheLinePad, so that the producer and the consumer don't invalidate each
+// other's cache line on every item.
+//
+// WriteItem returns NULL while the ring is full, and the producer can try
+// again later. When it gives up on the item instead, it tells the queue with
+// DropItem, so that lost events can be detected.
 
 template <class ITEM>
 class LockFreeFIFOWithFree
 {
 	LockFreeFIFOWithFree(); // private, unimplemented.
 public:
-	LockFreeFIFOWithFree(UInt32 inMaxSize)
-		: mReadIndex(0), mWriteIndex(0), mFreeIndex(0)
+	LockFreeFIFOWithFree(uint32_t inMaxSize)
+		: mWriteIndex(0), mFreeIndex(0), mDroppedItems(0), mReadIndex(0)
 	{
 		//assert(IsPowerOfTwo(inMaxSize));
 		mItems = new ITEM[inMaxSize];
@@ -65,38 +83,46 @@ public:
 	}
 
 	
+	// Must not be called while either side is using the queue.
 	void Reset() 
 	{
 		FreeItems();
-		mReadIndex = 0;
-		mWriteIndex = 0;
+		mReadIndex.store(0, std::memory_order_relaxed);
+		mWriteIndex.store(0, std::memory_order_relaxed);
 		mFreeIndex = 0;
 	}
 	
+	// Producer side. Returns NULL if the queue is full.
 	ITEM* WriteItem() 
 	{
-		//printf("WriteItem %d %d\n", mReadIndex, mWriteIndex);
 		FreeItems(); // free items on the write thread.
-		UInt32 nextWriteIndex = (mWriteIndex + 1) & mMask;
+		uint32_t writeIndex = mWriteIndex.load(std::memory_order_relaxed);
+		uint32_t nextWriteIndex = (writeIndex + 1) & mMask;
 		if (nextWriteIndex == mFreeIndex) return NULL;
-		return &mItems[mWriteIndex];
+		return &mItems[writeIndex];
 	}
+	// Producer side. Counts an item that the producer gave up on because the queue was full.
+	void DropItem() { mDroppedItems.fetch_add(1, std::memory_order_relaxed); }
 	
+	// Consumer side.
 	ITEM* ReadItem() 
 	{
-		//printf("ReadItem %d %d\n", mReadIndex, mWriteIndex);
-		if (mReadIndex == mWriteIndex) return NULL;
-		return &mItems[mReadIndex];
+		uint32_t readIndex = mReadIndex.load(std::memory_order_relaxed);
+		if (readIndex == mWriteIndex.load(std::memory_order_acquire)) return NULL;
+		return &mItems[readIndex];
 	}
-	void AdvanceWritePtr() { OSAtomicCompareAndSwap32(mWriteIndex, (mWriteIndex + 1) & mMask, (int32_t*)&mWriteIndex); }
-	void AdvanceReadPtr()  { OSAtomicCompareAndSwap32(mReadIndex,  (mReadIndex  + 1) & mMask, (int32_t*)&mReadIndex); }
+	void AdvanceWritePtr() { mWriteIndex.store((mWriteIndex.load(std::memory_order_relaxed) + 1) & mMask, std::memory_order_release); }
+	void AdvanceReadPtr()  { mReadIndex.store((mReadIndex.load(std::memory_order_relaxed) + 1) & mMask, std::memory_order_release); }
+	
+	// The number of items that were given to DropItem. Can be read from any thread.
+	uint64_t GetDroppedItems() const { return mDroppedItems.load(std::memory_order_relaxed); }
 private:
 	ITEM* FreeItem() 
 	{
-		if (mFreeIndex == mReadIndex) return NULL;
+		if (mFreeIndex == mReadIndex.load(std::memory_order_acquire)) return NULL;
 		return &mItems[mFreeIndex];
 	}
-	void AdvanceFreePtr() { OSAtomicCompareAndSwap32(mFreeIndex, (mFreeIndex + 1) & mMask, (int32_t*)&mFreeIndex); }
+	void AdvanceFreePtr() { mFreeIndex = (mFreeIndex + 1) & mMask; }
 	
 	void FreeItems() 
 	{
@@ -108,8 +134,19 @@ private:
 		}
 	}
 	
-	volatile UInt32 mReadIndex, mWriteIndex, mFreeIndex;
-	UInt32 mMask;
+	// Written by the producer. The free index is only used on the producer side.
+	HSCacheLinePad mPad0;
+	std::atomic<uint32_t> mWriteIndex;
+	uint32_t mFreeIndex;
+	std::atomic<uint64_t> mDroppedItems;
+	
+	// Written by the consumer.
+	HSCacheLinePad mPad1;
+	std::atomic<uint32_t> mReadIndex;
+	
+	// Read only after construction.
+	HSCacheLinePad mPad2;
+	uint32_t mMask;
 	ITEM *mItems;
 };
 
@@ -122,8 +159,8 @@ class LockFreeFIFO
 {
 	LockFreeFIFO(); // private, unimplemented.
 public:
-	LockFreeFIFO(UInt32 inMaxSize)
-		: mReadIndex(0), mWriteIndex(0)
+	LockFreeFIFO(uint32_t inMaxSize)
+		: mWriteIndex(0), mDroppedItems(0), mReadIndex(0)
 	{
 		//assert(IsPowerOfTwo(inMaxSize));
 		mItems = new ITEM[inMaxSize];
@@ -135,34 +172,50 @@ public:
 		delete [] mItems;
 	}
 	
+	// Must not be called while either side is using the queue.
 	void Reset() 
 	{
-		mReadIndex = 0;
-		mWriteIndex = 0;
+		mReadIndex.store(0, std::memory_order_relaxed);
+		mWriteIndex.store(0, std::memory_order_relaxed);
 	}
 	
+	// Producer side. Returns NULL if the queue is full.
 	ITEM* WriteItem() 
 	{
-		UInt32 nextWriteIndex = (mWriteIndex + 1) & mMask;
-		if (nextWriteIndex == mReadIndex) return NULL;
-		return &mItems[mWriteIndex];
+		uint32_t writeIndex = mWriteIndex.load(std::memory_order_relaxed);
+		uint32_t nextWriteIndex = (writeIndex + 1) & mMask;
+		if (nextWriteIndex == mReadIndex.load(std::memory_order_acquire)) return NULL;
+		return &mItems[writeIndex];
 	}
+	// Producer side. Counts an item that the producer gave up on because the queue was full.
+	void DropItem() { mDroppedItems.fetch_add(1, std::memory_order_relaxed); }
 	
+	// Consumer side.
 	ITEM* ReadItem() 
 	{
-		if (mReadIndex == mWriteIndex) return NULL;
-		return &mItems[mReadIndex];
+		uint32_t readIndex = mReadIndex.load(std::memory_order_relaxed);
+		if (readIndex == mWriteIndex.load(std::memory_order_acquire)) return NULL;
+		return &mItems[readIndex];
 	}
 	
-		// the CompareAndSwap will always succeed. We use CompareAndSwap because it calls the PowerPC sync instruction,
-		// plus any processor bug workarounds for various CPUs.
-	void AdvanceWritePtr() { OSAtomicCompareAndSwap32(mWriteIndex, (mWriteIndex + 1) & mMask, (UInt32*)&mWriteIndex); }
-	void AdvanceReadPtr()  { OSAtomicCompareAndSwap32(mReadIndex,  (mReadIndex  + 1) & mMask, (UInt32*)&mReadIndex); }
+	void AdvanceWritePtr() { mWriteIndex.store((mWriteIndex.load(std::memory_order_relaxed) + 1) & mMask, std::memory_order_release); }
+	void AdvanceReadPtr()  { mReadIndex.store((mReadIndex.load(std::memory_order_relaxed) + 1) & mMask, std::memory_order_release); }
+	
+	// The number of items that were given to DropItem. Can be read from any thread.
+	uint64_t GetDroppedItems() const { return mDroppedItems.load(std::memory_order_relaxed); }
 	
 private:
 	
-	volatile UInt32 mReadIndex, mWriteIndex;
-	UInt32 mMask;
+	HSCacheLinePad mPad0;
+	std::atomic<uint32_t> mWriteIndex;
+	std::atomic<uint64_t> mDroppedItems;
+	
+	HSCacheLinePad mPad1;
+	std::atomic<uint32_t> mReadIndex;
+	
+	HSCacheLinePad mPad2;
+	uint32_t mMask;
 	ITEM *mItems;
 };
 
+#endif
@@ -0,0 +1,316 @@
+/*
+ *  LockFreeMPSCQueue.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __LockFreeMPSCQueue_h__
+#define __LockFreeMPSCQueue_h__
+
+#include <stdint.h>
+#include <atomic>
+#include "HSCacheLine.h"
+
+// A multiple producer, single consumer queue, made for carrying events from any
+// number of MIDI and automation threads to the render thread.
+//
+// The items are kept in a chain of chunks of kChunkSize slots. Producers fill
+// the chunk at the tail of the chain, each claiming a slot with one fetch_add,
+// and move on to the next chunk when it is full. The consumer reads the chunk
+// at the head, and when it has read all of it, moves it to the end of the
+// chain, where it is filled again. The chunks for inCapacity items are
+// allocated up front, so in normal use neither side allocates or frees memory.
+//
+// A burst that doesn't fit makes the queue grow: a producer that finds every
+// chunk full allocates another one and links it in. The consumer, which is
+// the render thread, never allocates. Only once the chunks for inMaxCapacity
+// items are all full does WriteItem return NULL, and the item is dropped.
+//
+// Both sides are wait free apart from growing: a producer takes a bounded
+// number of steps whether or not the other threads make progress, and the
+// consumer never waits for a producer; an item that is claimed but not yet
+// published holds back the items after it until it is.
+//
+// A chunk that is moved to the end of the chain gets a new generation, which
+// is part of what the producers read from the tail. A producer that still holds
+// the old generation, and claims a slot in the chunk after all, marks the slot
+// as skipped and starts over.
+//
+// Items are freed with ITEM::Free() on the producer thread, when their slot is
+// written again, so that the consumer doesn't free memory either.
+
+template <class ITEM>
+class LockFreeMPSCQueue
+{
+	LockFreeMPSCQueue(); // private, unimplemented.
+	LockFreeMPSCQueue(const LockFreeMPSCQueue&);
+	LockFreeMPSCQueue& operator=(const LockFreeMPSCQueue&);
+
+public:
+	static const uint32_t kChunkSize = 256;
+
+private:
+	// The item must be the first member, so that AdvanceWritePtr can find the slot of an item
+	struct Slot
+	{
+		ITEM mItem;
+		std::atomic<uint64_t> mState; // the tag of the item once it is published, with kSkipped if it never will be
+		uint64_t mTag;                // written by the producer that claimed the slot
+		bool mWritten;                // whether the item has to be freed before reuse
+	};
+
+	struct Chunk
+	{
+		Chunk() : mWritePos(0), mNext(0), mGeneration(0)
+		{
+			for (uint32_t i=0; i<kChunkSize; ++i)
+			{
+				mSlots[i].mState.store(0, std::memory_order_relaxed);
+				mSlots[i].mTag = 0;
+				mSlots[i].mWritten = false;
+			}
+		}
+
+		Slot mSlots[kChunkSize];
+		HSCacheLinePad mPad0;
+		std::atomic<uint64_t> mWritePos; // the generation in the upper half, the claimed slots in the lower
+		HSCacheLinePad mPad1;
+		std::atomic<uint64_t> mNext;     // the link to the next chunk in the chain, 0 at the end
+		uint32_t mGeneration;            // only used by the consumer, once the chunk is in the chain
+	};
+
+	// Links and tags are a generation in the upper half and an index+1 in the
+	// lower, so that neither is ever 0
+	static const uint32_t kGenerationMask = 0x7FFFFFFF;
+	static const uint64_t kSkipped = 1ULL << 63;
+
+	static uint64_t Pack(uint32_t inGeneration, uint32_t inIndex) { return ((uint64_t) inGeneration << 32) | (inIndex + 1); }
+	static uint32_t Generation(uint64_t inValue) { return (uint32_t) (inValue >> 32); }
+	static uint32_t Index(uint64_t inLink) { return (uint32_t) inLink - 1; }
+	static uint32_t Claimed(uint64_t inWritePos) { return (uint32_t) inWritePos; }
+
+public:
+	// The chunks for inCapacity items are allocated up front, and the queue grows
+	// until it holds inMaxCapacity items.
+	LockFreeMPSCQueue(uint32_t inCapacity, uint32_t inMaxCapacity)
+		: mDroppedItems(0)
+	{
+		// One chunk more than the items need, since the consumer can't reuse the
+		// head chunk until it has read all of it
+		uint32_t chunks = (inCapacity + kChunkSize - 1) / kChunkSize + 1;
+		if (chunks < 2) chunks = 2;
+		mMaxChunks = (inMaxCapacity + kChunkSize - 1) / kChunkSize + 1;
+		if (mMaxChunks < chunks) mMaxChunks = chunks;
+
+		mChunks = new std::atomic<Chunk*>[mMaxChunks];
+		for (uint32_t i=0; i<mMaxChunks; ++i)
+			mChunks[i].store(i < chunks ? new Chunk : NULL, std::memory_order_relaxed);
+		for (uint32_t i=0; i+1<chunks; ++i)
+			GetChunk(i)->mNext.store(Pack(0, i+1), std::memory_order_relaxed);
+		mNumChunks.store(chunks, std::memory_order_relaxed);
+
+		mTail.store(Pack(0, 0), std::memory_order_relaxed);
+		mHead = 0;
+		mHeadGeneration = 0;
+		mReadPos = 0;
+		mEnd = chunks - 1;
+	}
+
+	~LockFreeMPSCQueue()
+	{
+		for (uint32_t i=0; i<mMaxChunks; ++i)
+		{
+			Chunk* chunk = mChunks[i].load(std::memory_order_relaxed);
+			if (!chunk) continue;
+			for (uint32_t j=0; j<kChunkSize; ++j)
+			{
+				if (chunk->mSlots[j].mWritten) chunk->mSlots[j].mItem.Free();
+			}
+			delete chunk;
+		}
+		delete [] mChunks;
+	}
+
+	// Must not be called while any thread is using the queue.
+	void Reset()
+	{
+		while (ReadItem())
+			AdvanceReadPtr();
+	}
+
+	// Producer side; can be called from any number of threads at once. Returns
+	// NULL if the queue is full and can't grow. Every item that is returned must
+	// be handed back with AdvanceWritePtr.
+	ITEM* WriteItem()
+	{
+		// Each time around, either this producer claims a slot, or some chunk has
+		// filled up or moved since it read the tail, so this is only cut short
+		// when the other producers fill more chunks than the queue can have
+		for (uint32_t attempt=0; attempt<=mMaxChunks; ++attempt)
+		{
+			uint64_t tail = mTail.load(std::memory_order_seq_cst);
+			uint32_t generation = Generation(tail);
+			Chunk* chunk = GetChunk(Index(tail));
+
+			// A full chunk isn't claimed from, so that the count can't run into the generation
+			uint64_t claim = chunk->mWritePos.load(std::memory_order_relaxed);
+			if (Generation(claim) != generation) continue;
+			if (Claimed(claim) < kChunkSize)
+				claim = chunk->mWritePos.fetch_add(1, std::memory_order_seq_cst);
+
+			uint32_t pos = Claimed(claim);
+			if (Generation(claim) != generation)
+			{
+				// The chunk was moved to the end of the chain after the tail was read,
+				// and the slot belongs to its new generation
+				if (pos < kChunkSize)
+					chunk->mSlots[pos].mState.store(Pack(Generation(claim), pos) | kSkipped, std::memory_order_release);
+				continue;
+			}
+
+			if (pos < kChunkSize)
+			{
+				// The consumer had read the slot before the chunk was linked in
+				// again, and the chunk was reached through that link, so the item
+				// can be freed and written
+				Slot& slot = chunk->mSlots[pos];
+				if (slot.mWritten) slot.mItem.Free();
+				slot.mWritten = true;
+				slot.mTag = Pack(generation, pos);
+				return &slot.mItem;
+			}
+
+			uint64_t next = chunk->mNext.load(std::memory_order_seq_cst);
+			if (!next)
+			{
+				// The chunk is moving to the end of the chain unless it is still the tail
+				if (mTail.load(std::memory_order_seq_cst) == tail && !Grow(Index(tail))) return NULL;
+				continue;
+			}
+			mTail.compare_exchange_strong(tail, next, std::memory_order_seq_cst);
+		}
+		return NULL;
+	}
+
+	// Publishes an item that was returned by WriteItem.
+	void AdvanceWritePtr(ITEM* inItem)
+	{
+		Slot* slot = reinterpret_cast<Slot*>(inItem);
+		slot->mState.store(slot->mTag, std::memory_order_release);
+	}
+
+	// Producer side. Counts an item that the producer gave up on because the queue was full.
+	void DropItem() { mDroppedItems.fetch_add(1, std::memory_order_relaxed); }
+
+	// Consumer side. The items of each producer are read in the order in which it
+	// wrote them.
+	ITEM* ReadItem()
+	{
+		for (;;)
+		{
+			Slot& slot = GetChunk(mHead)->mSlots[mReadPos];
+			uint64_t state = slot.mState.load(std::memory_order_acquire);
+			uint64_t tag = Pack(mHeadGeneration, mReadPos);
+			if (state == tag) return &slot.mItem;
+			if (state != (tag | kSkipped)) return NULL;
+			AdvanceReadPtr();
+		}
+	}
+
+	// Hands the slot back to the producers
+	void AdvanceReadPtr()
+	{
+		if (++mReadPos == kChunkSize) NextChunk();
+	}
+
+	// The number of items that were given to DropItem. Can be read from any thread.
+	uint64_t GetDroppedItems() const { return mDroppedItems.load(std::memory_order_relaxed); }
+
+	// The number of slots in the chunks that have been allocated. Can be read from any thread.
+	uint32_t GetCapacity() const
+	{
+		uint32_t chunks = mNumChunks.load(std::memory_order_relaxed);
+		return (chunks < mMaxChunks ? chunks : mMaxChunks) * kChunkSize;
+	}
+
+private:
+	Chunk* GetChunk(uint32_t inIndex) const { return mChunks[inIndex].load(std::memory_order_acquire); }
+
+	// Links a chunk in after the end of the chain that inIndex is on. Returns
+	// false if the chain kept growing for longer than the queue can.
+	bool Append(uint32_t inIndex, uint64_t inLink)
+	{
+		Chunk* chunk = GetChunk(inIndex);
+		for (uint32_t i=0; i<=mMaxChunks; ++i)
+		{
+			uint64_t next = chunk->mNext.load(std::memory_order_seq_cst);
+			if (!next && chunk->mNext.compare_exchange_strong(next, inLink, std::memory_order_seq_cst))
+				return true;
+			chunk = GetChunk(Index(next));
+		}
+		return false;
+	}
+
+	// Producer side. Allocates a chunk and links it in after the end of the
+	// chain. Returns false if the queue already has as many chunks as it can.
+	bool Grow(uint32_t inTail)
+	{
+		if (mNumChunks.load(std::memory_order_relaxed) >= mMaxChunks) return false;
+		uint32_t index = mNumChunks.fetch_add(1, std::memory_order_relaxed);
+		if (index >= mMaxChunks) return false;
+
+		mChunks[index].store(new Chunk, std::memory_order_release);
+		// If this fails, the chunk stays unused until the queue is destroyed
+		Append(inTail, Pack(0, index));
+		return true;
+	}
+
+	// Consumer side. Moves the head chunk, which has been read, to the end of
+	// the chain. The chain always has more than one chunk, so there is a next one.
+	void NextChunk()
+	{
+		Chunk* chunk = GetChunk(mHead);
+		uint64_t next = chunk->mNext.load(std::memory_order_seq_cst);
+
+		// Producers that still see the chunk as the tail move on from it
+		uint64_t link = Pack(mHeadGeneration, mHead);
+		mTail.compare_exchange_strong(link, next, std::memory_order_seq_cst);
+
+		// The end of the chain is searched for from a chunk that stays on it
+		uint32_t end = mEnd == mHead ? Index(next) : mEnd;
+
+		uint32_t generation = (chunk->mGeneration + 1) & kGenerationMask;
+		chunk->mGeneration = generation;
+		chunk->mNext.store(0, std::memory_order_seq_cst);
+		chunk->mWritePos.store((uint64_t) generation << 32, std::memory_order_seq_cst);
+		Append(end, Pack(generation, mHead));
+		mEnd = mHead;
+
+		mHead = Index(next);
+		mHeadGeneration = Generation(next);
+		mReadPos = 0;
+	}
+
+	// Shared by the producers, and moved on by the consumer
+	HSCacheLinePad mPad0;
+	std::atomic<uint64_t> mTail;
+	HSCacheLinePad mPad1;
+	std::atomic<uint32_t> mNumChunks;
+	std::atomic<uint64_t> mDroppedItems;
+
+	// Only used by the consumer
+	HSCacheLinePad mPad2;
+	uint32_t mHead;
+	uint32_t mHeadGeneration;
+	uint32_t mReadPos;
+	uint32_t mEnd;
+	HSCacheLinePad mPad3;
+
+	// Read only after construction
+	std::atomic<Chunk*>* mChunks;
+	uint32_t mMaxChunks;
+};
+
+#endif
@@ -95,6 +95,7 @@ SynthGroupElement::SynthGroupElement(AUInstrumentBase *audioUnit, UInt32 inEleme
 {
 	for (UInt32 i=0; i<kNumberOfSoundingNoteStates; ++i)
 		mNoteList[i].mState = (SynthNoteState) i;
+	memset(mNotesByID, 0, sizeof(mNotesByID));
 }
 
 SynthGroupElement::~SynthGroupElement()
@@ -117,6 +118,7 @@ void SynthGroupElement::Reset()
 	mMidiControlHandler->Reset();
 	for (UInt32 i=0; i<kNumberOfSoundingNoteStates; ++i)
 		mNoteList[i].Empty();
+	memset(mNotesByID, 0, sizeof(mNotesByID));
 }
 
 SynthPartElement::SynthPartElement(AUInstrumentBase *audioUnit, UInt32 inElement) 
@@ -124,8 +126,31 @@ SynthPartElement::SynthPartElement(AUInstrumentBase *audioUnit, UInt32 inElement
 {
 }
 
+void SynthGroupElement::AddNoteID(SynthNote *inNote)
+{
+	SynthNote **bucket = &mNotesByID[inNote->mNoteID & (kNoteIDTableSize - 1)];
+	inNote->mIDPrev = NULL;
+	inNote->mIDNext = *bucket;
+	if (*bucket) (*bucket)->mIDPrev = inNote;
+	*bucket = inNote;
+}
+
+void SynthGroupElement::RemoveNoteID(SynthNote *inNote)
+{
+	SynthNote **bucket = &mNotesByID[inNote->mNoteID & (kNoteIDTableSize - 1)];
+	if (inNote->mIDPrev) inNote->mIDPrev->mIDNext = inNote->mIDNext;
+	else if (*bucket == inNote) *bucket = inNote->mIDNext;
+	else return; // not indexed
+	
+	if (inNote->mIDNext) inNote->mIDNext->mIDPrev = inNote->mIDPrev;
+	inNote->mIDPrev = NULL;
+	inNote->mIDNext = NULL;
+}
+
 // Return the SynthNote with the given inNoteID, if found.  If unreleasedOnly is true, only look for
 // attacked and sostenutoed notes, otherwise search all states.  Return state of found note via outNoteState.
+// If several notes have the same ID, the one in the earliest state is returned, and among those the one
+// that was started last.
 
 SynthNote *SynthGroupElement::GetNote(NoteInstanceID inNoteID, bool unreleasedOnly, UInt32 *outNoteState)
 {
@@ -135,28 +160,28 @@ SynthNote *SynthGroupElement::GetNote(NoteInstanceID inNoteID, bool unreleasedOn
 	const UInt32 lastNoteState = unreleasedOnly ? 
 									(mSostenutoIsOn ? kNoteState_Sostenutoed : kNoteState_Attacked)
 										: kNoteState_Released;
-	SynthNote *note = NULL;
-	// Search for notes in each successive state
-	for (UInt32 noteState = kNoteState_Attacked; noteState <= lastNoteState; ++noteState)
+	SynthNote *found = NULL;
+	UInt32 foundState = lastNoteState;	// reported even if we find nothing
+	// Only the notes whose IDs share a bucket with inNoteID need to be checked
+	for (SynthNote *note = mNotesByID[inNoteID & (kNoteIDTableSize - 1)]; note; note = note->mIDNext)
 	{
-		if (outNoteState) *outNoteState = noteState;	// even if we find nothing
-		note = mNoteList[noteState].mHead;
-		while (note && note->mNoteID != inNoteID)
-		{
 #if DEBUG_PRINT_RENDER
-			printf("   checking %p id: %d\n", note, note->mNoteID);
+		printf("   checking %p id: %d\n", note, note->mNoteID);
 #endif
-			note = note->mNext;
-		}
-		if (note)
+		if (note->mNoteID != inNoteID) continue;
+		UInt32 noteState = note->GetState();
+		if (noteState > lastNoteState) continue;
+		if (!found || noteState < foundState)
 		{
-#if DEBUG_PRINT_RENDER
-			printf("  found %p\n", note);
-#endif
-			break;
+			found = note;
+			foundState = noteState;
 		}
 	}
-	return note;
+#if DEBUG_PRINT_RENDER
+	if (found) printf("  found %p\n", found);
+#endif
+	if (outNoteState) *outNoteState = foundState;
+	return found;
 }
 
 void SynthGroupElement::NoteOn(SynthNote *note,
@@ -169,9 +194,12 @@ void SynthGroupElement::NoteOn(SynthNote *note,
 	printf("SynthGroupElement::NoteOn %d\n", inNoteID);
 #endif
 	// TODO: CONSIDER FIXING this to not need to initialize mCurrentAbsoluteFrame to -1.
-	UInt64 absoluteFrame = (mCurrentAbsoluteFrame == -1) ? inOffsetSampleFrame : mCurrentAbsoluteFrame + inOffsetSampleFrame;
+	// The offset is relative to the render cycle, not to the sub-block that was rendered last.
+	UInt64 absoluteFrame = (mCurrentAbsoluteFrame == -1) ? inOffsetSampleFrame : GetAUInstrument()->RenderCycleStartFrame() + inOffsetSampleFrame;
 	if (note->AttackNote(part, this, inNoteID, absoluteFrame, inOffsetSampleFrame, inParams)) {
+		note->mStealAmplitude = note->Amplitude();
 		mNoteList[kNoteState_Attacked].AddNote(note);
+		AddNoteID(note);
 	}
 }
 
@@ -216,6 +244,7 @@ void SynthGroupElement::NoteEnded(SynthNote *inNote, UInt32 inFrame)
 	if (inNote->IsSounding()) {
 		SynthNoteList *list = &mNoteList[inNote->GetState()];
 		list->RemoveNote(inNote);
+		RemoveNoteID(inNote);
 	}
 	
 	GetAUInstrument()->AddFreeNote(inNote);
@@ -391,29 +420,67 @@ OSStatus SynthGroupElement::Render(SInt64 inAbsoluteSampleFrame, UInt32 inNumber
 		mCurrentAbsoluteFrame = inAbsoluteSampleFrame;
 		AudioBufferList* buffArray[16];
 		UInt32 numOutputs = outputs.GetNumberOfElements();
-		for (UInt32 outBus = 0; outBus < numOutputs && outBus < 16; ++outBus)
+		if (numOutputs > 16) numOutputs = 16;
+		for (UInt32 outBus = 0; outBus < numOutputs; ++outBus)
 		{
 			buffArray[outBus] = &GetAudioUnit()->GetOutput(outBus)->GetBufferList();
 		}
 		
-		for (UInt32 i=0 ; i<kNumberOfSoundingNoteStates; ++i)
+			// notes render from the start of the buffers, so move the buffers to the sub-block
+		UInt32 subBlockOffset = (UInt32)(inAbsoluteSampleFrame - GetAUInstrument()->RenderCycleStartFrame());
+		OffsetBuffers(buffArray, numOutputs, subBlockOffset);
+		
+		OSStatus err = RenderNotes(inAbsoluteSampleFrame, inNumberFrames, buffArray, numOutputs);
+		
+		OffsetBuffers(buffArray, numOutputs, -(SInt32)subBlockOffset);
+		if (err) return err;
+	}
+	return noErr;
+}
+
+OSStatus SynthGroupElement::RenderNotes(SInt64 inAbsoluteSampleFrame, UInt32 inNumberFrames, AudioBufferList** ioBufferList, UInt32 inOutBusCount)
+{
+	for (UInt32 i=0 ; i<kNumberOfSoundingNoteStates; ++i)
+	{
+		SynthNote *note = mNoteList[i].mHead;
+		while (note)
 		{
-			SynthNote *note = mNoteList[i].mHead;
-			while (note)
-			{
 #if DEBUG_PRINT_RENDER
-				printf("SynthGroupElement::Render: state %d, note %p\n", i, note);
+			printf("SynthGroupElement::Render: state %d, note %p\n", i, note);
 #endif
-				SynthNote *nextNote = note->mNext;
-				
-				OSStatus err = note->Render(inAbsoluteSampleFrame, inNumberFrames, buffArray, numOutputs);
-				if (err) return err;
-				
-				note = nextNote;
-			}
+			SynthNote *nextNote = note->mNext;
+			
+			OSStatus err = note->Render(inAbsoluteSampleFrame, inNumberFrames, ioBufferList, inOutBusCount);
+			if (err) return err;
+			UpdateNoteAmplitude(note);
+			
+			note = nextNote;
 		}
 	}
 	return noErr;
 }
 
+void SynthGroupElement::UpdateNoteAmplitude(SynthNote *inNote)
+{
+	// rendering can end the note
+	if (inNote->IsSounding())
+		mNoteList[inNote->GetState()].UpdateAmplitude(inNote, inNote->Amplitude());
+}
+
+void SynthGroupElement::OffsetBuffers(AudioBufferList** ioBufferList, UInt32 inOutBusCount, SInt32 inFrames)
+{
+	if (inFrames == 0) return;
+	
+	for (UInt32 outBus = 0; outBus < inOutBusCount; ++outBus)
+	{
+		AudioBufferList* bufferList = ioBufferList[outBus];
+		SInt32 bytes = inFrames * (SInt32)GetAudioUnit()->GetOutput(outBus)->GetStreamFormat().mBytesPerFrame;
+		for (UInt32 k = 0; k < bufferList->mNumberBuffers; ++k)
+		{
+			bufferList->mBuffers[k].mData = (char*)bufferList->mBuffers[k].mData + bytes;
+			bufferList->mBuffers[k].mDataByteSize -= bytes;
+		}
+	}
+}
+
 
@@ -142,7 +142,11 @@ class SynthGroupElement : public SynthElement
 {
 public:
 	enum {
-		kUnassignedGroup = 0xFFFFFFFF
+		kUnassignedGroup = 0xFFFFFFFF,
+		
+		// the number of buckets in the NoteID table; a power of two. MIDI key numbers,
+		// which are used as NoteIDs when the host doesn't ask for one, get a bucket each.
+		kNoteIDTableSize = 256
 	};
 	
 	SynthGroupElement(AUInstrumentBase *audioUnit, UInt32 inElement, MIDIControlHandler *inHandler);
@@ -178,9 +182,26 @@ public:
 	MIDIControlHandler *	GetMIDIControlHandler() const { return mMidiControlHandler; }
 	
 protected:	
+		// moves the data pointers of the output buffers inFrames frames forward (or back, if negative)
+	void					OffsetBuffers(AudioBufferList** ioBufferList, UInt32 inOutBusCount, SInt32 inFrames);
+	
+		// renders the sounding notes of a sub-block into the output buffers, which Render has
+		// moved to the sub-block. This renders them list by list; override it to render them
+		// in another order.
+	virtual OSStatus		RenderNotes(SInt64 inAbsoluteSampleFrame, UInt32 inNumberFrames, AudioBufferList** ioBufferList, UInt32 inOutBusCount);
+	
 	SInt64					mCurrentAbsoluteFrame;
 	SynthNoteList 			mNoteList[kNumberOfSoundingNoteStates];
 	MIDIControlHandler		*mMidiControlHandler;
+	
+		// indexes the sounding notes by NoteID, so that GetNote doesn't have to search the note lists
+	void					AddNoteID(SynthNote *inNote);
+	void					RemoveNoteID(SynthNote *inNote);
+	
+	SynthNote				*mNotesByID[kNoteIDTableSize];
+	
+		// call after a note has rendered, to keep the amplitudes that voice stealing uses current
+	void					UpdateNoteAmplitude(SynthNote *inNote);
 
 private:
 	friend class AUInstrumentBase;
@@ -0,0 +1,24 @@
+/*
+ *  SynthEventQueueSize.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __SynthEventQueueSize_h__
+#define __SynthEventQueueSize_h__
+
+#include <stdint.h>
+
+// The size of the event queue of AUInstrumentBase, apart from the rest of it so
+// that fifo_bench can check the queue at the same size.
+//
+// The number of events that the queue has room for up front. A burst that
+// doesn't fit, like the ones that sequencers send at transport start, makes it
+// grow on the thread that sends it, up to kMaxEventQueueSize events; only the
+// events past that are dropped.
+static const uint32_t kEventQueueSize = 8192;
+static const uint32_t kMaxEventQueueSize = 65536;
+
+#endif
@@ -97,7 +97,8 @@ class AUInstrumentBase;
 struct SynthNote
 {
 	SynthNote() :
-		mPrev(0), mNext(0), mPart(0), mGroup(0),
+		mPrev(0), mNext(0), mIDPrev(0), mIDNext(0), mQuietPrev(0), mQuietNext(0),
+		mStealAmplitude(0.0f), mQuietBucket(0), mPart(0), mGroup(0),
 		mNoteID(0xffffffff),
 		mState(kNoteState_Unset),
 		mAbsoluteStartFrame(0),
@@ -151,7 +152,7 @@ struct SynthNote
 	SInt32					GetRelativeReleaseFrame() const { return mRelativeReleaseFrame; }
 	SInt32					GetRelativeKillFrame() const { return mRelativeKillFrame; }
 
-	void					ListRemove() { mPrev = mNext = 0; } // only use when lists will be reset.
+	void					ListRemove() { mPrev = mNext = mQuietPrev = mQuietNext = 0; } // only use when lists will be reset.
 
 	float					GetPitchBend() const;
 	double					TuningA() const;
@@ -163,6 +164,19 @@ struct SynthNote
 	SynthNote				*mPrev;
 	SynthNote				*mNext;
 	
+	// pointers for the chain of sounding notes whose IDs hash to the same bucket
+	// of the group's NoteID table
+	SynthNote				*mIDPrev;
+	SynthNote				*mIDNext;
+	
+	// pointers for the chain of notes in the same amplitude bucket of the note list,
+	// and the amplitude that the note was filed under. The amplitude is updated
+	// once per render cycle, so voice stealing doesn't have to call Amplitude().
+	SynthNote				*mQuietPrev;
+	SynthNote				*mQuietNext;
+	Float32					mStealAmplitude;
+	UInt32					mQuietBucket;
+	
 	friend class			SynthGroupElement;
 	friend struct			SynthNoteList;
 protected:
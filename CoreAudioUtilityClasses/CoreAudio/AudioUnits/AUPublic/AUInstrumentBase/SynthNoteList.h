@@ -48,6 +48,7 @@
 #define __SynthNoteList__
 
 #include "SynthNote.h"
+#include <string.h>
 
 #if DEBUG
 #ifndef DEBUG_PRINT
@@ -60,7 +61,16 @@
 
 struct SynthNoteList
 {
-	SynthNoteList() : mState(kNoteState_Unset), mHead(0), mTail(0) {}
+	enum {
+		// Notes are also filed by amplitude, in quarter octave buckets from about -96 dB
+		// up to 0 dB, so that the quietest note can be found without visiting every note.
+		kNumQuietBuckets = 64
+	};
+	
+	SynthNoteList() : mState(kNoteState_Unset), mHead(0), mTail(0), mOccupiedQuietBuckets(0)
+	{
+		memset(mQuietBuckets, 0, sizeof(mQuietBuckets));
+	}
 	
 	bool NotEmpty() const { return mHead != NULL; }
 	bool IsEmpty() const { return mHead == NULL; }
@@ -69,6 +79,8 @@ struct SynthNoteList
 		SanityCheck();
 #endif
 		mHead = mTail = NULL; 
+		memset(mQuietBuckets, 0, sizeof(mQuietBuckets));
+		mOccupiedQuietBuckets = 0;
 	}
 	
 	UInt32 Length() const {
@@ -95,6 +107,7 @@ struct SynthNoteList
 		
 		if (mHead) { mHead->mPrev = inNote; mHead = inNote; }
 		else mHead = mTail = inNote;
+		AddQuietNote(inNote);
 #if USE_SANITY_CHECK
 		SanityCheck();
 #endif
@@ -116,6 +129,7 @@ struct SynthNoteList
 		
 		inNote->mPrev = 0;
 		inNote->mNext = 0;
+		RemoveQuietNote(inNote);
 #if USE_SANITY_CHECK
 		SanityCheck();
 #endif
@@ -141,6 +155,7 @@ struct SynthNoteList
 #endif
 				note->Release(inFrame);
 				note->SetState(mState);
+				AddQuietNote(note);
 			}
 		}
 		else
@@ -148,8 +163,11 @@ struct SynthNoteList
 			for (SynthNote* note = inNoteList->mHead; note; note = note->mNext)
 			{
 				note->SetState(mState);
+				AddQuietNote(note);
 			}
 		}
+		memset(inNoteList->mQuietBuckets, 0, sizeof(inNoteList->mQuietBuckets));
+		inNoteList->mOccupiedQuietBuckets = 0;
 		
 		inNoteList->mTail->mNext = mHead;
 		
@@ -187,17 +205,33 @@ struct SynthNoteList
 		return oldestNote;
 	}
 	
+	// Files the note under a new amplitude. Call this when the note has rendered, so
+	// that FindMostQuietNote sees current amplitudes.
+	void UpdateAmplitude(SynthNote *inNote, Float32 inAmplitude)
+	{
+		inNote->mStealAmplitude = inAmplitude;
+		if (QuietBucket(inAmplitude) != inNote->mQuietBucket)
+		{
+			RemoveQuietNote(inNote);
+			AddQuietNote(inNote);
+		}
+	}
+	
+	// Returns the note with the lowest amplitude, as of its last update, and the earliest
+	// start time among those. Only the notes in the lowest occupied bucket are compared.
 	SynthNote* FindMostQuietNote()
 	{
 #if DEBUG_PRINT
 		printf("FindMostQuietNote\n");
 #endif
+		if (!mOccupiedQuietBuckets) return NULL;
+		
 		Float32 minAmplitude = 1e9f;
 		UInt64 minStartFrame = -1;
 		SynthNote* mostQuietNote = NULL;
-		for (SynthNote* note = mHead; note; note = note->mNext)
+		for (SynthNote* note = mQuietBuckets[LowestBit(mOccupiedQuietBuckets)]; note; note = note->mQuietNext)
 		{
-			Float32 amp = note->Amplitude();
+			Float32 amp = note->mStealAmplitude;
 #if DEBUG_PRINT
 			printf("   amp %g   minAmplitude %g\n", amp, minAmplitude);
 #endif
@@ -225,6 +259,59 @@ struct SynthNoteList
 	SynthNoteState	mState;
 	SynthNote *		mHead;
 	SynthNote *		mTail;
+	
+private:
+	// Maps an amplitude to a bucket such that louder notes never get lower buckets. The bit
+	// pattern of a positive float orders like the float, and its top bits hold the exponent
+	// and the first two bits of the mantissa, which gives quarter octave steps.
+	static UInt32 QuietBucket(Float32 inAmplitude)
+	{
+		if (!(inAmplitude > 0.0f)) return 0;
+		union { Float32 f; UInt32 i; } bits;
+		bits.f = inAmplitude;
+		SInt32 bucket = (SInt32)(bits.i >> 21) - ((127 - 16) << 2);	// 1.0 lands in the top bucket
+		if (bucket < 0) return 0;
+		if (bucket >= kNumQuietBuckets) return kNumQuietBuckets - 1;
+		return (UInt32)bucket;
+	}
+	
+	static UInt32 LowestBit(UInt64 inBits)
+	{
+#if defined(__GNUC__)
+		return (UInt32)__builtin_ctzll(inBits);
+#else
+		UInt32 bit = 0;
+		while (!(inBits & 1)) { inBits >>= 1; ++bit; }
+		return bit;
+#endif
+	}
+	
+	void AddQuietNote(SynthNote *inNote)
+	{
+		UInt32 bucket = QuietBucket(inNote->mStealAmplitude);
+		inNote->mQuietBucket = bucket;
+		inNote->mQuietPrev = NULL;
+		inNote->mQuietNext = mQuietBuckets[bucket];
+		if (mQuietBuckets[bucket]) mQuietBuckets[bucket]->mQuietPrev = inNote;
+		mQuietBuckets[bucket] = inNote;
+		mOccupiedQuietBuckets |= 1ULL << bucket;
+	}
+	
+	void RemoveQuietNote(SynthNote *inNote)
+	{
+		UInt32 bucket = inNote->mQuietBucket;
+		if (inNote->mQuietPrev) inNote->mQuietPrev->mQuietNext = inNote->mQuietNext;
+		else mQuietBuckets[bucket] = inNote->mQuietNext;
+		
+		if (inNote->mQuietNext) inNote->mQuietNext->mQuietPrev = inNote->mQuietPrev;
+		if (!mQuietBuckets[bucket]) mOccupiedQuietBuckets &= ~(1ULL << bucket);
+		
+		inNote->mQuietPrev = 0;
+		inNote->mQuietNext = 0;
+	}
+	
+	SynthNote *		mQuietBuckets[kNumQuietBuckets];
+	UInt64			mOccupiedQuietBuckets;
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,25 @@
+/*
+ *  HSCacheLine.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSCacheLine_h__
+#define __HSCacheLine_h__
+
+#include <stddef.h>
+
+static const size_t kCacheLineSize = 64;
+
+// Keeps data that different threads write off each other's cache lines: a
+// member between two of these is on cache lines of its own. It is padding
+// rather than alignas, since new doesn't honor the alignment of a type before
+// C++17, and the objects that use it are allocated with new. Padding a full
+// line on each side works wherever the object starts.
+struct HSCacheLinePad {
+    char bytes[kCacheLineSize];
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ *  HSEngine.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSEngine.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#include "HSLog.h"
+#include "HSWavetable.h"
+
+HSEngine::HSEngine(double sample_rate_, int polyphony_, uint32_t max_frames_, HSWavetable* shared_wavetable) {
+    sample_rate = sample_rate_;
+    polyphony = polyphony_ < 1 ? 1 : polyphony_ > kMaxPolyphony ? kMaxPolyphony : polyphony_;
+    max_frames = max_frames_ < 1 ? 1 : max_frames_;
+
+    memset(&params, 0, sizeof(params));
+    params.setDefaults();
+    wavetable_params_changed = false;
+    wavetable = shared_wavetable;
+    owns_wavetable = !shared_wavetable;
+
+    num_slots = polyphony + kNumFastReleaseNotes;
+    slots = new Slot[num_slots];
+    for (int i=0; i<num_slots; i++) {
+        slots[i].active = false;
+    }
+    render_order = new Slot*[num_slots];
+    memory.add(kMemory_Voices, (sizeof(Slot)+sizeof(Slot*))*num_slots);
+
+    seed = 1;
+    random.seed(seed);
+    pitch_bend = 0;
+    sustain = false;
+
+    sample_time = 0;
+    mono_bus = (float*) memory.allocate(kMemory_Voices, sizeof(float)*max_frames);
+    side_bus = (float*) memory.allocate(kMemory_Voices, sizeof(float)*max_frames);
+    bus.mono = mono_bus;
+    bus.side = 0;
+    bus.frames_written = 0;
+    stereo_width = params.values[kParameter_StereoWidth];
+}
+
+HSEngine::~HSEngine() {
+    if (owns_wavetable) delete wavetable;
+    delete [] slots;
+    delete [] render_order;
+    memory.remove(kMemory_Voices, (sizeof(Slot)+sizeof(Slot*))*num_slots);
+    memory.release(mono_bus);
+    memory.release(side_bus);
+}
+
+void HSEngine::getMemoryStats(HSMemoryStats* out) const {
+    memory.read(out);
+    if (wavetable && owns_wavetable) {
+        HSMemoryStats tables;
+        wavetable->getMemory().read(&tables);
+        addMemoryStats(out, tables);
+    }
+}
+
+void HSEngine::setSeed(uint32_t seed_) {
+    seed = seed_;
+    random.seed(seed);
+}
+
+void HSEngine::setParameter(int id, float value) {
+    if (id < 0 || id >= kNumberOfParameters) return;
+    if (params.values[id] == value) return;
+
+    params.values[id] = value;
+    for (int i=0; i<kNumParametersThatAreRelevantToWavetable; i++) {
+        if (kParametersThatAreRelevantToWavetable[i] != id) continue;
+        wavetable_params_changed = true;
+        // The next render cycle requests the new tables
+        if (wavetable && owns_wavetable) wavetable->getTrace().parameterChanged();
+    }
+}
+
+void HSEngine::noteOn(int key, int velocity, uint32_t offset) {
+    pushEvent(kEvent_NoteOn, offset, key, velocity, 0);
+}
+
+void HSEngine::noteOff(int key, uint32_t offset) {
+    pushEvent(kEvent_NoteOff, offset, key, 0, 0);
+}
+
+void HSEngine::setPitchBend(float semitones, uint32_t offset) {
+    pushEvent(kEvent_PitchBend, offset, 0, 0, semitones);
+}
+
+void HSEngine::setSustain(bool on, uint32_t offset) {
+    pushEvent(kEvent_Sustain, offset, 0, 0, on ? 1 : 0);
+}
+
+void HSEngine::pushEvent(EventType type, uint32_t offset, int key, int velocity, float value) {
+    Event event;
+    event.offset = offset;
+    event.type = type;
+    event.key = key;
+    event.velocity = velocity;
+    event.value = value;
+    events.push_back(event);
+}
+
+int HSEngine::getNumSoundingVoices() const {
+    int count = 0;
+    for (int i=0; i<num_slots; i++) {
+        if (slots[i].active) count++;
+    }
+    return count;
+}
+
+void HSEngine::render(float* left, float* right, uint32_t num_frames) {
+    while (num_frames > 0) {
+        uint32_t cycle_frames = num_frames < max_frames ? num_frames : max_frames;
+        renderCycle(left, right, cycle_frames);
+        left += cycle_frames;
+        if (right) right += cycle_frames;
+        num_frames -= cycle_frames;
+    }
+}
+
+// The clock that render cycles are timed with, in seconds
+static inline double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void HSEngine::renderCycle(float* left, float* right, uint32_t num_frames) {
+    double start_time = now();
+    if (!wavetable) {
+        wavetable = new HSWavetable(kNumWavetables,
+                                    sample_rate,
+                                    kNumSamplesPerWavetable,
+                                    params.values[kParameter_HarmonicBandwidth],
+                                    params.values[kParameter_HarmonicProfile], // Harmonic bandwidth scale
+                                    params.values[kParameter_HarmonicsAmount],
+                                    params.values[kParameter_HarmonicsCurveSteepness],
+                                    params.values[kParameter_HarmonicsBalance],
+                                    kHarmonicsCompensation,
+                                    seed);
+        wavetable_params_changed = false;
+    }
+    else if (wavetable_params_changed && owns_wavetable) {
+        wavetable->generateWavetables(params.values[kParameter_HarmonicBandwidth],
+                                      params.values[kParameter_HarmonicProfile], // Harmonic bandwidth scale
+                                      params.values[kParameter_HarmonicsAmount],
+                                      params.values[kParameter_HarmonicsCurveSteepness],
+                                      params.values[kParameter_HarmonicsBalance],
+                                      kHarmonicsCompensation);
+        wavetable_params_changed = false;
+    }
+
+    float start_width = stereo_width;
+    params.derive(sample_rate, right ? 2 : 1);
+    stereo_width = params.stereo_width;
+    bus.side = start_width > 0 || stereo_width > 0 ? side_bus : 0;
+    bus.frames_written = 0;
+
+    // Events at the same offset keep the order that they were queued in
+    std::stable_sort(events.begin(), events.end());
+    size_t next_event = 0;
+
+    // Render up to the next event, perform the events at that offset and
+    // continue from there
+    uint32_t frame = 0;
+    while (frame < num_frames) {
+        while (next_event < events.size() && events[next_event].offset <= frame) {
+            performEvent(events[next_event++]);
+        }
+        uint32_t end_frame = num_frames;
+        if (next_event < events.size() && events[next_event].offset < num_frames) {
+            end_frame = events[next_event].offset;
+        }
+
+        // Render the voices ordered by the wavetable that they read, so that
+        // voices that share a table are rendered after each other
+        int num_voices = 0;
+        for (int i=0; i<num_slots; i++) {
+            if (!slots[i].active) continue;
+            int pos = num_voices++;
+            while (pos > 0 && render_order[pos-1]->voice.getWavetableIndex() > slots[i].voice.getWavetableIndex()) {
+                render_order[pos] = render_order[pos-1];
+                pos--;
+            }
+            render_order[pos] = &slots[i];
+        }
+
+        double voices_start_time = now();
+        wavetable->lockWavetables();
+        for (int i=0; i<num_voices; i++) {
+            Slot* slot = render_order[i];
+            uint32_t ended = slot->voice.render(bus, sample_time, sample_time+frame, end_frame-frame,
+                                                slot->stage, pitch_bend, params);
+            if (ended != kVoiceNotEnded) slot->active = false;
+        }
+        wavetable->unlockWavetables();
+        render_stats.addVoices(now()-voices_start_time, num_voices, end_frame-frame);
+
+        frame = end_frame;
+    }
+
+    // Keep the events that are due in later cycles
+    events.erase(events.begin(), events.begin()+next_event);
+    for (size_t i=0; i<events.size(); i++) {
+        events[i].offset -= num_frames;
+    }
+
+    bus.spread(left, right, num_frames, start_width, stereo_width);
+    sample_time += num_frames;
+
+    double seconds = now()-start_time;
+    render_stats.endCycle(seconds, num_frames, sample_rate, 0);
+    if (seconds*sample_rate > num_frames) {
+        HS_LOG("Render cycle of %u frames missed the deadline: %.3f ms", (unsigned) num_frames, seconds*1e3);
+    }
+}
+
+void HSEngine::performEvent(const Event& event) {
+    switch (event.type) {
+        case kEvent_NoteOn:
+            startVoice(event.key, event.velocity, event.offset);
+            break;
+
+        case kEvent_NoteOff:
+            for (int i=0; i<num_slots; i++) {
+                Slot& slot = slots[i];
+                if (!slot.active || slot.key != event.key || slot.stage != kEnvelope_Held || slot.sustained) continue;
+                if (sustain) slot.sustained = true;
+                else slot.stage = kEnvelope_Released;
+            }
+            break;
+
+        case kEvent_PitchBend:
+            pitch_bend = event.value;
+            break;
+
+        case kEvent_Sustain:
+            sustain = event.value != 0;
+            if (!sustain) {
+                for (int i=0; i<num_slots; i++) {
+                    Slot& slot = slots[i];
+                    if (slot.active && slot.sustained) {
+                        slot.stage = kEnvelope_Released;
+                        slot.sustained = false;
+                    }
+                }
+            }
+            break;
+    }
+}
+
+void HSEngine::startVoice(int key, int velocity, uint32_t offset) {
+    // A key that is played again releases the voice that it played before
+    for (int i=0; i<num_slots; i++) {
+        Slot& slot = slots[i];
+        if (slot.active && slot.key == key && slot.stage == kEnvelope_Held) {
+            slot.stage = kEnvelope_Released;
+            slot.sustained = false;
+        }
+    }
+
+    int num_playing = 0;
+    for (int i=0; i<num_slots; i++) {
+        if (slots[i].active && slots[i].stage != kEnvelope_FastReleased) num_playing++;
+    }
+    if (num_playing >= polyphony) fastReleaseQuietest();
+
+    // Take a free voice, or else the quietest of the fast released ones. That
+    // one was counted as stolen when it was fast released.
+    Slot* slot = 0;
+    for (int i=0; i<num_slots && !slot; i++) {
+        if (!slots[i].active) slot = &slots[i];
+    }
+    if (!slot) {
+        for (int i=0; i<num_slots; i++) {
+            if (slots[i].stage != kEnvelope_FastReleased) continue;
+            if (!slot || slots[i].voice.getAmplitude() < slot->voice.getAmplitude()) slot = &slots[i];
+        }
+        if (!slot) return;
+    }
+
+    // The offset of the event is relative to the cycle that it is performed in
+    double frequency = 440.0*pow(2., (key-69)/12.);
+    slot->voice.start(wavetable, params, sample_rate, frequency, velocity, pitch_bend, offset, random);
+    slot->key = key;
+    slot->stage = kEnvelope_Held;
+    slot->active = true;
+    slot->sustained = false;
+}
+
+void HSEngine::fastReleaseQuietest() {
+    Slot* quietest = 0;
+    for (int i=0; i<num_slots; i++) {
+        Slot& slot = slots[i];
+        if (!slot.active || slot.stage == kEnvelope_FastReleased) continue;
+        if (!quietest || slot.voice.getAmplitude() < quietest->voice.getAmplitude()) quietest = &slot;
+    }
+    if (quietest) {
+        quietest->stage = kEnvelope_FastReleased;
+        quietest->sustained = false;
+        render_stats.addStolenVoice();
+        HS_LOG("Stole the voice of key %d", quietest->key);
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ *  HSEngine.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSEngine_h__
+#define __HSEngine_h__
+
+#include <stdint.h>
+#include <vector>
+#include "HSVoice.h"
+#include "HSRenderStats.h"
+#include "HSMemory.h"
+
+class HSWavetable;
+
+// Plays HSPad without a plug-in host: it keeps the voices, the wavetables and
+// the parameters, and renders the notes that it is told to play, like the
+// AudioUnit does. It is meant for rendering offline and for measuring; the
+// AudioUnit uses HSVoice directly, and leaves the voice management to
+// AUInstrumentBase.
+//
+// Events take an offset, which is the frame where they happen counted from the
+// start of the next render() call. Events can be queued any number of frames
+// ahead. None of the methods are thread safe.
+class HSEngine
+{
+public:
+    // max_frames is the most frames that a render cycle has; render() splits
+    // longer calls into several cycles.
+    //
+    // Engines on different threads can play from the same shared_wavetable,
+    // which the caller owns. The parameters that the wavetables depend on
+    // don't change a shared wavetable; it keeps the ones it was made with.
+    // The voices play at most kNumWavetables of its tables.
+    HSEngine(double sample_rate, int polyphony = kDefaultPolyphony, uint32_t max_frames = 1024,
+             HSWavetable* shared_wavetable = 0);
+    ~HSEngine();
+
+    // Parameters take effect at the start of the next render cycle. The
+    // wavetables are generated when the engine first renders. After that,
+    // changing a parameter that they depend on regenerates them on the
+    // generator thread of HSWavetable, and the old tables play until the new
+    // ones are done.
+    void setParameter(int id, float value);
+    float getParameter(int id) const { return params.values[id]; }
+    // Seeds the random phases of the voices, and of the wavetables if the
+    // engine hasn't made them yet; the seed is 1 by default. The engine renders
+    // the same notes the same way every time for a given seed.
+    void setSeed(uint32_t seed);
+
+    void noteOn(int key, int velocity, uint32_t offset = 0);
+    void noteOff(int key, uint32_t offset = 0);
+    // In semitones
+    void setPitchBend(float semitones, uint32_t offset = 0);
+    void setSustain(bool on, uint32_t offset = 0);
+
+    // Renders num_frames frames. right is NULL for mono output.
+    void render(float* left, float* right, uint32_t num_frames);
+
+    int getNumSoundingVoices() const;
+    double getSampleRate() const { return sample_rate; }
+    // The sample time of the next frame that will be rendered
+    int64_t getSampleTime() const { return sample_time; }
+    // NULL before the first render, unless the wavetable is shared
+    HSWavetable* getWavetable() { return wavetable; }
+    // Times each render cycle like the AudioUnit does. Events are never
+    // dropped, since the queue grows as needed. Unlike the rest of the engine,
+    // the statistics can be read and reset from other threads.
+    HSRenderStats& getRenderStats() { return render_stats; }
+    // The memory of the voices and buses, and of the wavetables unless they
+    // are shared, like the AudioUnit counts it. The event queue isn't counted.
+    void getMemoryStats(HSMemoryStats* out) const;
+
+private:
+    enum EventType { kEvent_NoteOn, kEvent_NoteOff, kEvent_PitchBend, kEvent_Sustain };
+
+    struct Event {
+        uint32_t offset;
+        EventType type;
+        int key;
+        int velocity;
+        float value;
+
+        bool operator<(const Event& other) const { return offset < other.offset; }
+    };
+
+    struct Slot {
+        HSVoice voice;
+        int key;
+        HSEnvelopeStage stage;
+        bool active;
+        bool sustained;  // Released while the sustain pedal was down
+    };
+
+    void renderCycle(float* left, float* right, uint32_t num_frames);
+    void performEvent(const Event& event);
+    void startVoice(int key, int velocity, uint32_t offset);
+    // Fast releases the quietest voice that isn't fast released already
+    void fastReleaseQuietest();
+    void pushEvent(EventType type, uint32_t offset, int key, int velocity, float value);
+
+    double sample_rate;
+    int polyphony;
+    uint32_t max_frames;
+
+    HSParameters params;
+    bool wavetable_params_changed;
+    HSWavetable* wavetable;
+    bool owns_wavetable;
+
+    int num_slots;
+    Slot* slots;
+    Slot** render_order;
+
+    std::vector<Event> events;
+    // The phases of the voices come from here, so that the same notes render
+    // the same every time
+    HSRandom random;
+    uint32_t seed;
+    float pitch_bend;
+    bool sustain;
+
+    int64_t sample_time;
+    float* mono_bus;
+    float* side_bus;
+    HSBus bus;
+    float stereo_width;  // The width that the previous render cycle ended with
+
+    HSRenderStats render_stats;
+    HSMemoryAccount memory;
+};
+
+#endif
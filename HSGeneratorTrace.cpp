@@ -0,0 +1,228 @@
+/*
+ *  HSGeneratorTrace.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSGeneratorTrace.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#include "HSJSON.h"
+
+static const char* const kStageNames[kNumGeneratorStages] = {
+    "listener delay",
+    "queue wait",
+    "generate",
+    "synth",
+    "highest partial",
+    "swap wait",
+    "swap"
+};
+
+// The Chrome trace process and thread that the generator thread's work shows
+// up on. The stages before it are async events, which get a track per job.
+static const int kTracePid = 1;
+static const int kTraceGeneratorTid = 1;
+
+uint64_t hsTraceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double seconds(uint64_t begin, uint64_t end) {
+    return end > begin ? (end-begin)*1e-9 : 0;
+}
+
+HSGeneratorTrace::HSGeneratorTrace() : first_change(0) {
+    origin = hsTraceNow();
+    next_job = 1;
+    jobs_requested = 0;
+    jobs_completed = 0;
+    jobs_superseded = 0;
+    events.resize(kGeneratorTraceEvents);
+    num_events = 0;
+    samples.resize(kGeneratorLatencySamples);
+    num_samples = 0;
+}
+
+void HSGeneratorTrace::parameterChanged() {
+    uint64_t expected = 0;
+    first_change.compare_exchange_strong(expected, hsTraceNow(), std::memory_order_relaxed);
+}
+
+void HSGeneratorTrace::beginJob(HSGeneratorJob* job) {
+    uint64_t now = hsTraceNow();
+    uint64_t changed = first_change.exchange(0, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    job->id = next_job++;
+    // Requests that no parameter change was reported for have no delay
+    job->changed = changed && changed <= now ? changed : now;
+    job->requested = now;
+    job->taken = job->generated = job->locked = job->swapped = 0;
+    jobs_requested++;
+}
+
+void HSGeneratorTrace::add(const Event& event) {
+    events[num_events % events.size()] = event;
+    num_events++;
+}
+
+void HSGeneratorTrace::addEvent(uint64_t job, HSGeneratorStage stage, int table, uint64_t begin, uint64_t end) {
+    Event event = { job, begin, end, (int16_t) table, (uint8_t) stage, false };
+    std::lock_guard<std::mutex> lock(mutex);
+    add(event);
+}
+
+void HSGeneratorTrace::jobSuperseded(const HSGeneratorJob& job) {
+    uint64_t now = hsTraceNow();
+    Event listener = { job.id, job.changed, job.requested, -1, kStage_ListenerDelay, true };
+    Event queue = { job.id, job.requested, now, -1, kStage_QueueWait, true };
+
+    std::lock_guard<std::mutex> lock(mutex);
+    add(listener);
+    add(queue);
+    jobs_superseded++;
+}
+
+void HSGeneratorTrace::jobCompleted(const HSGeneratorJob& job) {
+    // The per table stages were added as they happened, during generate
+    Event stages[] = {
+        { job.id, job.changed, job.requested, -1, kStage_ListenerDelay, false },
+        { job.id, job.requested, job.taken, -1, kStage_QueueWait, false },
+        { job.id, job.taken, job.generated, -1, kStage_Generate, false },
+        { job.id, job.generated, job.locked, -1, kStage_SwapWait, false },
+        { job.id, job.locked, job.swapped, -1, kStage_Swap, false }
+    };
+    Sample sample;
+    sample.listener_delay = seconds(job.changed, job.requested);
+    sample.queue_wait = seconds(job.requested, job.taken);
+    sample.generate = seconds(job.taken, job.generated);
+    sample.swap = seconds(job.generated, job.swapped);
+    sample.end_to_end = seconds(job.changed, job.swapped);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i=0; i<sizeof(stages)/sizeof(stages[0]); i++) add(stages[i]);
+    samples[num_samples % samples.size()] = sample;
+    num_samples++;
+    jobs_completed++;
+}
+
+static HSGeneratorLatency latency(std::vector<double>& values) {
+    HSGeneratorLatency result = { 0, 0, 0 };
+    if (values.empty()) return result;
+    std::sort(values.begin(), values.end());
+    // Nearest rank
+    size_t n = values.size();
+    result.p50 = values[(size_t) ceil(0.5*n)-1];
+    result.p99 = values[(size_t) ceil(0.99*n)-1];
+    result.max = values[n-1];
+    return result;
+}
+
+void HSGeneratorTrace::getStats(HSGeneratorStats* stats) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats->jobs_requested = jobs_requested;
+    stats->jobs_completed = jobs_completed;
+    stats->jobs_superseded = jobs_superseded;
+
+    size_t n = std::min(num_samples, samples.size());
+    std::vector<double> values(n);
+    double Sample::* fields[] = { &Sample::listener_delay, &Sample::queue_wait, &Sample::generate,
+                                  &Sample::swap, &Sample::end_to_end };
+    HSGeneratorLatency* results[] = { &stats->listener_delay, &stats->queue_wait, &stats->generate,
+                                      &stats->swap, &stats->end_to_end };
+    for (int field=0; field<5; field++) {
+        for (size_t i=0; i<n; i++) values[i] = samples[i].*fields[field];
+        *results[field] = latency(values);
+    }
+}
+
+static void writeLatency(FILE* f, const char* pad, const char* name, const HSGeneratorLatency& latency, bool last) {
+    fprintf(f, "%s\"%s_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+            pad, name, latency.p50*1e3, latency.p99*1e3, latency.max*1e3, last ? "" : ",");
+}
+
+void writeGeneratorStatsJSON(FILE* f, const HSGeneratorStats& stats, int indent) {
+    HSJSONIndent json(indent);
+    const char* pad = json.members();
+
+    fprintf(f, "{\n");
+    fprintf(f, "%s\"jobs_requested\": %llu,\n", pad, (unsigned long long) stats.jobs_requested);
+    fprintf(f, "%s\"jobs_completed\": %llu,\n", pad, (unsigned long long) stats.jobs_completed);
+    fprintf(f, "%s\"jobs_superseded\": %llu,\n", pad, (unsigned long long) stats.jobs_superseded);
+    writeLatency(f, pad, "listener_delay", stats.listener_delay, false);
+    writeLatency(f, pad, "queue_wait", stats.queue_wait, false);
+    writeLatency(f, pad, "generate", stats.generate, false);
+    writeLatency(f, pad, "swap", stats.swap, false);
+    writeLatency(f, pad, "end_to_end", stats.end_to_end, true);
+    fprintf(f, "%s}", json.brace());
+}
+
+static void append(std::string* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(std::string* out, const char* format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (n > 0) out->append(buf, std::min((size_t) n, sizeof(buf)-1));
+}
+
+std::string HSGeneratorTrace::chromeTraceJSON() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string json = "{\"traceEvents\": [\n";
+    append(&json, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"HSPad wavetables\"}},\n",
+           kTracePid);
+    append(&json, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"generator thread\"}}",
+           kTracePid, kTraceGeneratorTid);
+
+    size_t first = num_events > events.size() ? num_events-events.size() : 0;
+    for (size_t i=first; i<num_events; i++) {
+        const Event& e = events[i % events.size()];
+        double begin = ((int64_t) (e.begin-origin))/1e3;
+        double end = ((int64_t) (e.end-origin))/1e3;
+        const char* name = kStageNames[e.stage];
+        const char* suffix = e.superseded ? " (superseded)" : "";
+
+        if (e.stage == kStage_ListenerDelay || e.stage == kStage_QueueWait) {
+            // Before the generator thread has the job, jobs overlap, so each
+            // gets an async track
+            append(&json, ",\n{\"name\": \"%s%s\", \"cat\": \"job\", \"ph\": \"b\", \"id\": %llu, \"pid\": %d, "
+                          "\"ts\": %.3f, \"args\": {\"job\": %llu}}",
+                   name, suffix, (unsigned long long) e.job, kTracePid, begin, (unsigned long long) e.job);
+            append(&json, ",\n{\"name\": \"%s%s\", \"cat\": \"job\", \"ph\": \"e\", \"id\": %llu, \"pid\": %d, \"ts\": %.3f}",
+                   name, suffix, (unsigned long long) e.job, kTracePid, end);
+        }
+        else if (e.table >= 0) {
+            append(&json, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"args\": {\"job\": %llu, \"table\": %d}}",
+                   name, kTracePid, kTraceGeneratorTid, begin, end-begin, (unsigned long long) e.job, e.table);
+        }
+        else {
+            append(&json, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"args\": {\"job\": %llu}}",
+                   name, kTracePid, kTraceGeneratorTid, begin, end-begin, (unsigned long long) e.job);
+        }
+    }
+    json += "\n],\n\"displayTimeUnit\": \"ms\"}\n";
+    return json;
+}
+
+void HSGeneratorTrace::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs_requested = 0;
+    jobs_completed = 0;
+    jobs_superseded = 0;
+    num_events = 0;
+    num_samples = 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *  HSGeneratorTrace.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSGeneratorTrace_h__
+#define __HSGeneratorTrace_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The stages that regenerating the wavetables goes through, in order
+enum HSGeneratorStage {
+    kStage_ListenerDelay,   // From the first parameter change to the request for new tables
+    kStage_QueueWait,       // From the request until the generator thread takes it
+    kStage_Generate,        // Generating all the tables
+    kStage_Synth,           // PADsynth::synth of one table
+    kStage_HighestPartial,  // Finding the highest partial of one table
+    kStage_SwapWait,        // Waiting for the notes to let go of the old tables
+    kStage_Swap,            // Replacing the old tables with the new
+    kNumGeneratorStages
+};
+
+// The timeline of one regeneration, in nanoseconds of hsTraceNow()
+struct HSGeneratorJob {
+    uint64_t id;          // 0 for the tables that HSWavetable starts with
+    uint64_t changed;     // The first parameter change that the job picks up
+    uint64_t requested;
+    uint64_t taken;       // By the generator thread
+    uint64_t generated;
+    uint64_t locked;      // The generator thread got the write lock
+    uint64_t swapped;
+};
+
+// In seconds, over the most recent jobs
+struct HSGeneratorLatency {
+    double p50;
+    double p99;
+    double max;
+};
+
+// The value of kHSPadProperty_GeneratorStats
+struct HSGeneratorStats {
+    uint64_t jobs_requested;
+    uint64_t jobs_completed;
+    // Jobs that were replaced by a newer request before the generator thread
+    // took them
+    uint64_t jobs_superseded;
+
+    // Of the last kGeneratorLatencySamples completed jobs
+    HSGeneratorLatency listener_delay;
+    HSGeneratorLatency queue_wait;
+    HSGeneratorLatency generate;
+    HSGeneratorLatency swap;         // Waiting for the lock and swapping
+    HSGeneratorLatency end_to_end;   // From the parameter change to the swap
+};
+
+static const int kGeneratorLatencySamples = 1024;
+// The most events that the trace keeps; older ones are dropped. A job with the
+// default number of tables makes about 25.
+static const int kGeneratorTraceEvents = 16384;
+
+// The clock that the trace uses, in nanoseconds
+uint64_t hsTraceNow();
+
+// Writes the statistics as a JSON object, with the times in milliseconds,
+// indented like writeRenderStatsJSON.
+void writeGeneratorStatsJSON(FILE* f, const HSGeneratorStats& stats, int indent = 2);
+
+// Records when each stage of each regeneration of the wavetables happens, for
+// tuning how they are generated. HSWavetable has one; it records the stages of
+// its jobs, and the per table stages as it generates them.
+//
+// The statistics sum up the recent jobs, and the trace has the stages of each
+// job, which chromeTraceJSON() writes in the Chrome trace event format that
+// chrome://tracing and Perfetto read. Each job shows up as a track of its own
+// with the stages before the generator thread takes it, and the generator
+// thread has a track with the work it does.
+//
+// parameterChanged() doesn't lock and can be called from the render thread.
+// The other methods lock, and are called by HSWavetable and by whoever reads
+// the results.
+class HSGeneratorTrace {
+public:
+    HSGeneratorTrace();
+
+    // A parameter that the wavetables depend on changed. Only the first change
+    // since the last request counts, since that is how long the request was
+    // waited for.
+    void parameterChanged();
+
+    // Fills in the id, and the change and request times of a new job
+    void beginJob(HSGeneratorJob* job);
+    // A newer request replaced the job before the generator thread took it
+    void jobSuperseded(const HSGeneratorJob& job);
+    void jobCompleted(const HSGeneratorJob& job);
+    // A stage of one table. table is -1 for stages of all of them.
+    void addEvent(uint64_t job, HSGeneratorStage stage, int table, uint64_t begin, uint64_t end);
+
+    void getStats(HSGeneratorStats* stats);
+    std::string chromeTraceJSON();
+    // Forgets the events and the statistics
+    void reset();
+
+private:
+    struct Event {
+        uint64_t job;
+        uint64_t begin;
+        uint64_t end;
+        int16_t table;
+        uint8_t stage;
+        bool superseded;
+    };
+
+    // In seconds, like HSGeneratorStats
+    struct Sample {
+        double listener_delay;
+        double queue_wait;
+        double generate;
+        double swap;
+        double end_to_end;
+    };
+
+    void add(const Event& event);
+
+    std::atomic<uint64_t> first_change;
+    uint64_t origin;  // Trace times are relative to this
+
+    std::mutex mutex;
+    uint64_t next_job;
+    uint64_t jobs_requested;
+    uint64_t jobs_completed;
+    uint64_t jobs_superseded;
+    // Rings of the most recent ones
+    std::vector<Event> events;
+    size_t num_events;
+    std::vector<Sample> samples;
+    size_t num_samples;
+};
+
+#endif
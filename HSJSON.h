@@ -0,0 +1,36 @@
+/*
+ *  HSJSON.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSJSON_h__
+#define __HSJSON_h__
+
+#include <string.h>
+
+// The indentation of a JSON object that the statistics writers nest in other
+// JSON. The members are indented by indent spaces, and the closing brace by
+// two less. The brace isn't followed by a newline, so that the object can be
+// the value of a member.
+class HSJSONIndent {
+public:
+    explicit HSJSONIndent(int indent) {
+        if (indent < 0) indent = 0;
+        if (indent > (int) sizeof(pad)-1) indent = sizeof(pad)-1;
+        memset(pad, ' ', indent);
+        pad[indent] = 0;
+        brace_offset = indent >= 2 ? 2 : indent;
+    }
+
+    const char* members() const { return pad; }
+    const char* brace() const { return pad+brace_offset; }
+
+private:
+    char pad[64];
+    int brace_offset;
+};
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ *  HSLog.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSLog.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <chrono>
+
+#include "HSGeneratorTrace.h"
+
+static_assert((kLogCapacity & (kLogCapacity-1)) == 0, "kLogCapacity must be a power of two");
+
+static HSLog shared_log;
+
+HSLog& hsLog() {
+    return shared_log;
+}
+
+HSLog::HSLog() : entries(0), write_pos(0), dropped(0), enabled(false), start_count(0), quit(false), file(0) {
+    read_pos = 0;
+    origin = 0;
+    reported_dropped = 0;
+    num_threads = 0;
+}
+
+HSLog::~HSLog() {
+    if (start_count > 0) {
+        start_count = 1;
+        stop();
+    }
+    delete [] entries;
+}
+
+bool HSLog::start(const char* path) {
+    if (start_count++ > 0) return true;
+
+    file = fopen(path, "w");
+    if (!file) {
+        start_count = 0;
+        return false;
+    }
+    // The entries are never freed while the log lives, since a thread that
+    // saw the log enabled can still be writing to them after it is stopped
+    if (!entries) {
+        entries = new Entry[kLogCapacity];
+        for (int i=0; i<kLogCapacity; i++) entries[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    origin = hsTraceNow();
+    reported_dropped = dropped.load(std::memory_order_relaxed);
+    num_threads = 0;
+
+    quit.store(false);
+    thread = std::thread(drainThread, this);
+    enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+void HSLog::stop() {
+    if (start_count == 0 || --start_count > 0) return;
+
+    enabled.store(false, std::memory_order_relaxed);
+    quit.store(true);
+    thread.join();
+    fclose(file);
+    file = 0;
+}
+
+void HSLog::writeEntry(const char* format, int num_args, const Arg* args) {
+    uint64_t pos = write_pos.load(std::memory_order_relaxed);
+    Entry* entry;
+    for (;;) {
+        entry = &entries[pos & (kLogCapacity-1)];
+        int64_t diff = (int64_t) (entry->sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (write_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0) {
+            // The drain thread hasn't read the entry from the last time around
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = write_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    entry->time = hsTraceNow();
+    entry->thread = (uint64_t) (uintptr_t) pthread_self();
+    entry->format = format;
+    entry->num_args = num_args;
+    for (int i=0; i<num_args; i++) entry->args[i] = args[i];
+    entry->sequence.store(pos+1, std::memory_order_release);
+}
+
+bool HSLog::drain() {
+    bool any = false;
+    for (;;) {
+        Entry& entry = entries[read_pos & (kLogCapacity-1)];
+        if (entry.sequence.load(std::memory_order_acquire) != read_pos+1) break;
+        format(entry);
+        entry.sequence.store(read_pos+kLogCapacity, std::memory_order_release);
+        read_pos++;
+        any = true;
+    }
+
+    uint64_t now_dropped = dropped.load(std::memory_order_relaxed);
+    if (now_dropped != reported_dropped) {
+        fprintf(file, "%10.6f     %llu messages were dropped\n", (hsTraceNow()-origin)*1e-9,
+                (unsigned long long) (now_dropped-reported_dropped));
+        reported_dropped = now_dropped;
+        any = true;
+    }
+    return any;
+}
+
+// Numbers are converted to what the format asks for, so that a format that
+// doesn't match the argument still prints something sensible
+int HSLog::formatArg(char* out, size_t size, const char* spec, char conversion, const Arg& arg) {
+    double d = arg.type == kArg_Double ? arg.d : arg.type == kArg_Signed ? (double) arg.i : (double) arg.u;
+    long long i = arg.type == kArg_Double ? (long long) arg.d : arg.type == kArg_Signed ? arg.i : (long long) arg.u;
+    bool number = arg.type == kArg_Signed || arg.type == kArg_Unsigned || arg.type == kArg_Double;
+    char f[32];
+    switch (conversion) {
+        case 'd': case 'i':
+            if (!number) break;
+            snprintf(f, sizeof(f), "%%%slld", spec);
+            return snprintf(out, size, f, i);
+        case 'u': case 'x': case 'X': case 'o':
+            if (!number) break;
+            snprintf(f, sizeof(f), "%%%sll%c", spec, conversion);
+            return snprintf(out, size, f, (unsigned long long) i);
+        case 'c':
+            if (!number) break;
+            snprintf(f, sizeof(f), "%%%sc", spec);
+            return snprintf(out, size, f, (int) i);
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (!number) break;
+            snprintf(f, sizeof(f), "%%%s%c", spec, conversion);
+            return snprintf(out, size, f, d);
+        case 's':
+            if (arg.type != kArg_String || !arg.s) break;
+            snprintf(f, sizeof(f), "%%%ss", spec);
+            return snprintf(out, size, f, arg.s);
+        case 'p':
+            if (arg.type != kArg_Pointer && arg.type != kArg_String) break;
+            return snprintf(out, size, "%p", arg.p);
+    }
+    return snprintf(out, size, "(?)");
+}
+
+void HSLog::format(const Entry& entry) {
+    int thread = 0;
+    for (int i=0; i<num_threads && !thread; i++) {
+        if (threads[i] == entry.thread) thread = i+1;
+    }
+    if (!thread && num_threads < (int) (sizeof(threads)/sizeof(threads[0]))) {
+        threads[num_threads++] = entry.thread;
+        thread = num_threads;
+    }
+
+    char line[1024];
+    size_t length = snprintf(line, sizeof(line), "%10.6f T%-3d ", ((int64_t) (entry.time-origin))*1e-9, thread);
+    int next_arg = 0;
+    for (const char* c = entry.format; *c && length < sizeof(line)-1; c++) {
+        if (*c != '%') {
+            line[length++] = *c;
+            continue;
+        }
+        if (c[1] == '%') {
+            line[length++] = '%';
+            c++;
+            continue;
+        }
+
+        // Flags, width and precision are kept; length modifiers are replaced
+        // with the type that the argument was stored as
+        char spec[16];
+        size_t spec_length = 0;
+        c++;
+        while (*c && strchr("-+ #0123456789.", *c)) {
+            if (spec_length < sizeof(spec)-1) spec[spec_length++] = *c;
+            c++;
+        }
+        spec[spec_length] = 0;
+        while (*c && strchr("hlLqjzt", *c)) c++;
+        if (!*c) break;
+
+        int n;
+        if (next_arg >= entry.num_args) n = snprintf(line+length, sizeof(line)-length, "(?)");
+        else n = formatArg(line+length, sizeof(line)-length, spec, *c, entry.args[next_arg++]);
+        if (n > 0) length += n;
+        if (length > sizeof(line)-1) length = sizeof(line)-1;
+    }
+    line[length] = 0;
+    fprintf(file, "%s\n", line);
+}
+
+void HSLog::drainThread(HSLog* log) {
+    while (!log->quit.load()) {
+        if (log->drain()) fflush(log->file);
+        std::this_thread::sleep_for(std::chrono::milliseconds(kLogDrainMilliseconds));
+    }
+    // What was logged before stop()
+    log->drain();
+    fflush(log->file);
+}
@@ -0,0 +1,153 @@
+/*
+ *  HSLog.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSLog_h__
+#define __HSLog_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <type_traits>
+#include <atomic>
+#include <thread>
+#include "HSCacheLine.h"
+
+// The most arguments that a message can have
+static const int kMaxLogArgs = 6;
+// The messages that fit in the ring; more are dropped until the drain thread
+// catches up. A power of two.
+static const int kLogCapacity = 4096;
+// How often the drain thread writes out what has been logged
+static const int kLogDrainMilliseconds = 20;
+
+// A log that the render and generator threads can write to without blocking.
+//
+// Messages are kept in binary form in a ring of fixed size entries: the
+// format string, which must be a string literal, the time, the thread and the
+// arguments as they are. Writing one takes a compare and swap to claim an
+// entry and a few stores; it doesn't lock, allocate or make system calls, and
+// if the ring is full the message is dropped and counted rather than waited
+// for. A drain thread formats the messages with printf and writes them to the
+// file every kLogDrainMilliseconds.
+//
+// The arguments can be integers, floating point numbers, pointers and string
+// literals; strings are kept as pointers, so they must outlive the drain.
+// Log with HS_LOG, which checks the arguments against the format like printf.
+//
+// Nothing is kept until start() is called, and write() is a load and a branch
+// until then, so the messages can stay in release builds.
+class HSLog {
+public:
+    HSLog();
+    ~HSLog();
+
+    // Starts writing the messages to the file, and returns false if it can't
+    // be opened. The log can be started more times than once; it stops when
+    // stop() has been called as many times.
+    bool start(const char* path);
+    void stop();
+
+    bool isEnabled() const { return enabled.load(std::memory_order_acquire); }
+    // The messages that didn't fit in the ring
+    uint64_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+    template <typename... Args>
+    void write(const char* format, Args... args) {
+        static_assert(sizeof...(Args) <= kMaxLogArgs, "Too many arguments for HSLog");
+        if (!isEnabled()) return;
+        Arg values[sizeof...(Args) + 1] = { toArg(args)... };
+        writeEntry(format, sizeof...(Args), values);
+    }
+
+private:
+    enum ArgType { kArg_Signed, kArg_Unsigned, kArg_Double, kArg_String, kArg_Pointer };
+
+    struct Arg {
+        uint8_t type;
+        union {
+            int64_t i;
+            uint64_t u;
+            double d;
+            const char* s;
+            const void* p;
+        };
+    };
+
+    // The entries are handed between the threads with a sequence number each:
+    // the entry at position pos is free to write when its sequence is pos, and
+    // written when it is pos+1
+    struct Entry {
+        std::atomic<uint64_t> sequence;
+        uint64_t time;
+        uint64_t thread;
+        const char* format;
+        int num_args;
+        Arg args[kMaxLogArgs];
+    };
+
+    template <typename T>
+    static Arg toArg(T value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_pointer<T>::value,
+                      "HSLog arguments must be numbers or pointers");
+        return toArg(value, std::integral_constant<int, std::is_floating_point<T>::value ? 0 :
+                                                        std::is_signed<T>::value ? 1 :
+                                                        std::is_pointer<T>::value ? 2 : 3>());
+    }
+    template <typename T> static Arg toArg(T value, std::integral_constant<int, 0>) {
+        Arg arg; arg.type = kArg_Double; arg.d = value; return arg;
+    }
+    template <typename T> static Arg toArg(T value, std::integral_constant<int, 1>) {
+        Arg arg; arg.type = kArg_Signed; arg.i = value; return arg;
+    }
+    template <typename T> static Arg toArg(T value, std::integral_constant<int, 2>) {
+        Arg arg; arg.type = kArg_Pointer; arg.p = value; return arg;
+    }
+    template <typename T> static Arg toArg(T value, std::integral_constant<int, 3>) {
+        Arg arg; arg.type = kArg_Unsigned; arg.u = value; return arg;
+    }
+    static Arg toArg(const char* value) {
+        Arg arg; arg.type = kArg_String; arg.s = value; return arg;
+    }
+    static Arg toArg(char* value) { return toArg((const char*) value); }
+
+    void writeEntry(const char* format, int num_args, const Arg* args);
+    // Formats and writes the messages in the ring; returns true if there were any
+    bool drain();
+    void format(const Entry& entry);
+    static int formatArg(char* out, size_t size, const char* spec, char conversion, const Arg& arg);
+    static void drainThread(HSLog* log);
+
+    Entry* entries;
+    // Written by every thread that logs, each on cache lines of its own
+    HSCacheLinePad pad;
+    std::atomic<uint64_t> write_pos;
+    HSCacheLinePad pad_dropped;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> enabled;
+    HSCacheLinePad pad_after;
+
+    // Only used by start and stop, and by the drain thread
+    int start_count;
+    std::atomic<bool> quit;
+    std::thread thread;
+    FILE* file;
+    uint64_t read_pos;
+    uint64_t origin;
+    uint64_t reported_dropped;
+    // The threads that have logged, in order, so that they can be numbered
+    uint64_t threads[64];
+    int num_threads;
+};
+
+// The log of the process, which HS_LOG writes to
+HSLog& hsLog();
+
+// Logs a message with printf formatting, if the log is started. The format
+// must be a string literal.
+#define HS_LOG(...) do { if (0) printf(__VA_ARGS__); hsLog().write(__VA_ARGS__); } while (0)
+
+#endif
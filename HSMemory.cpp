@@ -0,0 +1,115 @@
+/*
+ *  HSMemory.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSMemory.h"
+
+#include <stdlib.h>
+
+#include "HSJSON.h"
+
+// Goes in front of each allocation, so that release() knows what to count.
+// It is as large as malloc's alignment, so the memory after it stays aligned.
+union AllocationHeader {
+    struct {
+        uint64_t size;
+        uint32_t subsystem;
+    } info;
+    max_align_t align;
+};
+
+static const char* const kSubsystemNames[kNumMemorySubsystems] = {
+    "wavetables", "synth", "scratch", "voices"
+};
+
+HSMemoryAccount::HSMemoryAccount() {
+    for (int i=0; i<=kNumMemorySubsystems; i++) {
+        current[i].store(0, std::memory_order_relaxed);
+        peak[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void* HSMemoryAccount::allocate(HSMemorySubsystem subsystem, size_t size) {
+    AllocationHeader* header = (AllocationHeader*) malloc(sizeof(AllocationHeader)+size);
+    if (!header) return 0;
+    header->info.size = size;
+    header->info.subsystem = subsystem;
+    change(subsystem, size);
+    return header+1;
+}
+
+void HSMemoryAccount::release(void* ptr) {
+    if (!ptr) return;
+    AllocationHeader* header = ((AllocationHeader*) ptr)-1;
+    change((HSMemorySubsystem) header->info.subsystem, -(int64_t) header->info.size);
+    free(header);
+}
+
+void HSMemoryAccount::add(HSMemorySubsystem subsystem, size_t size) {
+    change(subsystem, size);
+}
+
+void HSMemoryAccount::remove(HSMemorySubsystem subsystem, size_t size) {
+    change(subsystem, -(int64_t) size);
+}
+
+static void raisePeak(std::atomic<int64_t>* peak, int64_t value) {
+    int64_t old_peak = peak->load(std::memory_order_relaxed);
+    while (value > old_peak && !peak->compare_exchange_weak(old_peak, value, std::memory_order_relaxed)) {}
+}
+
+void HSMemoryAccount::change(HSMemorySubsystem subsystem, int64_t size) {
+    int64_t now = current[subsystem].fetch_add(size, std::memory_order_relaxed) + size;
+    int64_t total = current[kNumMemorySubsystems].fetch_add(size, std::memory_order_relaxed) + size;
+    if (size <= 0) return;
+    raisePeak(&peak[subsystem], now);
+    raisePeak(&peak[kNumMemorySubsystems], total);
+}
+
+void HSMemoryAccount::read(HSMemoryStats* out) const {
+    HSMemoryUsage* usage[kNumMemorySubsystems+1];
+    for (int i=0; i<kNumMemorySubsystems; i++) usage[i] = &out->subsystems[i];
+    usage[kNumMemorySubsystems] = &out->total;
+
+    for (int i=0; i<=kNumMemorySubsystems; i++) {
+        int64_t now = current[i].load(std::memory_order_relaxed);
+        int64_t highest = peak[i].load(std::memory_order_relaxed);
+        usage[i]->current = now > 0 ? now : 0;
+        // The peak can be read before a concurrent allocation raises it
+        usage[i]->peak = highest > now ? highest : usage[i]->current;
+    }
+}
+
+void HSMemoryAccount::resetPeaks() {
+    for (int i=0; i<=kNumMemorySubsystems; i++) {
+        peak[i].store(current[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
+
+void addMemoryStats(HSMemoryStats* sum, const HSMemoryStats& stats) {
+    for (int i=0; i<kNumMemorySubsystems; i++) {
+        sum->subsystems[i].current += stats.subsystems[i].current;
+        sum->subsystems[i].peak += stats.subsystems[i].peak;
+    }
+    sum->total.current += stats.total.current;
+    sum->total.peak += stats.total.peak;
+}
+
+static void writeUsage(FILE* f, const char* pad, const char* name, const HSMemoryUsage& usage, bool last) {
+    fprintf(f, "%s\"%s\": {\"current\": %llu, \"peak\": %llu}%s\n", pad, name,
+            (unsigned long long) usage.current, (unsigned long long) usage.peak, last ? "" : ",");
+}
+
+void writeMemoryStatsJSON(FILE* f, const HSMemoryStats& stats, int indent) {
+    HSJSONIndent json(indent);
+    const char* pad = json.members();
+
+    fprintf(f, "{\n");
+    for (int i=0; i<kNumMemorySubsystems; i++) writeUsage(f, pad, kSubsystemNames[i], stats.subsystems[i], false);
+    writeUsage(f, pad, "total", stats.total, true);
+    fprintf(f, "%s}", json.brace());
+}
@@ -0,0 +1,82 @@
+/*
+ *  HSMemory.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSMemory_h__
+#define __HSMemory_h__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// What the memory is used for
+enum HSMemorySubsystem {
+    kMemory_Wavetables,  // The tables, with their frequencies and highest partials
+    kMemory_Synth,       // PADsynth: the amplitude spectrum and the FFT plan
+    kMemory_Scratch,     // Buffers that only live while a set of tables is generated
+    kMemory_Voices,      // The voices and the buses that they render to
+    kNumMemorySubsystems
+};
+
+// In bytes
+struct HSMemoryUsage {
+    uint64_t current;
+    uint64_t peak;
+};
+
+// The value of kHSPadProperty_MemoryStats
+struct HSMemoryStats {
+    HSMemoryUsage subsystems[kNumMemorySubsystems];
+    // All subsystems together. The peak is of the sum, so it is usually less
+    // than the peaks of the subsystems added up.
+    HSMemoryUsage total;
+};
+
+// Counts the memory that something allocates, by subsystem, for planning how
+// many instances a machine has room for. HSWavetable has one for the tables
+// and what generates them; the peak includes the time while the generator
+// thread has generated a new set of tables and the old set is still played.
+// HSEngine and the AudioUnit have one for their voices.
+//
+// The bytes that are asked for are counted; what malloc adds to them isn't.
+// The counters are atomic, so any thread can allocate and read.
+class HSMemoryAccount {
+public:
+    HSMemoryAccount();
+
+    // Like malloc, and the bytes are counted against subsystem until the
+    // memory is given to release(). Returns NULL if malloc does.
+    void* allocate(HSMemorySubsystem subsystem, size_t size);
+    // Frees memory from allocate(). NULL is ignored.
+    void release(void* ptr);
+
+    // Counts memory that is allocated some other way, such as with new[]
+    void add(HSMemorySubsystem subsystem, size_t size);
+    void remove(HSMemorySubsystem subsystem, size_t size);
+
+    void read(HSMemoryStats* out) const;
+    // The peaks start over from what is allocated now
+    void resetPeaks();
+
+private:
+    void change(HSMemorySubsystem subsystem, int64_t size);
+
+    std::atomic<int64_t> current[kNumMemorySubsystems+1];
+    std::atomic<int64_t> peak[kNumMemorySubsystems+1];
+};
+
+// Adds stats to sum, for reporting the accounts of several owners together.
+// The peak of the total becomes the sum of the peaks, which is as high as the
+// total can have been.
+void addMemoryStats(HSMemoryStats* sum, const HSMemoryStats& stats);
+
+// Writes the usage as a JSON object with a member for each subsystem and the
+// total, in bytes, indented like writeRenderStatsJSON.
+void writeMemoryStatsJSON(FILE* f, const HSMemoryStats& stats, int indent = 2);
+
+#endif
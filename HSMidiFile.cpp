@@ -0,0 +1,211 @@
+/*
+ *  HSMidiFile.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSMidiFile.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+// The tempo until the first tempo change, in microseconds per quarter note
+static const double kDefaultTempo = 500000;
+
+namespace {
+
+// An event before the tempo map is applied. Tempo changes are kept in the same
+// list, with a tempo instead of a message, so that they can be sorted together.
+struct TickEvent {
+    uint64_t tick;
+    uint32_t order;   // The position in the file, which breaks ties
+    bool is_tempo;
+    uint32_t tempo;
+    HSMidiEvent event;
+
+    bool operator<(const TickEvent& other) const {
+        if (tick != other.tick) return tick < other.tick;
+        return order < other.order;
+    }
+};
+
+struct Reader {
+    const uint8_t* pos;
+    const uint8_t* end;
+
+    bool has(size_t n) const { return (size_t) (end-pos) >= n; }
+
+    uint32_t be(int n) {
+        uint32_t value = 0;
+        for (int i=0; i<n; i++) value = (value << 8) | *pos++;
+        return value;
+    }
+
+    // Variable length quantities are at most four bytes
+    bool varlen(uint32_t* value) {
+        *value = 0;
+        for (int i=0; i<4; i++) {
+            if (!has(1)) return false;
+            uint8_t byte = *pos++;
+            *value = (*value << 7) | (byte & 0x7F);
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+};
+
+}
+
+bool HSMidiFile::read(const char* path) {
+    events.clear();
+    duration = 0;
+    error.clear();
+
+    FILE* f = fopen(path, "rb");
+    if (!f) return fail("could not open the file");
+
+    std::vector<uint8_t> data;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf+n);
+    bool read_error = ferror(f);
+    fclose(f);
+    if (read_error) return fail("could not read the file");
+
+    return parse(data.empty() ? 0 : &data[0], data.size());
+}
+
+bool HSMidiFile::fail(const char* message) {
+    error = message;
+    events.clear();
+    return false;
+}
+
+bool HSMidiFile::parse(const uint8_t* data, size_t size) {
+    Reader file = { data, data+size };
+
+    if (!file.has(14) || file.be(4) != 0x4D546864 /* MThd */) return fail("not a MIDI file");
+    uint32_t header_size = file.be(4);
+    if (header_size < 6 || !file.has(header_size)) return fail("truncated header");
+    uint32_t format = file.be(2);
+    uint32_t num_tracks = file.be(2);
+    uint32_t division = file.be(2);
+    file.pos += header_size-6;
+
+    if (format > 1) return fail("only format 0 and 1 files are supported");
+    if (division == 0) return fail("invalid time division");
+
+    // With SMPTE time, ticks have a fixed length and tempo changes don't matter
+    double smpte_seconds_per_tick = 0;
+    if (division & 0x8000) {
+        int fps = -(int8_t) (division >> 8);
+        int ticks_per_frame = division & 0xFF;
+        if (fps <= 0 || ticks_per_frame == 0) return fail("invalid time division");
+        double frame_rate = fps == 29 ? 30000/1001. : fps;
+        smpte_seconds_per_tick = 1/(frame_rate*ticks_per_frame);
+    }
+
+    std::vector<TickEvent> tick_events;
+    uint64_t end_tick = 0;
+    uint32_t order = 0;
+
+    for (uint32_t track=0; track<num_tracks; track++) {
+        // Skip chunks that aren't tracks
+        uint32_t chunk_id, chunk_size;
+        for (;;) {
+            if (!file.has(8)) return fail("truncated file");
+            chunk_id = file.be(4);
+            chunk_size = file.be(4);
+            if (!file.has(chunk_size)) return fail("truncated track");
+            if (chunk_id == 0x4D54726B /* MTrk */) break;
+            file.pos += chunk_size;
+        }
+
+        Reader r = { file.pos, file.pos+chunk_size };
+        file.pos += chunk_size;
+
+        uint64_t tick = 0;
+        uint8_t running_status = 0;
+        while (r.has(1)) {
+            uint32_t delta;
+            if (!r.varlen(&delta)) return fail("truncated event");
+            tick += delta;
+            if (!r.has(1)) return fail("truncated event");
+
+            uint8_t status = *r.pos;
+            if (status & 0x80) r.pos++;
+            else if (running_status) status = running_status;
+            else return fail("data byte without a status");
+
+            if (status == 0xFF) {
+                // Meta event
+                if (!r.has(1)) return fail("truncated meta event");
+                uint8_t type = *r.pos++;
+                uint32_t length;
+                if (!r.varlen(&length) || !r.has(length)) return fail("truncated meta event");
+                if (type == 0x51 && length == 3) {
+                    TickEvent e = TickEvent();
+                    e.tick = tick;
+                    e.order = order++;
+                    e.is_tempo = true;
+                    e.tempo = (r.pos[0] << 16) | (r.pos[1] << 8) | r.pos[2];
+                    tick_events.push_back(e);
+                }
+                r.pos += length;
+                if (type == 0x2F) break; // End of track
+                continue;
+            }
+            if (status == 0xF0 || status == 0xF7) {
+                // System exclusive
+                uint32_t length;
+                if (!r.varlen(&length) || !r.has(length)) return fail("truncated system exclusive event");
+                r.pos += length;
+                continue;
+            }
+            if (status >= 0xF0) return fail("unexpected system message");
+
+            running_status = status;
+            int num_data = (status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0 ? 1 : 2;
+            if (!r.has(num_data)) return fail("truncated channel message");
+
+            TickEvent e = TickEvent();
+            e.tick = tick;
+            e.order = order++;
+            e.is_tempo = false;
+            e.event.status = status;
+            e.event.data1 = r.pos[0] & 0x7F;
+            e.event.data2 = num_data == 2 ? r.pos[1] & 0x7F : 0;
+            r.pos += num_data;
+            tick_events.push_back(e);
+        }
+        if (tick > end_tick) end_tick = tick;
+    }
+
+    // Apply the tempo map. Events at the same tick keep their order in the
+    // file, so a tempo change applies to the events after it.
+    std::stable_sort(tick_events.begin(), tick_events.end());
+
+    double ticks_per_quarter = division & 0x7FFF;
+    double seconds_per_tick = smpte_seconds_per_tick ? smpte_seconds_per_tick : kDefaultTempo/1e6/ticks_per_quarter;
+    double time = 0;
+    uint64_t last_tick = 0;
+    events.reserve(tick_events.size());
+    for (size_t i=0; i<tick_events.size(); i++) {
+        const TickEvent& e = tick_events[i];
+        time += (e.tick-last_tick)*seconds_per_tick;
+        last_tick = e.tick;
+
+        if (e.is_tempo) {
+            if (!smpte_seconds_per_tick && e.tempo > 0) seconds_per_tick = e.tempo/1e6/ticks_per_quarter;
+            continue;
+        }
+        HSMidiEvent event = e.event;
+        event.time = time;
+        events.push_back(event);
+    }
+    duration = time + (end_tick-last_tick)*seconds_per_tick;
+
+    return true;
+}
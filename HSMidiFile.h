@@ -0,0 +1,53 @@
+/*
+ *  HSMidiFile.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSMidiFile_h__
+#define __HSMidiFile_h__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A channel message from a MIDI file, at a time in seconds from the start
+struct HSMidiEvent {
+    double time;
+    uint8_t status;  // Including the channel
+    uint8_t data1;
+    uint8_t data2;   // 0 for messages with one data byte
+
+    uint8_t type() const { return status & 0xF0; }
+    uint8_t channel() const { return status & 0x0F; }
+};
+
+// Reads a Standard MIDI File of format 0 or 1. The channel messages of all the
+// tracks are merged into one list in time order, and the tempo map is applied,
+// so the events are timed in seconds. System exclusive and meta events other
+// than tempo changes are skipped.
+class HSMidiFile
+{
+public:
+    // Returns false if the file can't be read or isn't a MIDI file; getError
+    // tells why.
+    bool read(const char* path);
+
+    const std::vector<HSMidiEvent>& getEvents() const { return events; }
+    // The end of the longest track, in seconds. This can be after the last
+    // event, when the file ends with a rest.
+    double getDuration() const { return duration; }
+    const std::string& getError() const { return error; }
+
+private:
+    bool parse(const uint8_t* data, size_t size);
+    bool fail(const char* message);
+
+    std::vector<HSMidiEvent> events;
+    double duration;
+    std::string error;
+};
+
+#endif
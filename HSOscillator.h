@@ -0,0 +1,222 @@
+/*
+ *  HSOscillator.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSOscillator_h__
+#define __HSOscillator_h__
+
+#include <math.h>
+
+// Returns a linearly interpolated sample from a wavetable. phase must be in
+// [0, num_samples).
+static inline float interpolateWavetable(const float* wt, int num_samples, double phase) {
+    int pint = (int) phase;
+    float frac = phase - pint;
+    float out1 = wt[pint];
+    float out2 = wt[pint+1 == num_samples ? 0 : pint+1];
+    return out1 + frac*(out2-out1);
+}
+
+// Reads a linearly interpolated sample from a wavetable and advances phase.
+// phase must be in [0, num_samples) and increment smaller than num_samples.
+static inline float readWavetable(const float* wt, int num_samples, double& phase, double increment) {
+    float out = interpolateWavetable(wt, num_samples, phase);
+
+    phase += increment;
+    if (phase >= num_samples) phase -= num_samples;
+
+    return out;
+}
+
+// Like readWavetable, but also reads the sample half a table away from phase
+// into offset_out. PADsynth tables are noise-like, so the two reads are
+// uncorrelated, which gives a stereo image without any extra table memory.
+static inline float readWavetableWithOffset(const float* wt, int num_samples, double& phase, double increment, float& offset_out) {
+    double offset_phase = phase + (num_samples >> 1);
+    if (offset_phase >= num_samples) offset_phase -= num_samples;
+    offset_out = interpolateWavetable(wt, num_samples, offset_phase);
+
+    return readWavetable(wt, num_samples, phase, increment);
+}
+
+#if defined(__GNUC__)
+#define HS_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define HS_PREFETCH(addr)
+#endif
+
+static const int kFloatsPerCacheLine = 16;
+// Caps how much of a table is prefetched for one read, so that a very high
+// increment doesn't flood the memory system with prefetches.
+static const int kMaxPrefetchSpan = 64*kFloatsPerCacheLine;
+
+// Prefetches the part of a wavetable that reading num_frames frames from phase
+// with the given increment will touch. The tables are far bigger than the
+// caches and each note starts at a random phase, so without this nearly every
+// cache line that a block touches is a miss.
+static inline void prefetchWavetable(const float* wt, int num_samples, double phase, double increment, unsigned num_frames) {
+    int start = (int) phase;
+    int span = (int) (increment*num_frames) + 2;
+    if (span > kMaxPrefetchSpan) span = kMaxPrefetchSpan;
+
+    for (int i=0; i<span; i+=kFloatsPerCacheLine) {
+        int idx = start+i;
+        if (idx >= num_samples) idx -= num_samples;
+        HS_PREFETCH(wt+idx);
+    }
+    int last = start+span-1;
+    if (last >= num_samples) last -= num_samples;
+    HS_PREFETCH(wt+last);
+}
+
+// The maximum number of unison taps that an oscillator can play
+static const int kMaxUnisonTaps = 8;
+
+// Plays two adjacent wavetables (mip levels) at the same pitch and crossfades
+// between them. The tables have different base frequencies, so each has its
+// own phase and increment.
+//
+// Gains and increments are control rate values: they are computed once per
+// block and ramped linearly over it, so that volume changes, pitch bends and
+// changes of the crossfade position don't step at block boundaries.
+//
+// When only one table is audible during the block, hi_table should be NULL,
+// which makes this cost the same as reading a single table.
+//
+// For unison, the oscillator plays num_taps detuned taps of the same tables.
+// Each tap has its own phases, but all taps are read in the same loop from the
+// same tables, so the taps don't need any table memory of their own.
+struct HSOscillator {
+    const float* lo_table;
+    const float* hi_table;
+    int num_samples;
+
+    double lo_increment, hi_increment;
+    double lo_increment_step, hi_increment_step;
+
+    float lo_gain, hi_gain;
+    float lo_gain_step, hi_gain_step;
+
+    int num_taps;
+    double lo_phases[kMaxUnisonTaps], hi_phases[kMaxUnisonTaps];
+    double tap_ratios[kMaxUnisonTaps];     // Detune, as a factor of the increments
+    float tap_gains[kMaxUnisonTaps];
+    float tap_side_gains[kMaxUnisonTaps];  // Only used by next(float& side)
+
+    // Sets up the gain ramps to go from the start gains to the end gains over
+    // num_frames frames.
+    void setGains(float lo_start, float lo_end, float hi_start, float hi_end, unsigned num_frames) {
+        lo_gain = lo_start;
+        hi_gain = hi_start;
+        lo_gain_step = num_frames ? (lo_end-lo_start)/num_frames : 0;
+        hi_gain_step = num_frames ? (hi_end-hi_start)/num_frames : 0;
+    }
+
+    // Sets up the phase increments to go from the start values to the end
+    // values over num_frames frames.
+    void setIncrements(double lo_start, double lo_end, double hi_start, double hi_end, unsigned num_frames) {
+        lo_increment = lo_start;
+        hi_increment = hi_start;
+        lo_increment_step = num_frames ? (lo_end-lo_start)/num_frames : 0;
+        hi_increment_step = num_frames ? (hi_end-hi_start)/num_frames : 0;
+    }
+
+    inline float next() {
+        float lo_out = 0;
+        for (int tap=0; tap<num_taps; tap++) {
+            lo_out += tap_gains[tap]*readWavetable(lo_table, num_samples, lo_phases[tap], lo_increment*tap_ratios[tap]);
+        }
+        float out = lo_gain*lo_out;
+        lo_gain += lo_gain_step;
+        lo_increment += lo_increment_step;
+
+        if (hi_table) {
+            float hi_out = 0;
+            for (int tap=0; tap<num_taps; tap++) {
+                hi_out += tap_gains[tap]*readWavetable(hi_table, num_samples, hi_phases[tap], hi_increment*tap_ratios[tap]);
+            }
+            out += hi_gain*hi_out;
+            hi_gain += hi_gain_step;
+            hi_increment += hi_increment_step;
+        }
+
+        return out;
+    }
+
+    // Prefetches the parts of the tables that the next block will read if it
+    // continues at the increments that this block ended with. The phases and
+    // increments are the ones that the current block ended with, so this should
+    // be called after the block is rendered.
+    void prefetchNextBlock(unsigned num_frames, bool with_offset) const {
+        int half = num_samples >> 1;
+        for (int tap=0; tap<num_taps; tap++) {
+            double lo_tap_increment = lo_increment*tap_ratios[tap];
+            prefetchWavetable(lo_table, num_samples, lo_phases[tap], lo_tap_increment, num_frames);
+            if (with_offset) {
+                double offset_phase = lo_phases[tap] + half;
+                if (offset_phase >= num_samples) offset_phase -= num_samples;
+                prefetchWavetable(lo_table, num_samples, offset_phase, lo_tap_increment, num_frames);
+            }
+
+            if (hi_table) {
+                double hi_tap_increment = hi_increment*tap_ratios[tap];
+                prefetchWavetable(hi_table, num_samples, hi_phases[tap], hi_tap_increment, num_frames);
+                if (with_offset) {
+                    double offset_phase = hi_phases[tap] + half;
+                    if (offset_phase >= num_samples) offset_phase -= num_samples;
+                    prefetchWavetable(hi_table, num_samples, offset_phase, hi_tap_increment, num_frames);
+                }
+            }
+        }
+    }
+
+    // Like next(), but also returns the tables read half a table length away
+    // from the current phases in side, weighted with the side gains of the taps.
+    inline float next(float& side) {
+        float lo_out = 0, lo_side = 0;
+        for (int tap=0; tap<num_taps; tap++) {
+            float offset_out;
+            lo_out += tap_gains[tap]*readWavetableWithOffset(lo_table, num_samples, lo_phases[tap], lo_increment*tap_ratios[tap], offset_out);
+            lo_side += tap_side_gains[tap]*offset_out;
+        }
+        float out = lo_gain*lo_out;
+        side = lo_gain*lo_side;
+        lo_gain += lo_gain_step;
+        lo_increment += lo_increment_step;
+
+        if (hi_table) {
+            float hi_out = 0, hi_side = 0;
+            for (int tap=0; tap<num_taps; tap++) {
+                float offset_out;
+                hi_out += tap_gains[tap]*readWavetableWithOffset(hi_table, num_samples, hi_phases[tap], hi_increment*tap_ratios[tap], offset_out);
+                hi_side += tap_side_gains[tap]*offset_out;
+            }
+            out += hi_gain*hi_out;
+            side += hi_gain*hi_side;
+            hi_gain += hi_gain_step;
+            hi_increment += hi_increment_step;
+        }
+
+        return out;
+    }
+};
+
+// Returns where a unison tap is placed among the taps, from -1 to 1. It is
+// used both for the detune and the panning of the tap.
+static inline float unisonTapPosition(int tap, int num_taps) {
+    return num_taps > 1 ? 2.0f*tap/(num_taps-1) - 1 : 0;
+}
+
+// Returns the gain of table idx when the crossfade position is level. The two
+// tables are uncorrelated, so this uses an equal power crossfade.
+static inline float mipLevelGain(float level, int idx) {
+    float distance = level-idx;
+    if (distance < 0) distance = -distance;
+    return distance < 1 ? sqrtf(1-distance) : 0;
+}
+
+#endif
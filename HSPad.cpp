@@ -64,7 +64,11 @@
 #include "HSPad.h"
 
 #include "HSWavetable.h"
+#include "HSOscillator.h"
+#include "HSRenderPool.h"
+#include "HSLog.h"
 #include "ComponentBase.h"
+#include <mach/mach_time.h>
 
 AUDIOCOMPONENT_ENTRY(AUMusicDeviceFactory, HSPad)
 
@@ -94,9 +98,46 @@ HSPad::HSPad(ComponentInstance inComponentInstance)
 	Globals()->SetParameter(kParameter_AttackTime,       kDefaultValue_AttackTime);
 	Globals()->SetParameter(kParameter_ReleaseTime,      kDefaultValue_ReleaseTime);
     
+	Globals()->SetParameter(kParameter_StereoWidth, kDefaultValue_StereoWidth);
+    
+	Globals()->SetParameter(kParameter_UnisonVoices, kDefaultValue_UnisonVoices);
+	Globals()->SetParameter(kParameter_UnisonDetune, kDefaultValue_UnisonDetune);
+	Globals()->SetParameter(kParameter_UnisonSpread, kDefaultValue_UnisonSpread);
+    
     parameterListener = 0;
     
     wavetable = 0;
+    memset(&params, 0, sizeof(params));
+    
+    mono_bus = 0;
+    side_bus = 0;
+    render_side = false;
+    bus.mono = bus.side = 0;
+    bus.frames_written = 0;
+    
+    render_threads = 1;
+    render_pool = 0;
+    worker_bus_data = 0;
+    memset(worker_buses, 0, sizeof(worker_buses));
+    
+    mHSNotes = 0;
+    polyphony = kDefaultPolyphony;
+    
+    cpu_budget = kDefaultCPUBudget;
+    governed_polyphony = polyphony;
+    render_load = 0;
+    log_started = false;
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    seconds_per_tick = 1e-9*timebase.numer/timebase.denom;
+}
+
+AUElement* HSPad::CreateElement(AudioUnitScope inScope, AudioUnitElement element)
+{
+    if (inScope == kAudioUnitScope_Group)
+        return new HSGroupElement(this, element, new MidiControls);
+    
+    return AUMonotimbralInstrumentBase::CreateElement(inScope, element);
 }
 
 void MyEventListenerProc(void *                      inUserData,
@@ -117,7 +158,39 @@ OSStatus HSPad::Initialize()
     ret = AUMonotimbralInstrumentBase::Initialize();
     if (ret != noErr) return ret;
     
-	SetNotes(kNumNotes, kMaxActiveNotes, mHSNotes, sizeof(HSNote));
+    // The polyphony can't change while we're initialized
+    mHSNotes = new HSNote[polyphony + kNumFastReleaseNotes];
+    memory.add(kMemory_Voices, sizeof(HSNote)*(polyphony + kNumFastReleaseNotes));
+	SetNotes(polyphony + kNumFastReleaseNotes, polyphony, mHSNotes, sizeof(HSNote));
+    governed_polyphony = polyphony;
+    render_load = 0;
+    render_stats.reset();
+    
+    // Diagnostics go to the file that HSPAD_LOG names, if it is set
+    const char* log_path = getenv("HSPAD_LOG");
+    if (log_path && !log_started) log_started = hsLog().start(log_path);
+    
+    // The maximum number of frames per slice can't change while we're initialized
+    mono_bus = (float*) memory.allocate(kMemory_Voices, sizeof(float)*GetMaxFramesPerSlice());
+    side_bus = (float*) memory.allocate(kMemory_Voices, sizeof(float)*GetMaxFramesPerSlice());
+    render_side = false;
+    
+    // Render takes a new snapshot each cycle, but it fades the stereo width
+    // from the previous one
+    snapshotParameters(GetOutput(0)->GetStreamFormat().NumberChannels());
+    
+    // The render threads can't change while we're initialized. Each worker
+    // gets its own buses, and the pool gets the render cycle period for the
+    // real time constraints of its threads.
+    if (render_threads > 1) {
+        UInt32 maxFrames = GetMaxFramesPerSlice();
+        worker_bus_data = (float*) memory.allocate(kMemory_Voices, sizeof(float)*maxFrames*2*(render_threads-1));
+        for (UInt32 i=1; i<render_threads; i++) {
+            worker_buses[i].mono = worker_bus_data + maxFrames*2*(i-1);
+            worker_buses[i].side = worker_buses[i].mono + maxFrames;
+        }
+        render_pool = new HSRenderPool(render_threads-1, maxFrames/GetOutput(0)->GetStreamFormat().mSampleRate);
+    }
     
     wavetable = new HSWavetable(kNumWavetables,
                                 GetOutput(0)->GetStreamFormat().mSampleRate,
@@ -158,6 +231,124 @@ OSStatus HSPad::Initialize()
     return ret;
 }
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//	HSPad::Render
+//
+// Evaluates the parameters that are shared by all notes once per render cycle,
+// so that the notes don't have to do it each.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OSStatus HSPad::Render(AudioUnitRenderActionFlags &ioActionFlags, const AudioTimeStamp &inTimeStamp, UInt32 inNumberFrames)
+{
+    uint64_t start_ticks = mach_absolute_time();
+    governVoices();
+    
+    UInt32 numChans = GetOutput(0)->GetStreamFormat().NumberChannels();
+    if (numChans > 2) return -1;
+    
+    float start_width = params.stereo_width;
+    snapshotParameters(numChans);
+    float end_width = params.stereo_width;
+    render_side = start_width > 0 || end_width > 0;
+    
+    bus.mono = mono_bus;
+    bus.side = render_side ? side_bus : 0;
+    bus.frames_written = 0;
+    for (UInt32 i=1; i<render_threads; i++) {
+        worker_buses[i].side = render_side ? worker_buses[i].mono + GetMaxFramesPerSlice() : 0;
+    }
+    OSStatus result = AUMonotimbralInstrumentBase::Render(ioActionFlags, inTimeStamp, inNumberFrames);
+    if (result != noErr) return result;
+    // No note is sounding, and the base class has already cleared the outputs
+    if (ioActionFlags & kAudioUnitRenderAction_OutputIsSilence) {
+        measureRenderLoad(start_ticks, inNumberFrames);
+        return noErr;
+    }
+    
+    // Spread the mono bus to the output channels
+    AudioBufferList& bufferList = GetOutput(0)->GetBufferList();
+    float* left = (float*) bufferList.mBuffers[0].mData;
+    float* right = numChans == 2 ? (float*) bufferList.mBuffers[1].mData : 0;
+    bus.spread(left, right, inNumberFrames, start_width, end_width);
+    
+    measureRenderLoad(start_ticks, inNumberFrames);
+    return noErr;
+}
+
+void HSPad::measureRenderLoad(uint64_t start_ticks, UInt32 inNumberFrames)
+{
+    // Follow rises of the load at once, so that a single slow cycle is acted
+    // on, but let it fall slowly, so that a single fast cycle isn't trusted
+    double sampleRate = GetOutput(0)->GetStreamFormat().mSampleRate;
+    double seconds = ticksToSeconds(mach_absolute_time()-start_ticks);
+    double load = seconds*sampleRate/inNumberFrames;
+    render_load = load > render_load ? load : render_load + 0.05*(load-render_load);
+    
+    render_stats.endCycle(seconds, inNumberFrames, sampleRate, DroppedEventCount());
+    if (load > 1) {
+        HS_LOG("Render cycle of %u frames missed the deadline: %.3f ms, %u notes",
+               (unsigned) inNumberFrames, seconds*1e3, (unsigned) NumActiveNotes());
+    }
+}
+
+void HSPad::snapshotParameters(UInt32 numChans)
+{
+    AUElement* globals = Globals();
+    for (UInt32 i=0; i<kNumberOfParameters; ++i) {
+        params.values[i] = globals->GetParameter(i);
+    }
+    params.derive(GetOutput(0)->GetStreamFormat().mSampleRate, numChans);
+}
+
+void HSPad::PrepareOutputBuffers(UInt32 inNumberFrames)
+{
+    // The notes render into the buses, and Render writes every frame of the
+    // output buffers from them, so there is no need to clear the buffers
+    UInt32 numOutputs = Outputs().GetNumberOfElements();
+    for (UInt32 i=0; i<numOutputs; ++i) {
+        GetOutput(i)->PrepareBuffer(inNumberFrames);
+    }
+}
+
+SynthNote* HSPad::VoiceStealing(UInt32 inFrame, bool inKillIt)
+{
+    // Stealing fast releases a note, or cuts one off and returns it for reuse.
+    // Either way, a note that was playing stops, and the active notes go down
+    // by one. Cutting off a note that was already fast released doesn't lower
+    // them, and isn't counted again.
+    UInt32 numActiveNotes = NumActiveNotes();
+    SynthNote* note = AUMonotimbralInstrumentBase::VoiceStealing(inFrame, inKillIt);
+    if (NumActiveNotes() < numActiveNotes) {
+        render_stats.addStolenVoice();
+        HS_LOG("Stole a note, %u of %u active", (unsigned) numActiveNotes, (unsigned) governed_polyphony);
+    }
+    return note;
+}
+
+void HSPad::governVoices()
+{
+    UInt32 limit = governed_polyphony;
+    if (cpu_budget <= 0) {
+        limit = polyphony;
+    }
+    else if (render_load > cpu_budget && limit > 1) {
+        // Assume that the load is proportional to the number of notes
+        UInt32 target = (UInt32) (NumActiveNotes()*cpu_budget/render_load);
+        if (target >= limit) target = limit-1;
+        limit = target < 1 ? 1 : target;
+        // The next cycle shows the effect; don't act on this measurement again
+        render_load = cpu_budget;
+    }
+    else if (render_load < 0.6*cpu_budget && limit < polyphony) {
+        limit++;
+    }
+    
+    if (limit != governed_polyphony) {
+        governed_polyphony = limit;
+        // Quiet notes go first, and fast releasing them keeps them from clicking
+        SetMaxActiveNotes(limit, 0);
+    }
+}
+
 OSStatus HSPad::GenerateWavetables()
 {
     wavetable->generateWavetables(Globals()->GetParameter(kParameter_HarmonicBandwidth),
@@ -185,6 +376,26 @@ void HSPad::Cleanup()
     delete wavetable;
     wavetable = 0;
     
+    memory.release(mono_bus);
+    mono_bus = 0;
+    memory.release(side_bus);
+    side_bus = 0;
+    
+    // Stops the workers
+    delete render_pool;
+    render_pool = 0;
+    memory.release(worker_bus_data);
+    worker_bus_data = 0;
+    memset(worker_buses, 0, sizeof(worker_buses));
+    
+    SetNotes(0, 0, 0, sizeof(HSNote));
+    if (mHSNotes) memory.remove(kMemory_Voices, sizeof(HSNote)*(polyphony + kNumFastReleaseNotes));
+    delete[] mHSNotes;
+    mHSNotes = 0;
+    
+    if (log_started) hsLog().stop();
+    log_started = false;
+    
     AUMonotimbralInstrumentBase::Cleanup();
 }
 
@@ -274,6 +485,38 @@ OSStatus HSPad::GetParameterInfo(AudioUnitScope inScope, AudioUnitParameterID in
             outParameterInfo.defaultValue = kDefaultValue_ReleaseTime;
             break;
             
+        case kParameter_StereoWidth:
+            AUBase::FillInParameterName(outParameterInfo, kParamName_StereoWidth, false);
+            outParameterInfo.unit =         kAudioUnitParameterUnit_Generic;
+            outParameterInfo.minValue =     kMinimumValue_StereoWidth;
+            outParameterInfo.maxValue =     kMaximumValue_StereoWidth;
+            outParameterInfo.defaultValue = kDefaultValue_StereoWidth;
+            break;
+            
+        case kParameter_UnisonVoices:
+            AUBase::FillInParameterName(outParameterInfo, kParamName_UnisonVoices, false);
+            outParameterInfo.unit =         kAudioUnitParameterUnit_Indexed;
+            outParameterInfo.minValue =     kMinimumValue_UnisonVoices;
+            outParameterInfo.maxValue =     kMaximumValue_UnisonVoices;
+            outParameterInfo.defaultValue = kDefaultValue_UnisonVoices;
+            break;
+            
+        case kParameter_UnisonDetune:
+            AUBase::FillInParameterName(outParameterInfo, kParamName_UnisonDetune, false);
+            outParameterInfo.unit =         kAudioUnitParameterUnit_Cents;
+            outParameterInfo.minValue =     kMinimumValue_UnisonDetune;
+            outParameterInfo.maxValue =     kMaximumValue_UnisonDetune;
+            outParameterInfo.defaultValue = kDefaultValue_UnisonDetune;
+            break;
+            
+        case kParameter_UnisonSpread:
+            AUBase::FillInParameterName(outParameterInfo, kParamName_UnisonSpread, false);
+            outParameterInfo.unit =         kAudioUnitParameterUnit_Generic;
+            outParameterInfo.minValue =     kMinimumValue_UnisonSpread;
+            outParameterInfo.maxValue =     kMaximumValue_UnisonSpread;
+            outParameterInfo.defaultValue = kDefaultValue_UnisonSpread;
+            break;
+            
         default:
             result = kAudioUnitErr_InvalidParameter;
             break;
@@ -282,6 +525,198 @@ OSStatus HSPad::GetParameterInfo(AudioUnitScope inScope, AudioUnitParameterID in
 	return result;
 }
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//	HSPad::SetParameter
+//
+// Tells the generator trace when a parameter that the wavetables depend on
+// changes, which is where the wait for the parameter listener starts. This can
+// be called on the render thread; parameterChanged doesn't lock.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OSStatus HSPad::SetParameter(AudioUnitParameterID inID, AudioUnitScope inScope, AudioUnitElement inElement, AudioUnitParameterValue inValue, UInt32 inBufferOffsetInFrames)
+{
+    if (wavetable && inScope == kAudioUnitScope_Global && Globals()->GetParameter(inID) != inValue) {
+        for (int i=0; i<kNumParametersThatAreRelevantToWavetable; i++) {
+            if (kParametersThatAreRelevantToWavetable[i] == inID)
+                wavetable->getTrace().parameterChanged();
+        }
+    }
+    
+    return AUMonotimbralInstrumentBase::SetParameter(inID, inScope, inElement, inValue, inBufferOffsetInFrames);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//	HSPad::GetPropertyInfo
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OSStatus HSPad::GetPropertyInfo(AudioUnitPropertyID inID, AudioUnitScope inScope, AudioUnitElement inElement, UInt32 &outDataSize, Boolean &outWritable)
+{
+    if (inScope == kAudioUnitScope_Global) {
+        switch (inID) {
+            case kHSPadProperty_Polyphony:
+                outDataSize = sizeof(UInt32);
+                outWritable = true;
+                return noErr;
+                
+            case kHSPadProperty_GovernedPolyphony:
+                outDataSize = sizeof(UInt32);
+                outWritable = false;
+                return noErr;
+                
+            case kHSPadProperty_RenderThreads:
+                outDataSize = sizeof(UInt32);
+                outWritable = true;
+                return noErr;
+                
+            case kHSPadProperty_RenderStats:
+                outDataSize = sizeof(HSRenderStatsSnapshot);
+                outWritable = true;
+                return noErr;
+                
+            case kHSPadProperty_GeneratorStats:
+                if (!wavetable) return kAudioUnitErr_Uninitialized;
+                outDataSize = sizeof(HSGeneratorStats);
+                outWritable = true;
+                return noErr;
+                
+            case kHSPadProperty_GeneratorTrace:
+                if (!wavetable) return kAudioUnitErr_Uninitialized;
+                outDataSize = sizeof(CFDataRef);
+                outWritable = false;
+                return noErr;
+                
+            case kHSPadProperty_MemoryStats:
+                outDataSize = sizeof(HSMemoryStats);
+                outWritable = true;
+                return noErr;
+                
+            case kAudioUnitProperty_CPULoad:
+                outDataSize = sizeof(Float32);
+                outWritable = true;
+                return noErr;
+        }
+    }
+    
+    return AUMonotimbralInstrumentBase::GetPropertyInfo(inID, inScope, inElement, outDataSize, outWritable);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//	HSPad::GetProperty
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OSStatus HSPad::GetProperty(AudioUnitPropertyID inID, AudioUnitScope inScope, AudioUnitElement inElement, void *outData)
+{
+    if (inScope == kAudioUnitScope_Global) {
+        switch (inID) {
+            case kHSPadProperty_Polyphony:
+                *(UInt32*) outData = polyphony;
+                return noErr;
+                
+            case kHSPadProperty_GovernedPolyphony:
+                *(UInt32*) outData = governed_polyphony;
+                return noErr;
+                
+            case kHSPadProperty_RenderThreads:
+                *(UInt32*) outData = render_threads;
+                return noErr;
+                
+            case kHSPadProperty_RenderStats:
+                render_stats.read((HSRenderStatsSnapshot*) outData);
+                return noErr;
+                
+            case kHSPadProperty_GeneratorStats:
+                if (!wavetable) return kAudioUnitErr_Uninitialized;
+                wavetable->getTrace().getStats((HSGeneratorStats*) outData);
+                return noErr;
+                
+            case kHSPadProperty_GeneratorTrace: {
+                if (!wavetable) return kAudioUnitErr_Uninitialized;
+                std::string json = wavetable->getTrace().chromeTraceJSON();
+                *(CFDataRef*) outData = CFDataCreate(kCFAllocatorDefault, (const UInt8*) json.data(), json.size());
+                return noErr;
+            }
+                
+            case kHSPadProperty_MemoryStats: {
+                HSMemoryStats* stats = (HSMemoryStats*) outData;
+                memory.read(stats);
+                if (wavetable) {
+                    HSMemoryStats tables;
+                    wavetable->getMemory().read(&tables);
+                    addMemoryStats(stats, tables);
+                }
+                return noErr;
+            }
+                
+            case kAudioUnitProperty_CPULoad:
+                *(Float32*) outData = cpu_budget;
+                return noErr;
+        }
+    }
+    
+    return AUMonotimbralInstrumentBase::GetProperty(inID, inScope, inElement, outData);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//	HSPad::SetProperty
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OSStatus HSPad::SetProperty(AudioUnitPropertyID inID, AudioUnitScope inScope, AudioUnitElement inElement, const void *inData, UInt32 inDataSize)
+{
+    if (inScope == kAudioUnitScope_Global) {
+        switch (inID) {
+            case kHSPadProperty_Polyphony: {
+                if (inDataSize != sizeof(UInt32)) return kAudioUnitErr_InvalidPropertyValue;
+                // The voice pool is allocated in Initialize
+                if (IsInitialized()) return kAudioUnitErr_Initialized;
+                
+                UInt32 value = *(const UInt32*) inData;
+                if (value < 1 || value > (UInt32)kMaxPolyphony) return kAudioUnitErr_InvalidPropertyValue;
+                polyphony = value;
+                governed_polyphony = value;
+                return noErr;
+            }
+                
+            case kHSPadProperty_GovernedPolyphony:
+                return kAudioUnitErr_PropertyNotWritable;
+                
+            case kHSPadProperty_RenderThreads: {
+                if (inDataSize != sizeof(UInt32)) return kAudioUnitErr_InvalidPropertyValue;
+                // The threads and their buses are created in Initialize
+                if (IsInitialized()) return kAudioUnitErr_Initialized;
+                
+                UInt32 value = *(const UInt32*) inData;
+                if (value < 1 || value > kMaxRenderThreads) return kAudioUnitErr_InvalidPropertyValue;
+                render_threads = value;
+                return noErr;
+            }
+                
+            case kHSPadProperty_RenderStats:
+                render_stats.reset();
+                return noErr;
+                
+            case kHSPadProperty_GeneratorStats:
+                if (!wavetable) return kAudioUnitErr_Uninitialized;
+                wavetable->getTrace().reset();
+                return noErr;
+                
+            case kHSPadProperty_GeneratorTrace:
+                return kAudioUnitErr_PropertyNotWritable;
+                
+            case kHSPadProperty_MemoryStats:
+                memory.resetPeaks();
+                if (wavetable) wavetable->getMemory().resetPeaks();
+                return noErr;
+                
+            case kAudioUnitProperty_CPULoad: {
+                if (inDataSize != sizeof(Float32)) return kAudioUnitErr_InvalidPropertyValue;
+                
+                Float32 value = *(const Float32*) inData;
+                if (!(value >= 0 && value <= 1)) return kAudioUnitErr_InvalidPropertyValue;
+                cpu_budget = value;
+                return noErr;
+            }
+        }
+    }
+    
+    return AUMonotimbralInstrumentBase::SetProperty(inID, inScope, inElement, inData, inDataSize);
+}
+
 
 
 #pragma mark HSNote Methods
@@ -291,139 +726,166 @@ OSStatus HSPad::GetParameterInfo(AudioUnitScope inScope, AudioUnitParameterID in
 bool HSNote::Attack(const MusicDeviceNoteParams &inParams)
 {
     HSPad* hsp = (HSPad*) GetAudioUnit();
-    wavetable = hsp->getWavetable();
-    float freq = Frequency()*(1-GetGlobalParameter(kParameter_TouchSensitivity)*pow(inParams.mVelocity/127., 2.));
-    wavetable_idx = wavetable->closestMatchingWavetable(freq);
-    wavetable_num_samples = wavetable->getNumSamples();
-    wavetable_sample_rate = wavetable->getSampleRate();
-    
-    double sampleRate = SampleRate();
-    phase = (rand()/(RAND_MAX+1.0))*wavetable_num_samples;
-    amp = 0.;
-    maxamp = 0.4 * pow(inParams.mVelocity/127., 2.); 
-    
-    float at = GetGlobalParameter(kParameter_AttackTime);
-    // If at is 0, we set up_slope to maxamp/50. That is big enough to start the note
-    // seemingly immediately, yet avoiding an ugly chipping sound that comes if you set
-    // it to maxamp.
-    up_slope = maxamp / (at==0.0?50.0:(at/1000.0 * sampleRate));
-    
-    float rt = GetGlobalParameter(kParameter_ReleaseTime);
-    if (rt == 0) {
-        // This is not 0, because that makes an ugly chipping sound when the note
-        // is released. 0.99 is small enough to stop the note seemingly immediately
-        dn_slope = 0.99;
-    }
-    else {
-        double num_frames = rt/1000.0 * sampleRate;
-        double off_threshold = 0.01; // 20dB
-        dn_slope = pow(off_threshold, (double)1.0/num_frames);
-    }
-    
-    fast_dn_slope = -maxamp / (0.005 * sampleRate);
-    
+    float bend = GetPitchBend();
+    voice.start(hsp->getWavetable(), hsp->getParameters(), SampleRate(),
+                Frequency()/pow(2., bend/12.), inParams.mVelocity, bend,
+                GetRelativeStartFrame(), hsp->getRandom());
     return true;
 }
 
+// The envelope stage that a note state plays
+static HSEnvelopeStage envelopeStage(SynthNoteState state)
+{
+    switch (state)
+    {
+        case kNoteState_Attacked :
+        case kNoteState_Sostenutoed :
+        case kNoteState_ReleasedButSostenutoed :
+        case kNoteState_ReleasedButSustained :
+            return kEnvelope_Held;
+        case kNoteState_Released :
+            return kEnvelope_Released;
+        case kNoteState_FastReleased :
+            return kEnvelope_FastReleased;
+        default :
+            return kEnvelope_Off;
+    }
+}
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-//	HSPad::Render
+//	HSNote::Render
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 OSStatus		HSNote::Render(UInt64 inAbsoluteSampleFrame, UInt32 inNumFrames, AudioBufferList** inBufferList, UInt32 inOutBusCount)
 {
-    // TestNote only writes into the first bus regardless of what is handed to us.
-	const int bus0 = 0;
-    AudioBufferList* inBuffer = inBufferList[bus0];
+    // Notes don't write to the output buffers directly; they render into the
+    // buses, which HSPad::Render spreads to the output channels.
+    HSPad* hsp = (HSPad*) GetAudioUnit();
+    HSWavetable* wavetable = hsp->getWavetable();
     
-	int numChans = inBuffer->mNumberBuffers;
-	if (numChans > 2) return -1;
+    wavetable->lockWavetables();
+    UInt32 endFrame = renderToBus(hsp->getBus(), inAbsoluteSampleFrame, inNumFrames);
+    wavetable->unlockWavetables();
     
-    float volumeFactor = pow(10, GetGlobalParameter(kParameter_Volume)/10);
+    if (endFrame != kVoiceNotEnded)
+        NoteEnded(endFrame);
+    return noErr;
+}
+
+UInt32 HSNote::renderToBus(HSBus& bus, UInt64 inAbsoluteSampleFrame, UInt32 inNumFrames)
+{
+    HSPad* hsp = (HSPad*) GetAudioUnit();
+    return voice.render(bus, hsp->RenderCycleStartFrame(), inAbsoluteSampleFrame, inNumFrames,
+                        envelopeStage(GetState()), GetPitchBend(), hsp->getParameters());
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//	HSGroupElement::RenderNotes
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OSStatus HSGroupElement::RenderNotes(SInt64 inAbsoluteSampleFrame, UInt32 inNumberFrames,
+                                     AudioBufferList** ioBufferList, UInt32 inOutBusCount)
+{
+    // Collect the sounding notes, sorted by wavetable with an insertion sort. The
+    // order rarely changes between blocks and there are few notes, so this is cheap.
+    // The wavetable index is the table that the note read in its previous block.
+    HSNote* notes[kMaxNumNotes];
+    UInt32 numNotes = 0;
+	for (UInt32 i=0 ; i<kNumberOfSoundingNoteStates; ++i)
+	{
+		for (SynthNote *note = mNoteList[i].mHead; note && numNotes < kMaxNumNotes; note = note->mNext)
+		{
+            HSNote* hsnote = (HSNote*) note;
+            UInt32 pos = numNotes++;
+            while (pos > 0 && notes[pos-1]->voice.getWavetableIndex() > hsnote->voice.getWavetableIndex()) {
+                notes[pos] = notes[pos-1];
+                pos--;
+            }
+            notes[pos] = hsnote;
+		}
+	}
     
-	float *left, *right;
+    HSPad* hsp = (HSPad*) GetAUInstrument();
+    HSRenderPool* pool = hsp->getRenderPool();
+    UInt32 numThreads = pool ? numNotes/kMinNotesPerRenderThread : 1;
+    if (pool && numThreads > (UInt32)pool->getNumWorkers()+1) numThreads = pool->getNumWorkers()+1;
     
-    wavetable->lockWavetables(); {
-        float *wt = wavetable->getWavetableData(wavetable_idx);
-        float base_frequency = wavetable->getBaseFrequency(wavetable_idx);
-        
-        left = (float*)inBuffer->mBuffers[0].mData;
-        right = numChans == 2 ? (float*)inBuffer->mBuffers[1].mData : 0;
-        
-        double freq = Frequency()/base_frequency*((double)wavetable_sample_rate)/SampleRate();
-        
-        switch (GetState())
+    // Rendering a note can end it, which moves it to another list. That doesn't
+    // matter here, since the notes are rendered from the array.
+    uint64_t startTicks = mach_absolute_time();
+    OSStatus err = noErr;
+    if (numThreads > 1) {
+        renderParallel(notes, numNotes, numThreads, inAbsoluteSampleFrame, inNumberFrames);
+    }
+    else {
+        for (UInt32 i=0; i<numNotes && !err; ++i)
         {
-            case kNoteState_Attacked :
-            case kNoteState_Sostenutoed :
-            case kNoteState_ReleasedButSostenutoed :
-            case kNoteState_ReleasedButSustained :
-			{
-				for (UInt32 frame=0; frame<inNumFrames; ++frame)
-				{
-					if (amp < maxamp) amp += up_slope;
-                    
-                    int pint = (int) phase;
-                    float out1 = wt[pint%wavetable_num_samples];
-                    float out2 = wt[(pint+1)%wavetable_num_samples];
-                    float out =  ((1-(phase-pint))*out1+(phase-pint)*out2) * amp * volumeFactor;
-                    
-					phase += freq;
-					if (phase >= wavetable_num_samples) phase -= wavetable_num_samples;
-					left[frame] += out;
-					if (right) right[frame] += out;
-				}
-			}
-                break;
-                
-            case kNoteState_Released :
-			{
-				UInt32 endFrame = 0xFFFFFFFF;
-				for (UInt32 frame=0; frame<inNumFrames; ++frame)
-				{
-					if (amp > 0.0) amp *= dn_slope;
-					else if (endFrame == 0xFFFFFFFF) endFrame = frame;
-                    
-                    int pint = (int) phase;
-                    float out1 = wt[pint%wavetable_num_samples];
-                    float out2 = wt[(pint+1)%wavetable_num_samples];
-                    float out =  ((1-(phase-pint))*out1+(phase-pint)*out2) * amp * volumeFactor;
-                    
-					phase += freq;
-					if (phase >= wavetable_num_samples) phase -= wavetable_num_samples;
-					left[frame] += out;
-					if (right) right[frame] += out;
-				}
-				if (endFrame != 0xFFFFFFFF)
-					NoteEnded(endFrame);
-			}
-                break;
-                
-            case kNoteState_FastReleased :
-			{
-				UInt32 endFrame = 0xFFFFFFFF;
-				for (UInt32 frame=0; frame<inNumFrames; ++frame)
-				{
-					if (amp > 0.0) amp += fast_dn_slope;
-					else if (endFrame == 0xFFFFFFFF) endFrame = frame;
-                    
-                    int pint = (int) phase;
-                    float out1 = wt[pint%wavetable_num_samples];
-                    float out2 = wt[(pint+1)%wavetable_num_samples];
-                    float out =  ((1-(phase-pint))*out1+(phase-pint)*out2) * amp * volumeFactor;
-                    
-					phase += freq;
-					if (phase >= wavetable_num_samples) phase -= wavetable_num_samples;
-					left[frame] += out;
-					if (right) right[frame] += out;
-				}
-				if (endFrame != 0xFFFFFFFF)
-					NoteEnded(endFrame);
-			}
-                break;
-            default :
-                break;
+            err = notes[i]->Render(inAbsoluteSampleFrame, inNumberFrames, ioBufferList, inOutBusCount);
+            UpdateNoteAmplitude(notes[i]);
         }
-        
-    } wavetable->unlockWavetables();
-    return noErr;
+    }
+    hsp->getRenderStats().addVoices(hsp->ticksToSeconds(mach_absolute_time()-startTicks), numNotes, inNumberFrames);
+	return err;
 }
 
+// What the render pool tasks of a sub-block share. Each thread writes only its
+// own bus and the end frames of its own notes.
+struct HSParallelRender
+{
+    HSNote** notes;
+    UInt32 num_notes;
+    UInt32 num_threads;
+    HSBus* buses[kMaxRenderThreads];
+    UInt64 frame;
+    UInt32 num_frames;
+    UInt32 end_frames[kMaxNumNotes];
+};
+
+static void renderNotesTask(void* context, int thread)
+{
+    HSParallelRender* r = (HSParallelRender*) context;
+    UInt32 begin = r->num_notes*thread/r->num_threads;
+    UInt32 end = r->num_notes*(thread+1)/r->num_threads;
+    for (UInt32 i=begin; i<end; ++i) {
+        r->end_frames[i] = r->notes[i]->renderToBus(*r->buses[thread], r->frame, r->num_frames);
+    }
+}
+
+void HSGroupElement::renderParallel(HSNote** notes, UInt32 num_notes, UInt32 num_threads,
+                                    SInt64 inAbsoluteSampleFrame, UInt32 inNumberFrames)
+{
+    HSPad* hsp = (HSPad*) GetAUInstrument();
+    HSBus& bus = hsp->getBus();
+    UInt32 subBlockOffset = (UInt32)(inAbsoluteSampleFrame - hsp->RenderCycleStartFrame());
+    
+    // The notes are sorted by wavetable, so neighbours in the array tend to
+    // read the same table; giving each thread a run of them keeps the tables
+    // that a thread reads few. The render thread renders the first run
+    // straight into the buses.
+    HSParallelRender r;
+    r.notes = notes;
+    r.num_notes = num_notes;
+    r.num_threads = num_threads;
+    r.buses[0] = &bus;
+    for (UInt32 i=1; i<num_threads; ++i) {
+        r.buses[i] = &hsp->getWorkerBus(i);
+        r.buses[i]->frames_written = subBlockOffset;
+    }
+    r.frame = inAbsoluteSampleFrame;
+    r.num_frames = inNumberFrames;
+    
+    HSWavetable* wavetable = hsp->getWavetable();
+    wavetable->lockWavetables();
+    hsp->getRenderPool()->run(renderNotesTask, &r, num_threads);
+    wavetable->unlockWavetables();
+    
+    for (UInt32 i=1; i<num_threads; ++i) {
+        bus.mixFrom(*r.buses[i], subBlockOffset, inNumberFrames);
+    }
+    
+    // Ending notes changes the note lists, so it is done here, after all
+    // threads are done
+    for (UInt32 i=0; i<num_notes; ++i) {
+        if (r.end_frames[i] != kVoiceNotEnded)
+            notes[i]->NoteEnded(r.end_frames[i]);
+        UpdateNoteAmplitude(notes[i]);
+    }
+}
@@ -10,90 +10,78 @@
 #include "HSPadVersion.h"
 #include "AUInstrumentBase.h"
 #include <AudioToolbox/AudioUnitUtilities.h>
+#include "HSVoice.h"
+#include "HSRenderStats.h"
+#include "HSMemory.h"
 
 class HSWavetable;
+class HSRenderPool;
 
-// 
-static const UInt32 kNumNotes = 14;
-static const UInt32 kMaxActiveNotes = 10;
+// The share of the buffer duration that a render cycle may take before the
+// voice governor lowers the polyphony. Set with kAudioUnitProperty_CPULoad;
+// 0 turns the governor off.
+static const Float32 kDefaultCPUBudget = 0.8;
 
-static const UInt32 kNumWavetables = 10;
-static const UInt32 kNumSamplesPerWavetable = 262144;
-
-static const float kHarmonicsCompensation = 0.6667;
+// The most threads that render notes, counting the render thread, set with
+// kHSPadProperty_RenderThreads. Waking a worker costs about as much as
+// rendering a few notes, so each thread gets at least kMinNotesPerRenderThread.
+// parallel_bench measures both.
+static const UInt32 kMaxRenderThreads = 8;
+static const UInt32 kMinNotesPerRenderThread = 4;
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 
 enum {
-    kParameter_Volume = 0,
-    
-    kParameter_HarmonicsAmount = 1,
-    kParameter_HarmonicsCurveSteepness = 2,
-    kParameter_HarmonicsBalance = 3,
-    kParameter_HarmonicBandwidth = 4,
-    kParameter_HarmonicProfile = 5,
-    
-    kParameter_TouchSensitivity = 6,
-    kParameter_AttackTime = 7,
-    kParameter_ReleaseTime = 8,
-    
-	kNumberOfParameters=9
-};
-
-static int kNumParametersThatAreRelevantToWavetable = 5;
-static int kParametersThatAreRelevantToWavetable[] = {
-    kParameter_HarmonicsAmount,
-    kParameter_HarmonicsCurveSteepness,
-    kParameter_HarmonicsBalance,
-    kParameter_HarmonicBandwidth,
-    kParameter_HarmonicProfile
+    // UInt32, global scope. The number of notes that can sound at once, from 1
+    // to kMaxPolyphony. It can only be set while the AU is uninitialized.
+    kHSPadProperty_Polyphony = 64000,
+    // UInt32, global scope, read only. The number of notes that the voice
+    // governor allows at the moment; at most the polyphony.
+    kHSPadProperty_GovernedPolyphony = 64001,
+    // UInt32, global scope. The number of threads that render notes, counting
+    // the render thread, from 1 to kMaxRenderThreads. 1, the default, renders
+    // all notes on the render thread. It can only be set while the AU is
+    // uninitialized.
+    kHSPadProperty_RenderThreads = 64002,
+    // HSRenderStatsSnapshot, global scope. How long the render cycles since
+    // the AU was initialized took, and what they rendered; see HSRenderStats.h.
+    // It can be read from any thread while the AU renders. Setting it, to
+    // anything, starts the counts over.
+    kHSPadProperty_RenderStats = 64003,
+    // HSGeneratorStats, global scope. How long regenerating the wavetables
+    // after a parameter change takes, stage by stage; see HSGeneratorTrace.h.
+    // Setting it, to anything, starts the counts and the trace over. Only
+    // while the AU is initialized.
+    kHSPadProperty_GeneratorStats = 64004,
+    // CFDataRef, global scope, read only. The stages of the recent
+    // regenerations as JSON in the Chrome trace event format, for
+    // chrome://tracing or Perfetto. The caller releases it. Only while the AU
+    // is initialized.
+    kHSPadProperty_GeneratorTrace = 64005,
+    // HSMemoryStats, global scope. The bytes that the AU has allocated now,
+    // and the most it has had allocated, for each subsystem; see HSMemory.h.
+    // The peak includes the time while new wavetables replace the old ones;
+    // the wavetables are only counted while the AU is initialized.
+    // It can be read from any thread. Setting it, to anything, starts the
+    // peaks over from what is allocated now.
+    kHSPadProperty_MemoryStats = 64006
 };
 
+// The parameter IDs, defaults and ranges are in HSParameters.h
 static const CFStringRef kParamName_Volume                      = CFSTR("Volume");
-static const float       kDefaultValue_Volume                   = 0.0;
-static const float       kMinimumValue_Volume                   = -30.0;
-static const float       kMaximumValue_Volume                   = 6.0;
-
 static const CFStringRef kParamName_HarmonicsAmount             = CFSTR("Harmonics amount");
-static const float       kDefaultValue_HarmonicsAmount          = 5.0;
-static const float       kMinimumValue_HarmonicsAmount          = 0.0;
-static const float       kMaximumValue_HarmonicsAmount          = 15.0;
-
 static const CFStringRef kParamName_HarmonicsCurveSteepness     = CFSTR("Harmonics curve steepness");
-static const float       kDefaultValue_HarmonicsCurveSteepness  = 0.85;
-static const float       kMinimumValue_HarmonicsCurveSteepness  = 0.0;
-static const float       kMaximumValue_HarmonicsCurveSteepness  = 1.0;
-
 static const CFStringRef kParamName_HarmonicsBalance            = CFSTR("Harmonics balance");
-static const float       kDefaultValue_HarmonicsBalance         = 0.5;
-static const float       kMinimumValue_HarmonicsBalance         = 0.0;
-static const float       kMaximumValue_HarmonicsBalance         = 1.0;
-
 static const CFStringRef kParamName_HarmonicBandwidth           = CFSTR("Lushness");
-static const float       kDefaultValue_HarmonicBandwidth        = 53;
-static const float       kMinimumValue_HarmonicBandwidth        = 1.0;
-static const float       kMaximumValue_HarmonicBandwidth        = 100.0;
-
 static const CFStringRef kParamName_HarmonicProfile             = CFSTR("Lushness type");
-static const float       kDefaultValue_HarmonicProfile          = 1.0;
-static const float       kMinimumValue_HarmonicProfile          = 0.0;
-static const float       kMaximumValue_HarmonicProfile          = 2.0;
-
 static const CFStringRef kParamName_TouchSensitivity            = CFSTR("Touch sensitivity");
-static const float       kDefaultValue_TouchSensitivity         = 0.2;
-static const float       kMinimumValue_TouchSensitivity         = 0.0;
-static const float       kMaximumValue_TouchSensitivity         = 1.0;
-
 static const CFStringRef kParamName_AttackTime                  = CFSTR("Attack time");
-static const float       kDefaultValue_AttackTime               = 0.0;
-static const float       kMinimumValue_AttackTime               = 0.0;
-static const float       kMaximumValue_AttackTime               = 4000.0;
-
 static const CFStringRef kParamName_ReleaseTime                 = CFSTR("Release time");
-static const float       kDefaultValue_ReleaseTime              = 650.0;
-static const float       kMinimumValue_ReleaseTime              = 0.0;
-static const float       kMaximumValue_ReleaseTime              = 4000.0;
+static const CFStringRef kParamName_StereoWidth                 = CFSTR("Stereo width");
+static const CFStringRef kParamName_UnisonVoices                = CFSTR("Unison voices");
+static const CFStringRef kParamName_UnisonDetune                = CFSTR("Unison detune");
+static const CFStringRef kParamName_UnisonSpread                = CFSTR("Unison spread");
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 struct HSNote : public SynthNote
@@ -101,20 +89,36 @@ struct HSNote : public SynthNote
 	virtual					~HSNote() {}
 	
 	virtual bool			Attack(const MusicDeviceNoteParams &inParams);
-	virtual Float32			Amplitude() { return amp; } // used for finding quietest note for voice stealing.
+	virtual Float32			Amplitude() { return voice.getAmplitude(); } // used for finding quietest note for voice stealing.
     virtual OSStatus        Render(UInt64 inAbsoluteSampleFrame, UInt32 inNumFrames, AudioBufferList** inBufferList, UInt32 inOutBusCount);
-	
-    // Instance variables related to wavetable
-    int wavetable_num_samples;
-    int wavetable_sample_rate;
-    int wavetable_idx;
-    HSWavetable* wavetable;
     
-	double phase;
+    // Renders a block into bus and returns the frame of the render cycle where
+    // the note ended, or kVoiceNotEnded. It doesn't end the note or touch
+    // anything that other notes use, so notes can render on different threads,
+    // as long as the wavetables are locked while they do.
+    UInt32                  renderToBus(HSBus& bus, UInt64 inAbsoluteSampleFrame, UInt32 inNumFrames);
+    
+    // The synthesis; HSNote only tells it what AUInstrumentBase does with the note
+    HSVoice voice;
+};
+
+// Renders the notes of a group ordered by the wavetable that they read, so that
+// notes that share a table are rendered after each other.
+class HSGroupElement : public SynthGroupElement
+{
+	public:
+	HSGroupElement(AUInstrumentBase *audioUnit, UInt32 inElement, MIDIControlHandler *inHandler) :
+        SynthGroupElement(audioUnit, inElement, inHandler) {}
+    
+    protected:
+    virtual OSStatus        RenderNotes(SInt64 inAbsoluteSampleFrame, UInt32 inNumberFrames,
+                                        AudioBufferList** ioBufferList, UInt32 inOutBusCount);
     
-    // Instance variables related to attack envelope
-    double amp, maxamp;
-	double up_slope, dn_slope, fast_dn_slope;
+    private:
+    // Splits the notes into num_threads runs of neighbours in the array, and
+    // renders them on HSPad's render pool
+    void                    renderParallel(HSNote** notes, UInt32 num_notes, UInt32 num_threads,
+                                           SInt64 inAbsoluteSampleFrame, UInt32 inNumberFrames);
 };
 
 class HSPad : public AUMonotimbralInstrumentBase
@@ -123,16 +127,73 @@ class HSPad : public AUMonotimbralInstrumentBase
 	HSPad(ComponentInstance inComponentInstance);
 				
 	virtual OSStatus			Initialize();
+	virtual AUElement*			CreateElement(AudioUnitScope inScope, AudioUnitElement element);
+	virtual OSStatus			Render(AudioUnitRenderActionFlags &ioActionFlags, const AudioTimeStamp &inTimeStamp, UInt32 inNumberFrames);
+	virtual void				PrepareOutputBuffers(UInt32 inNumberFrames);
     virtual OSStatus            GenerateWavetables();
     virtual void                Cleanup();
 	virtual OSStatus			Version() { return kHSPadVersion; }
     
 	virtual OSStatus			GetParameterInfo(AudioUnitScope inScope, AudioUnitParameterID inParameterID, AudioUnitParameterInfo &outParameterInfo);
+    virtual OSStatus            SetParameter(AudioUnitParameterID inID, AudioUnitScope inScope, AudioUnitElement inElement, AudioUnitParameterValue inValue, UInt32 inBufferOffsetInFrames);
+    
+	virtual OSStatus			GetPropertyInfo(AudioUnitPropertyID inID, AudioUnitScope inScope, AudioUnitElement inElement, UInt32 &outDataSize, Boolean &outWritable);
+	virtual OSStatus			GetProperty(AudioUnitPropertyID inID, AudioUnitScope inScope, AudioUnitElement inElement, void *outData);
+	virtual OSStatus			SetProperty(AudioUnitPropertyID inID, AudioUnitScope inScope, AudioUnitElement inElement, const void *inData, UInt32 inDataSize);
     
     HSWavetable* getWavetable() { return wavetable; }
+    // The parameters of the current render cycle
+    const HSParameters& getParameters() const { return params; }
+    // The phases of the notes come from here. Notes start on the render
+    // thread, before the notes of the cycle are rendered.
+    HSRandom& getRandom() { return random; }
+    
+    // The buses that are spread to the output channels
+    HSBus& getBus() { return bus; }
+    
+    // NULL when the notes render on the render thread only
+    HSRenderPool* getRenderPool() { return render_pool; }
+    // Private buses for the notes that render on worker thread 1 and up; they
+    // are mixed into getBus() when the workers are done
+    HSBus& getWorkerBus(UInt32 thread) { return worker_buses[thread]; }
+    
+    HSRenderStats& getRenderStats() { return render_stats; }
+    // Converts a difference of mach_absolute_time() values
+    double ticksToSeconds(uint64_t ticks) const { return ticks*seconds_per_tick; }
 	private:
+    // Lowers the polyphony when render cycles come close to the deadline, and
+    // raises it again when there is room. Called at the start of a render cycle.
+    void                        governVoices();
+    void                        measureRenderLoad(uint64_t start_ticks, UInt32 inNumberFrames);
+    void                        snapshotParameters(UInt32 numChans);
+    // Counts the notes that are stolen for kHSPadProperty_RenderStats
+    virtual SynthNote*          VoiceStealing(UInt32 inFrame, bool inKillIt);
 	
-	HSNote mHSNotes[kNumNotes];
+	HSNote* mHSNotes;    // Allocated when initialized
+    UInt32 polyphony;
     AUParameterListenerRef parameterListener;
     HSWavetable* wavetable;
+    HSParameters params;
+    HSRandom random;
+    
+    float* mono_bus;
+    float* side_bus;
+    HSBus bus;
+    bool render_side;
+    
+    UInt32 render_threads;
+    HSRenderPool* render_pool;
+    float* worker_bus_data;
+    HSBus worker_buses[kMaxRenderThreads];
+    
+    // Voice governor state
+    Float32 cpu_budget;
+    UInt32 governed_polyphony;
+    double render_load;        // Smoothed share of the deadline that render cycles take
+    double seconds_per_tick;
+    bool log_started;          // Whether Initialize started hsLog()
+    
+    HSRenderStats render_stats;
+    // The voices and buses; the wavetables count their own memory
+    HSMemoryAccount memory;
 };
@@ -0,0 +1,101 @@
+/*
+ *  HSParameters.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSParameters.h"
+
+#include <math.h>
+#include <strings.h>
+
+struct ParameterInfo {
+    const char* name;
+    float min, max;
+};
+
+// In the order of the IDs. The names are the same as in HSPad.h.
+static const ParameterInfo kParameterInfo[kNumberOfParameters] = {
+    { "Volume",                    kMinimumValue_Volume,                  kMaximumValue_Volume },
+    { "Harmonics amount",          kMinimumValue_HarmonicsAmount,         kMaximumValue_HarmonicsAmount },
+    { "Harmonics curve steepness", kMinimumValue_HarmonicsCurveSteepness, kMaximumValue_HarmonicsCurveSteepness },
+    { "Harmonics balance",         kMinimumValue_HarmonicsBalance,        kMaximumValue_HarmonicsBalance },
+    { "Lushness",                  kMinimumValue_HarmonicBandwidth,       kMaximumValue_HarmonicBandwidth },
+    { "Lushness type",             kMinimumValue_HarmonicProfile,         kMaximumValue_HarmonicProfile },
+    { "Touch sensitivity",         kMinimumValue_TouchSensitivity,        kMaximumValue_TouchSensitivity },
+    { "Attack time",               kMinimumValue_AttackTime,              kMaximumValue_AttackTime },
+    { "Release time",              kMinimumValue_ReleaseTime,             kMaximumValue_ReleaseTime },
+    { "Stereo width",              kMinimumValue_StereoWidth,             kMaximumValue_StereoWidth },
+    { "Unison voices",             kMinimumValue_UnisonVoices,            kMaximumValue_UnisonVoices },
+    { "Unison detune",             kMinimumValue_UnisonDetune,            kMaximumValue_UnisonDetune },
+    { "Unison spread",             kMinimumValue_UnisonSpread,            kMaximumValue_UnisonSpread }
+};
+
+void HSParameters::setDefaults() {
+    values[kParameter_Volume]                  = kDefaultValue_Volume;
+
+    values[kParameter_HarmonicsAmount]         = kDefaultValue_HarmonicsAmount;
+    values[kParameter_HarmonicsCurveSteepness] = kDefaultValue_HarmonicsCurveSteepness;
+    values[kParameter_HarmonicsBalance]        = kDefaultValue_HarmonicsBalance;
+    values[kParameter_HarmonicBandwidth]       = kDefaultValue_HarmonicBandwidth;
+    values[kParameter_HarmonicProfile]         = kDefaultValue_HarmonicProfile;
+
+    values[kParameter_TouchSensitivity]        = kDefaultValue_TouchSensitivity;
+    values[kParameter_AttackTime]              = kDefaultValue_AttackTime;
+    values[kParameter_ReleaseTime]             = kDefaultValue_ReleaseTime;
+
+    values[kParameter_StereoWidth]             = kDefaultValue_StereoWidth;
+
+    values[kParameter_UnisonVoices]            = kDefaultValue_UnisonVoices;
+    values[kParameter_UnisonDetune]            = kDefaultValue_UnisonDetune;
+    values[kParameter_UnisonSpread]            = kDefaultValue_UnisonSpread;
+}
+
+void HSParameters::derive(double sample_rate, int num_channels) {
+    volume_factor = pow(10, values[kParameter_Volume]/10);
+    stereo_width = num_channels == 2 ? values[kParameter_StereoWidth] : 0;
+
+    int taps = (int) values[kParameter_UnisonVoices];
+    if (taps < 1) taps = 1;
+    if (taps > kMaxUnisonTaps) taps = kMaxUnisonTaps;
+    num_taps = taps;
+
+    // If the attack time is 0, the attack takes 50 frames. That is short enough
+    // to start the note seemingly immediately, yet avoids an ugly chipping sound
+    // that comes if the note starts at full amplitude.
+    float at = values[kParameter_AttackTime];
+    attack_frames = at == 0 ? 50.0 : at/1000.0 * sample_rate;
+
+    float rt = values[kParameter_ReleaseTime];
+    if (rt == 0) {
+        // This is not 0, because that makes an ugly chipping sound when the note
+        // is released. 0.99 is small enough to stop the note seemingly immediately
+        release_slope = 0.99;
+    }
+    else {
+        double num_frames = rt/1000.0 * sample_rate;
+        double off_threshold = 0.01; // 20dB
+        release_slope = pow(off_threshold, (double)1.0/num_frames);
+    }
+}
+
+const char* parameterName(int id) {
+    if (id < 0 || id >= kNumberOfParameters) return 0;
+    return kParameterInfo[id].name;
+}
+
+int parameterWithName(const char* name) {
+    for (int id=0; id<kNumberOfParameters; id++) {
+        if (!strcasecmp(kParameterInfo[id].name, name)) return id;
+    }
+    return -1;
+}
+
+bool parameterRange(int id, float* min, float* max) {
+    if (id < 0 || id >= kNumberOfParameters) return false;
+    *min = kParameterInfo[id].min;
+    *max = kParameterInfo[id].max;
+    return true;
+}
@@ -0,0 +1,133 @@
+/*
+ *  HSParameters.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSParameters_h__
+#define __HSParameters_h__
+
+#include "HSCacheLine.h"
+#include "HSOscillator.h"
+
+enum {
+    kParameter_Volume = 0,
+
+    kParameter_HarmonicsAmount = 1,
+    kParameter_HarmonicsCurveSteepness = 2,
+    kParameter_HarmonicsBalance = 3,
+    kParameter_HarmonicBandwidth = 4,
+    kParameter_HarmonicProfile = 5,
+
+    kParameter_TouchSensitivity = 6,
+    kParameter_AttackTime = 7,
+    kParameter_ReleaseTime = 8,
+
+    kParameter_StereoWidth = 9,
+
+    kParameter_UnisonVoices = 10,
+    kParameter_UnisonDetune = 11,
+    kParameter_UnisonSpread = 12,
+
+    kNumberOfParameters=13
+};
+
+// The parameters that the wavetables are generated from; changing one of them
+// regenerates the tables
+static const int kNumParametersThatAreRelevantToWavetable = 5;
+static const int kParametersThatAreRelevantToWavetable[] = {
+    kParameter_HarmonicsAmount,
+    kParameter_HarmonicsCurveSteepness,
+    kParameter_HarmonicsBalance,
+    kParameter_HarmonicBandwidth,
+    kParameter_HarmonicProfile
+};
+
+static const float       kDefaultValue_Volume                   = 0.0;
+static const float       kMinimumValue_Volume                   = -30.0;
+static const float       kMaximumValue_Volume                   = 6.0;
+
+static const float       kDefaultValue_HarmonicsAmount          = 5.0;
+static const float       kMinimumValue_HarmonicsAmount          = 0.0;
+static const float       kMaximumValue_HarmonicsAmount          = 15.0;
+
+static const float       kDefaultValue_HarmonicsCurveSteepness  = 0.85;
+static const float       kMinimumValue_HarmonicsCurveSteepness  = 0.0;
+static const float       kMaximumValue_HarmonicsCurveSteepness  = 1.0;
+
+static const float       kDefaultValue_HarmonicsBalance         = 0.5;
+static const float       kMinimumValue_HarmonicsBalance         = 0.0;
+static const float       kMaximumValue_HarmonicsBalance         = 1.0;
+
+static const float       kDefaultValue_HarmonicBandwidth        = 53;
+static const float       kMinimumValue_HarmonicBandwidth        = 1.0;
+static const float       kMaximumValue_HarmonicBandwidth        = 100.0;
+
+static const float       kDefaultValue_HarmonicProfile          = 1.0;
+static const float       kMinimumValue_HarmonicProfile          = 0.0;
+static const float       kMaximumValue_HarmonicProfile          = 2.0;
+
+static const float       kDefaultValue_TouchSensitivity         = 0.2;
+static const float       kMinimumValue_TouchSensitivity         = 0.0;
+static const float       kMaximumValue_TouchSensitivity         = 1.0;
+
+static const float       kDefaultValue_AttackTime               = 0.0;
+static const float       kMinimumValue_AttackTime               = 0.0;
+static const float       kMaximumValue_AttackTime               = 4000.0;
+
+static const float       kDefaultValue_ReleaseTime              = 650.0;
+static const float       kMinimumValue_ReleaseTime              = 0.0;
+static const float       kMaximumValue_ReleaseTime              = 4000.0;
+
+static const float       kDefaultValue_StereoWidth              = 0.0;
+static const float       kMinimumValue_StereoWidth              = 0.0;
+static const float       kMaximumValue_StereoWidth              = 1.0;
+
+static const float       kDefaultValue_UnisonVoices             = 1.0;
+static const float       kMinimumValue_UnisonVoices             = 1.0;
+static const float       kMaximumValue_UnisonVoices             = kMaxUnisonTaps;
+
+static const float       kDefaultValue_UnisonDetune             = 12.0;
+static const float       kMinimumValue_UnisonDetune             = 0.0;
+static const float       kMaximumValue_UnisonDetune             = 50.0;
+
+static const float       kDefaultValue_UnisonSpread             = 0.5;
+static const float       kMinimumValue_UnisonSpread             = 0.0;
+static const float       kMaximumValue_UnisonSpread             = 1.0;
+
+// The parameter values of a render cycle. The host takes this snapshot once at
+// the start of each cycle, and voices read it instead of looking each parameter
+// up, so all voices see the same values during the cycle. The values that the
+// voices derive from the parameters are computed here, once.
+struct HSParameters
+{
+    // The render threads read the snapshot, so it gets cache lines of its own
+    HSCacheLinePad pad;
+
+    float values[kNumberOfParameters];
+
+    float volume_factor;   // The linear output gain
+    float stereo_width;    // 0 for mono output
+    int num_taps;          // The unison voices, clamped to 1..kMaxUnisonTaps
+    double attack_frames;  // The attack time in frames; never 0
+    double release_slope;  // The factor that the envelope falls by each frame when released
+
+    HSCacheLinePad pad_after;
+
+    // Sets the values to the defaults
+    void setDefaults();
+    // Computes the derived values from the values
+    void derive(double sample_rate, int num_channels);
+};
+
+// The names that the AudioUnit shows for the parameters, for tools that read
+// parameter values from text. NULL if there is no such parameter.
+const char* parameterName(int id);
+// The ID of the parameter with the name, ignoring case, or -1
+int parameterWithName(const char* name);
+// Returns false if there is no such parameter
+bool parameterRange(int id, float* min, float* max);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ *  HSRandom.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSRandom_h__
+#define __HSRandom_h__
+
+#include <stdint.h>
+
+// A small random number generator (xorshift64*) for the phases of the
+// wavetables and the voices. Unlike rand(), it gives the same numbers with
+// every C library, and each user keeps its own state, so it is safe to use
+// from any thread without locking.
+class HSRandom {
+public:
+    explicit HSRandom(uint32_t seed_ = 1) { seed(seed_); }
+
+    void seed(uint32_t seed_) {
+        // The state must not be 0, and small seeds make the first numbers
+        // small, so the seed is spread over the bits with a splitmix64 step
+        uint64_t z = seed_ + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        state = z ^ (z >> 31);
+        if (!state) state = 0x9E3779B97F4A7C15ULL;
+    }
+
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (uint32_t) ((state * 0x2545F4914F6CDD1DULL) >> 32);
+    }
+
+    // In [0, 1)
+    double nextDouble() { return next() * (1.0/4294967296.0); }
+
+private:
+    uint64_t state;
+};
+
+#endif
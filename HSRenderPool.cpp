@@ -0,0 +1,177 @@
+/*
+ *  HSRenderPool.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSRenderPool.h"
+
+#include <errno.h>
+#include <sched.h>
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#endif
+
+// How many times the render thread polls for the workers before it starts to
+// yield the processor to them. The workers usually finish within a few
+// microseconds of the render thread, so yielding right away would mostly cost
+// a trip through the scheduler.
+static const int kJoinSpins = 2000;
+
+static inline void cpuPause() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void semaphoreInit(HSSemaphore* sem) {
+#if defined(__APPLE__)
+    semaphore_create(mach_task_self(), sem, SYNC_POLICY_FIFO, 0);
+#else
+    sem_init(sem, 0, 0);
+#endif
+}
+
+static void semaphoreDestroy(HSSemaphore* sem) {
+#if defined(__APPLE__)
+    semaphore_destroy(mach_task_self(), *sem);
+#else
+    sem_destroy(sem);
+#endif
+}
+
+static void semaphoreSignal(HSSemaphore* sem) {
+#if defined(__APPLE__)
+    semaphore_signal(*sem);
+#else
+    sem_post(sem);
+#endif
+}
+
+static void semaphoreWait(HSSemaphore* sem) {
+#if defined(__APPLE__)
+    while (semaphore_wait(*sem) == KERN_ABORTED) {}
+#else
+    while (sem_wait(sem) != 0 && errno == EINTR) {}
+#endif
+}
+
+HSRenderPool::HSRenderPool(int num_workers_, double period) {
+    num_workers = num_workers_;
+    workers = new Worker[num_workers];
+    period_ = period;
+
+    task.store(0, std::memory_order_relaxed);
+    context.store(0, std::memory_order_relaxed);
+    quit.store(false, std::memory_order_relaxed);
+    pending.store(0, std::memory_order_relaxed);
+
+    for (int i=0; i<num_workers; i++) {
+        workers[i].pool = this;
+        workers[i].index = i+1;
+        semaphoreInit(&workers[i].wake);
+        workers[i].started = pthread_create(&workers[i].thread, NULL, &HSRenderPool::workerThread, &workers[i]) == 0;
+    }
+}
+
+HSRenderPool::~HSRenderPool() {
+    quit.store(true, std::memory_order_release);
+    for (int i=0; i<num_workers; i++) {
+        if (!workers[i].started) continue;
+        semaphoreSignal(&workers[i].wake);
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i=0; i<num_workers; i++) {
+        semaphoreDestroy(&workers[i].wake);
+    }
+    delete [] workers;
+}
+
+void HSRenderPool::run(Task task_, void* context_, int num_tasks) {
+    int num_helpers = num_tasks-1;
+    if (num_helpers > num_workers) num_helpers = num_workers;
+
+    // Tasks that have no worker, because it couldn't be started, run here
+    int num_started = 0;
+    for (int i=0; i<num_helpers; i++) {
+        if (workers[i].started) num_started++;
+    }
+
+    if (num_started) {
+        task.store(task_, std::memory_order_relaxed);
+        context.store(context_, std::memory_order_relaxed);
+        pending.store(num_started, std::memory_order_release);
+        for (int i=0; i<num_helpers; i++) {
+            if (workers[i].started) semaphoreSignal(&workers[i].wake);
+        }
+    }
+
+    task_(context_, 0);
+    for (int i=0; i<num_helpers; i++) {
+        if (!workers[i].started) task_(context_, workers[i].index);
+    }
+    for (int i=num_helpers+1; i<num_tasks; i++) {
+        task_(context_, i);
+    }
+
+    int spins = 0;
+    while (pending.load(std::memory_order_acquire) != 0) {
+        if (spins < kJoinSpins) {
+            spins++;
+            cpuPause();
+        }
+        else {
+            sched_yield();
+        }
+    }
+}
+
+void* HSRenderPool::workerThread(void* data) {
+    Worker* worker = (Worker*) data;
+    HSRenderPool* pool = worker->pool;
+
+    pool->setRealTimePriority();
+
+    for (;;) {
+        semaphoreWait(&worker->wake);
+        if (pool->quit.load(std::memory_order_acquire)) break;
+
+        // The wake up orders the loads after the stores in run(): POSIX
+        // sem_post and sem_wait synchronize memory, and so do the Mach
+        // semaphore calls, which go through the kernel
+        Task task = pool->task.load(std::memory_order_relaxed);
+        void* context = pool->context.load(std::memory_order_relaxed);
+        task(context, worker->index);
+
+        pool->pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    return NULL;
+}
+
+// Called on each worker thread. If the system doesn't allow it, the worker
+// keeps running with normal priority, which still works but makes the worker
+// more likely to miss the deadline.
+void HSRenderPool::setRealTimePriority() {
+#if defined(__APPLE__)
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    double ticks_per_second = 1e9 * timebase.denom / timebase.numer;
+
+    thread_time_constraint_policy_data_t policy;
+    policy.period = (uint32_t) (period_*ticks_per_second);
+    policy.computation = (uint32_t) (period_*ticks_per_second/2);
+    policy.constraint = (uint32_t) (period_*ticks_per_second);
+    policy.preemptible = 1;
+    thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY,
+                      (thread_policy_t) &policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+#else
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 10;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+}
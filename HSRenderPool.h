@@ -0,0 +1,76 @@
+/*
+ *  HSRenderPool.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSRenderPool_h__
+#define __HSRenderPool_h__
+
+#include <pthread.h>
+#include <atomic>
+#include "HSCacheLine.h"
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+typedef semaphore_t HSSemaphore;
+#else
+#include <semaphore.h>
+typedef sem_t HSSemaphore;
+#endif
+
+// A small pool of threads that help the render thread render notes. The render
+// thread hands out tasks with run(), does the first task itself and waits for
+// the workers to finish the others before it returns.
+//
+// Handing out the tasks and waiting for them doesn't lock or allocate: the
+// workers are woken with a semaphore each, and the render thread counts the
+// finished tasks with an atomic counter that it spins on. The workers only
+// sleep between render cycles.
+class HSRenderPool {
+public:
+    typedef void (*Task)(void* context, int task);
+
+    // Starts num_workers threads. period is the duration of a render cycle in
+    // seconds. The workers run with real time priority; on Mac OS X they get
+    // the same kind of time constraints as an audio thread with that period.
+    HSRenderPool(int num_workers, double period);
+    ~HSRenderPool();
+
+    int getNumWorkers() const { return num_workers; }
+
+    // Runs task(context, i) for each i from 0 to num_tasks-1, and returns when
+    // all of them are done. Task 0 runs on the calling thread and the others
+    // on the workers, so num_tasks can be at most getNumWorkers()+1. Only one
+    // thread may call this at a time.
+    void run(Task task, void* context, int num_tasks);
+
+private:
+    struct Worker {
+        HSRenderPool* pool;
+        int index;
+        pthread_t thread;
+        HSSemaphore wake;
+        bool started;
+    };
+
+    static void* workerThread(void* data);
+    void setRealTimePriority();
+
+    int num_workers;
+    double period_;
+    Worker* workers;
+
+    std::atomic<Task> task;
+    std::atomic<void*> context;
+    std::atomic<bool> quit;
+    // The tasks that the workers haven't finished yet. On a cache line of its
+    // own, since all threads write it.
+    HSCacheLinePad pad;
+    std::atomic<int> pending;
+    HSCacheLinePad pad_after;
+};
+
+#endif
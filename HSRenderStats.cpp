@@ -0,0 +1,186 @@
+/*
+ *  HSRenderStats.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSRenderStats.h"
+
+#include <math.h>
+#include <sched.h>
+#include <string.h>
+
+#include "HSJSON.h"
+
+static_assert(sizeof(HSRenderStatsSnapshot) % sizeof(uint64_t) == 0,
+              "HSRenderStatsSnapshot is copied a word at a time");
+
+static int timeBin(double seconds) {
+    double ns = seconds*1e9;
+    if (!(ns >= 2)) return 0;
+    int bin = ilogb(ns);
+    return bin < kRenderStatsTimeBins ? bin : kRenderStatsTimeBins-1;
+}
+
+static int loadBin(double load) {
+    if (!(load >= 0)) return 0;
+    double bin = load/kRenderStatsLoadStep;
+    return bin < kRenderStatsLoadBins-1 ? (int) bin : kRenderStatsLoadBins-1;
+}
+
+HSRenderStats::HSRenderStats() : reset_requested(false), sequence(0) {
+    memset(&stats, 0, sizeof(stats));
+    cycle_voice_seconds = 0;
+    cycle_voice_frames = 0;
+    cycle_max_voices = 0;
+    cycle_stolen_voices = 0;
+    last_dropped_events = 0;
+    for (int i=0; i<kNumWords; i++) words[i].store(0, std::memory_order_relaxed);
+}
+
+void HSRenderStats::addVoices(double seconds, uint32_t num_voices, uint32_t num_frames) {
+    cycle_voice_seconds += seconds;
+    cycle_voice_frames += (uint64_t) num_voices*num_frames;
+    if (num_voices > cycle_max_voices) cycle_max_voices = num_voices;
+}
+
+void HSRenderStats::endCycle(double seconds, uint32_t num_frames, double sample_rate, uint64_t dropped_events) {
+    if (reset_requested.load(std::memory_order_relaxed)) {
+        reset_requested.store(false, std::memory_order_relaxed);
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    double load = num_frames ? seconds*sample_rate/num_frames : 0;
+    stats.cycles++;
+    stats.frames += num_frames;
+    if (load > 1) stats.deadline_misses++;
+    stats.stolen_voices += cycle_stolen_voices;
+    stats.dropped_events += dropped_events-last_dropped_events;
+    last_dropped_events = dropped_events;
+
+    stats.total_seconds += seconds;
+    stats.total_voice_seconds += cycle_voice_seconds;
+    stats.voice_frames += cycle_voice_frames;
+    if (seconds > stats.max_seconds) stats.max_seconds = seconds;
+    if (load > stats.max_load) stats.max_load = load;
+
+    stats.cycle_time[timeBin(seconds)]++;
+    stats.load[loadBin(load)]++;
+    if (cycle_voice_frames) {
+        // The time per frame of one voice, times the frames of the cycle
+        stats.voice_time[timeBin(cycle_voice_seconds/cycle_voice_frames*num_frames)]++;
+    }
+    stats.voices[cycle_max_voices < (uint32_t) kRenderStatsVoiceBins ? cycle_max_voices : kRenderStatsVoiceBins-1]++;
+
+    cycle_voice_seconds = 0;
+    cycle_voice_frames = 0;
+    cycle_max_voices = 0;
+    cycle_stolen_voices = 0;
+
+    publish();
+}
+
+// The words are stored with release and loaded with acquire, so that a reader
+// that sees a word of the next copy also sees the odd sequence number that was
+// stored before it, and tries again. On x86 these are plain moves.
+void HSRenderStats::publish() {
+    uint32_t seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq+1, std::memory_order_relaxed);
+    const char* data = (const char*) &stats;
+    for (int i=0; i<kNumWords; i++) {
+        uint64_t word;
+        memcpy(&word, data + i*sizeof(word), sizeof(word));
+        words[i].store(word, std::memory_order_release);
+    }
+    sequence.store(seq+2, std::memory_order_release);
+}
+
+void HSRenderStats::read(HSRenderStatsSnapshot* out) const {
+    char* data = (char*) out;
+    for (;;) {
+        uint32_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        for (int i=0; i<kNumWords; i++) {
+            uint64_t word = words[i].load(std::memory_order_acquire);
+            memcpy(data + i*sizeof(word), &word, sizeof(word));
+        }
+        if (sequence.load(std::memory_order_relaxed) == before) return;
+    }
+}
+
+// The load that share p of the cycles stayed within, to the resolution of the
+// bins
+static double loadPercentile(const HSRenderStatsSnapshot& stats, double p) {
+    uint64_t count = 0;
+    for (int i=0; i<kRenderStatsLoadBins-1; i++) {
+        count += stats.load[i];
+        if (count >= p*stats.cycles) {
+            double top = (i+1)*kRenderStatsLoadStep;
+            return top < stats.max_load ? top : stats.max_load;
+        }
+    }
+    return stats.max_load;
+}
+
+static void writeTimeHistogram(FILE* f, const char* name, const uint64_t* bins, const char* pad) {
+    fprintf(f, "%s\"%s\": [", pad, name);
+    bool first = true;
+    for (int i=0; i<kRenderStatsTimeBins; i++) {
+        if (!bins[i]) continue;
+        fprintf(f, "%s{\"from_ns\": %.0f, \"count\": %llu}", first ? "" : ", ",
+                i ? ldexp(1, i) : 0, (unsigned long long) bins[i]);
+        first = false;
+    }
+    fprintf(f, "],\n");
+}
+
+void writeRenderStatsJSON(FILE* f, const HSRenderStatsSnapshot& stats, int indent) {
+    HSJSONIndent json(indent);
+    const char* pad = json.members();
+
+    double mean_frames = stats.cycles ? (double) stats.frames/stats.cycles : 0;
+    fprintf(f, "{\n");
+    fprintf(f, "%s\"cycles\": %llu,\n", pad, (unsigned long long) stats.cycles);
+    fprintf(f, "%s\"frames\": %llu,\n", pad, (unsigned long long) stats.frames);
+    fprintf(f, "%s\"deadline_misses\": %llu,\n", pad, (unsigned long long) stats.deadline_misses);
+    fprintf(f, "%s\"stolen_voices\": %llu,\n", pad, (unsigned long long) stats.stolen_voices);
+    fprintf(f, "%s\"dropped_events\": %llu,\n", pad, (unsigned long long) stats.dropped_events);
+    fprintf(f, "%s\"mean_cycle_us\": %.3f,\n", pad, stats.cycles ? stats.total_seconds/stats.cycles*1e6 : 0);
+    fprintf(f, "%s\"max_cycle_us\": %.3f,\n", pad, stats.max_seconds*1e6);
+    fprintf(f, "%s\"mean_voice_us\": %.3f,\n", pad,
+            stats.voice_frames ? stats.total_voice_seconds/stats.voice_frames*mean_frames*1e6 : 0);
+    fprintf(f, "%s\"max_load\": %.4f,\n", pad, stats.max_load);
+    fprintf(f, "%s\"load_percentiles\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p99.9\": %.2f},\n", pad,
+            loadPercentile(stats, 0.5), loadPercentile(stats, 0.9),
+            loadPercentile(stats, 0.99), loadPercentile(stats, 0.999));
+
+    writeTimeHistogram(f, "cycle_time", stats.cycle_time, pad);
+    writeTimeHistogram(f, "voice_time", stats.voice_time, pad);
+
+    fprintf(f, "%s\"load\": [", pad);
+    bool first = true;
+    for (int i=0; i<kRenderStatsLoadBins; i++) {
+        if (!stats.load[i]) continue;
+        fprintf(f, "%s{\"from\": %.2f, \"count\": %llu}", first ? "" : ", ",
+                i*kRenderStatsLoadStep, (unsigned long long) stats.load[i]);
+        first = false;
+    }
+    fprintf(f, "],\n");
+
+    fprintf(f, "%s\"voices\": [", pad);
+    first = true;
+    for (int i=0; i<kRenderStatsVoiceBins; i++) {
+        if (!stats.voices[i]) continue;
+        fprintf(f, "%s{\"voices\": %d, \"count\": %llu}", first ? "" : ", ",
+                i, (unsigned long long) stats.voices[i]);
+        first = false;
+    }
+    fprintf(f, "]\n");
+
+    fprintf(f, "%s}", json.brace());
+}
@@ -0,0 +1,107 @@
+/*
+ *  HSRenderStats.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSRenderStats_h__
+#define __HSRenderStats_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include "HSVoice.h"
+
+// Times are binned by powers of two: bin i counts times from 2^i up to 2^(i+1)
+// nanoseconds. Bin 0 also counts shorter times, and the last bin longer ones.
+static const int kRenderStatsTimeBins = 32;
+// The load is the share of the deadline that a cycle takes, in steps of 1%
+// from 0 to 200%. The last bin counts cycles that took twice the deadline or
+// more.
+static const int kRenderStatsLoadBins = 201;
+static const double kRenderStatsLoadStep = 0.01;
+// Bin i counts cycles that rendered i voices
+static const int kRenderStatsVoiceBins = kMaxNumNotes+1;
+
+// What HSRenderStats has counted since it was created or reset. This is the
+// value of kHSPadProperty_RenderStats, so it only has fixed size fields.
+struct HSRenderStatsSnapshot {
+    uint64_t cycles;
+    uint64_t frames;
+    // Cycles that took longer than the audio that they rendered lasts
+    uint64_t deadline_misses;
+    // Notes that were fast released or cut off to make room for others,
+    // including the ones that the voice governor let go
+    uint64_t stolen_voices;
+    // MIDI events that didn't fit in the event queue
+    uint64_t dropped_events;
+
+    double total_seconds;        // The time that the cycles took together
+    double total_voice_seconds;  // Of that, the time that rendering voices took
+    uint64_t voice_frames;       // The frames that the voices rendered, all voices counted
+    double max_seconds;          // The slowest cycle
+    double max_load;             // The highest share of the deadline that a cycle took
+
+    // The time that each cycle took
+    uint64_t cycle_time[kRenderStatsTimeBins];
+    // The time that one voice took to render a cycle, on average over the
+    // voices of the cycle. With several render threads this is wall clock
+    // time, which is what counts against the deadline.
+    uint64_t voice_time[kRenderStatsTimeBins];
+    uint64_t load[kRenderStatsLoadBins];
+    // The most voices that rendered at once during each cycle
+    uint64_t voices[kRenderStatsVoiceBins];
+};
+
+// Counts how long render cycles take and what they render, for finding the
+// polyphony and buffer size that a machine can take.
+//
+// The render thread records each cycle with the methods in the first group
+// below, and any other thread can read the counts with read(). Neither side
+// locks or waits for the other: the render thread keeps the counts to itself
+// and copies them at the end of each cycle to atomic words that read() copies
+// from, with a sequence number that tells read() to try again when it read
+// while they were being written.
+class HSRenderStats {
+public:
+    HSRenderStats();
+
+    // Render thread. A sub-block of the cycle rendered num_voices voices, for
+    // num_frames frames each, in seconds.
+    void addVoices(double seconds, uint32_t num_voices, uint32_t num_frames);
+    void addStolenVoice() { cycle_stolen_voices++; }
+    // Render thread. The cycle rendered num_frames frames in seconds.
+    // dropped_events is the number of events that the event queue has dropped
+    // since it was created.
+    void endCycle(double seconds, uint32_t num_frames, double sample_rate, uint64_t dropped_events);
+
+    // Any thread
+    void read(HSRenderStatsSnapshot* out) const;
+    // Any thread. The counts start over at the end of the next cycle.
+    void reset() { reset_requested.store(true, std::memory_order_relaxed); }
+
+private:
+    void publish();
+
+    // The counts, which only the render thread touches
+    HSRenderStatsSnapshot stats;
+    double cycle_voice_seconds;
+    uint64_t cycle_voice_frames;
+    uint32_t cycle_max_voices;
+    uint64_t cycle_stolen_voices;
+    uint64_t last_dropped_events;
+
+    std::atomic<bool> reset_requested;
+    // Odd while the words are being written
+    std::atomic<uint32_t> sequence;
+    static const int kNumWords = sizeof(HSRenderStatsSnapshot)/sizeof(uint64_t);
+    std::atomic<uint64_t> words[kNumWords];
+};
+
+// Writes the counts as a JSON object, with the bins of the histograms and
+// percentiles of the load, indented as HSJSONIndent describes.
+void writeRenderStatsJSON(FILE* f, const HSRenderStatsSnapshot& stats, int indent = 2);
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ *  HSVoice.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSVoice.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "HSWavetable.h"
+
+bool HSBus::beginWrite(uint32_t offset, uint32_t num_frames) {
+    if (offset < frames_written) return false;
+
+    // Clear the frames that no voice rendered, like before a voice that starts
+    // in the middle of a sub-block
+    uint32_t gap = offset-frames_written;
+    if (gap) {
+        memset(mono+frames_written, 0, sizeof(float)*gap);
+        if (side) memset(side+frames_written, 0, sizeof(float)*gap);
+    }
+    frames_written = offset+num_frames;
+    return true;
+}
+
+void HSBus::mixFrom(const HSBus& other, uint32_t offset, uint32_t num_frames) {
+    if (other.frames_written <= offset) return;
+
+    if (beginWrite(offset, num_frames)) {
+        memcpy(mono+offset, other.mono+offset, sizeof(float)*num_frames);
+        if (side) memcpy(side+offset, other.side+offset, sizeof(float)*num_frames);
+        return;
+    }
+
+    // Plain loops over restrict pointers, which the compiler vectorizes
+    float* __restrict dst = mono+offset;
+    const float* __restrict src = other.mono+offset;
+    for (uint32_t frame=0; frame<num_frames; ++frame) dst[frame] += src[frame];
+    if (side) {
+        float* __restrict side_dst = side+offset;
+        const float* __restrict side_src = other.side+offset;
+        for (uint32_t frame=0; frame<num_frames; ++frame) side_dst[frame] += side_src[frame];
+    }
+}
+
+void HSBus::spread(float* left, float* right, uint32_t num_frames, float start_width, float end_width) {
+    if (frames_written == 0) {
+        // No voice rendered, and the buses hold whatever the previous cycle left
+        memset(left, 0, sizeof(float)*num_frames);
+        if (right) memset(right, 0, sizeof(float)*num_frames);
+        return;
+    }
+
+    beginWrite(num_frames, 0); // Clears the frames after the last voice
+
+    memcpy(left, mono, sizeof(float)*num_frames);
+    if (!right) return;
+
+    if (side) {
+        float width = start_width;
+        float width_step = (end_width-start_width)/num_frames;
+        for (uint32_t frame=0; frame<num_frames; ++frame) {
+            right[frame] = mono[frame] + width*(side[frame]-mono[frame]);
+            width += width_step;
+        }
+    }
+    else {
+        memcpy(right, mono, sizeof(float)*num_frames);
+    }
+}
+
+void HSVoice::start(HSWavetable* wavetable_, const HSParameters& params, double sample_rate_,
+                    double frequency_, int velocity, float pitch_bend_, uint32_t start_offset_,
+                    HSRandom& random) {
+    wavetable = wavetable_;
+    sample_rate = sample_rate_;
+
+    pitch_bend = pitch_bend_;
+    bend_factor = pow(2., pitch_bend/12.);
+    note_frequency = frequency_;
+    frequency = -1;
+    volume = -1;
+    start_frame = -1;
+    start_offset = start_offset_;
+
+    float freq = note_frequency*bend_factor*(1-params.values[kParameter_TouchSensitivity]*pow(velocity/127., 2.));
+    wavetable_level = wavetable->closestMatchingLevel(freq);
+    wavetable_idx = (int) wavetable_level;
+    mip_level = -1;
+    wavetable_num_samples = wavetable->getNumSamples();
+    wavetable_sample_rate = wavetable->getSampleRate();
+
+    num_taps = params.num_taps;
+    float detune = params.values[kParameter_UnisonDetune];
+    float spread = params.values[kParameter_UnisonSpread];
+    for (int tap=0; tap<num_taps; tap++) {
+        float position = unisonTapPosition(tap, num_taps);
+        tap_ratios[tap] = pow(2., position*detune/1200.);
+        tap_pans[tap] = position*spread;
+    }
+
+    for (int tap=0; tap<num_taps; tap++) {
+        for (int i=0; i<kNumWavetables; i++) {
+            phases[tap][i] = random.nextDouble()*wavetable_num_samples;
+        }
+    }
+    amp = 0.;
+    maxamp = 0.4 * pow(velocity/127., 2.);
+
+    up_slope = maxamp / params.attack_frames;
+    dn_slope = params.release_slope;
+
+    fast_dn_slope = -maxamp / (0.005 * sample_rate);
+}
+
+template <bool kWrite>
+inline void HSVoice::renderFrame(HSOscillator& osc, float* mono, float* side, uint32_t frame) {
+    if (side) {
+        float side_out;
+        float mono_out = osc.next(side_out) * amp;
+        if (kWrite) {
+            mono[frame] = mono_out;
+            side[frame] = side_out * amp;
+        }
+        else {
+            mono[frame] += mono_out;
+            side[frame] += side_out * amp;
+        }
+    }
+    else {
+        if (kWrite) mono[frame] = osc.next() * amp;
+        else mono[frame] += osc.next() * amp;
+    }
+}
+
+template <bool kWrite>
+uint32_t HSVoice::renderFrames(HSOscillator& osc, HSEnvelopeStage stage, float* mono, float* side, uint32_t num_frames) {
+    uint32_t endFrame = kVoiceNotEnded;
+    switch (stage) {
+        case kEnvelope_Held:
+            for (uint32_t frame=0; frame<num_frames; ++frame) {
+                if (amp < maxamp) amp += up_slope;
+
+                renderFrame<kWrite>(osc, mono, side, frame);
+            }
+            break;
+
+        case kEnvelope_Released:
+            for (uint32_t frame=0; frame<num_frames; ++frame) {
+                if (amp > kNoteOffLevel) amp *= dn_slope;
+                else if (endFrame == kVoiceNotEnded) { endFrame = frame; amp = 0; }
+
+                renderFrame<kWrite>(osc, mono, side, frame);
+            }
+            break;
+
+        case kEnvelope_FastReleased:
+            for (uint32_t frame=0; frame<num_frames; ++frame) {
+                if (amp > 0.0) amp += fast_dn_slope;
+                // The linear slope overshoots zero on the last step
+                else if (endFrame == kVoiceNotEnded) { endFrame = frame; amp = 0; }
+
+                renderFrame<kWrite>(osc, mono, side, frame);
+            }
+            break;
+
+        default:
+            // Nothing is rendered, but the frames must still be written
+            if (kWrite) {
+                memset(mono, 0, sizeof(float)*num_frames);
+                if (side) memset(side, 0, sizeof(float)*num_frames);
+            }
+            break;
+    }
+    return endFrame;
+}
+
+uint32_t HSVoice::render(HSBus& bus, int64_t cycle_start, int64_t inFrame, uint32_t num_frames,
+                         HSEnvelopeStage stage, float bend, const HSParameters& params) {
+    // The voice is started before the render cycle that it starts in is
+    // rendered, so the start offset is relative to the first cycle it renders in.
+    if (start_frame < 0) start_frame = cycle_start + start_offset;
+
+    // The render cycle can be split into sub-blocks, so this block doesn't
+    // necessarily start at the beginning of the bus.
+    uint32_t skip = 0;
+    if (start_frame > inFrame) {
+        if (start_frame - inFrame >= num_frames) return kVoiceNotEnded;
+        skip = (uint32_t) (start_frame - inFrame);
+    }
+    uint32_t offset = (uint32_t) (inFrame - cycle_start) + skip;
+    num_frames -= skip;
+
+    float *mono = bus.mono + offset;
+    float *side = bus.side;
+    if (side) side += offset;
+
+    // Control rate values for this block. The frequency and volume at the start
+    // of the block are the ones that the previous block ended with.
+    if (bend != pitch_bend) {
+        pitch_bend = bend;
+        bend_factor = pow(2., pitch_bend/12.);
+    }
+    double start_frequency = frequency;
+    frequency = note_frequency*bend_factor;
+    if (start_frequency < 0) start_frequency = frequency;
+
+    float start_volume = volume;
+    volume = params.volume_factor;
+    if (start_volume < 0) start_volume = volume;
+
+    // The phases are kept for kNumWavetables tables; a voice plays the higher
+    // notes of a table with more of them from the last one that it keeps.
+    int num_wavetables = wavetable->getNumWavetables();
+    if (num_wavetables > kNumWavetables) num_wavetables = kNumWavetables;
+    double rate_factor = ((double)wavetable_sample_rate)/sample_rate;
+
+    // Pick the mip level for this block. Pitch bend can move the note far enough
+    // up that the tables that match its timbre would alias, so it can be higher
+    // than wavetable_level. The highest unison tap is the one that aliases first.
+    float level = wavetable->aliasFreeLevel(frequency*tap_ratios[num_taps-1], sample_rate);
+    if (level < wavetable_level) level = wavetable_level;
+    if (level > num_wavetables-1) level = num_wavetables-1;
+    if (mip_level < 0) mip_level = level;
+
+    // Don't move past more than one table boundary per block, so that the gain
+    // ramps never need more than two tables.
+    if (level > floorf(mip_level)+1) level = floorf(mip_level)+1;
+    if (level < ceilf(mip_level)-1) level = ceilf(mip_level)-1;
+
+    int lo_idx = (int) (level < mip_level ? level : mip_level);
+    if (lo_idx > num_wavetables-1) lo_idx = num_wavetables-1;
+    int hi_idx = lo_idx+1;
+    wavetable_idx = lo_idx;
+
+    HSOscillator osc;
+    osc.num_samples = wavetable_num_samples;
+    osc.lo_table = wavetable->getWavetableData(lo_idx);
+    osc.hi_table = 0;
+
+    // The taps are uncorrelated, so they are scaled to keep the power of the
+    // voice independent of the number of taps. Panning a tap to one side only
+    // attenuates it on the other side; the left channel is the mono bus, so
+    // the tap gains fade in the panning as the stereo width is increased.
+    osc.num_taps = num_taps;
+    float tap_scale = 1/sqrtf(num_taps);
+    float width = params.stereo_width;
+    for (int tap=0; tap<num_taps; tap++) {
+        float pan = tap_pans[tap];
+        osc.lo_phases[tap] = phases[tap][lo_idx];
+        osc.tap_ratios[tap] = tap_ratios[tap];
+        osc.tap_gains[tap] = (1 - width*(pan > 0 ? pan : 0))*tap_scale;
+        osc.tap_side_gains[tap] = (1 + (pan < 0 ? pan : 0))*tap_scale;
+    }
+
+    float hi_start = 0, hi_end = 0;
+    if (hi_idx < num_wavetables) {
+        hi_start = mipLevelGain(mip_level, hi_idx);
+        hi_end = mipLevelGain(level, hi_idx);
+    }
+    double lo_base = wavetable->getBaseFrequency(lo_idx);
+    double hi_base = lo_base;
+    if (hi_start != 0 || hi_end != 0) {
+        osc.hi_table = wavetable->getWavetableData(hi_idx);
+        for (int tap=0; tap<num_taps; tap++) {
+            osc.hi_phases[tap] = phases[tap][hi_idx];
+        }
+        hi_base = wavetable->getBaseFrequency(hi_idx);
+    }
+
+    // The volume is folded into the crossfade gains, so it costs nothing per sample
+    osc.setGains(mipLevelGain(mip_level, lo_idx)*start_volume, mipLevelGain(level, lo_idx)*volume,
+                 hi_start*start_volume, hi_end*volume,
+                 num_frames);
+    osc.setIncrements(start_frequency/lo_base*rate_factor, frequency/lo_base*rate_factor,
+                      start_frequency/hi_base*rate_factor, frequency/hi_base*rate_factor,
+                      num_frames);
+    mip_level = level;
+
+    // The first voice to render these frames stores its output, which saves
+    // clearing the buses every cycle
+    uint32_t endFrame;
+    if (bus.beginWrite(offset, num_frames))
+        endFrame = renderFrames<true>(osc, stage, mono, side, num_frames);
+    else
+        endFrame = renderFrames<false>(osc, stage, mono, side, num_frames);
+    if (endFrame != kVoiceNotEnded)
+        endFrame += offset;
+
+    // Most of the time, the next block continues where this one ended, so
+    // start fetching what it will read while other voices are rendered.
+    osc.prefetchNextBlock(num_frames, side != 0);
+
+    for (int tap=0; tap<num_taps; tap++) {
+        phases[tap][lo_idx] = osc.lo_phases[tap];
+        if (osc.hi_table) phases[tap][hi_idx] = osc.hi_phases[tap];
+    }
+
+    return endFrame;
+}
@@ -0,0 +1,156 @@
+/*
+ *  HSVoice.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSVoice_h__
+#define __HSVoice_h__
+
+#include <stdint.h>
+#include "HSOscillator.h"
+#include "HSParameters.h"
+#include "HSRandom.h"
+
+class HSWavetable;
+
+static const int kNumWavetables = 10;
+static const int kNumSamplesPerWavetable = 262144;
+
+static const float kHarmonicsCompensation = 0.6667;
+
+// A released voice ends when its envelope falls below this level, -100 dB. The
+// release envelope is exponential, so it would otherwise never reach zero.
+static const double kNoteOffLevel = 0.00001;
+
+// The number of voices that can sound at once. Voices that are fast released
+// to make room for new ones keep sounding for a little while, so the voice
+// pool has kNumFastReleaseNotes more voices than that.
+static const int kDefaultPolyphony = 10;
+static const int kMaxPolyphony = 64;
+static const int kNumFastReleaseNotes = 4;
+static const int kMaxNumNotes = kMaxPolyphony + kNumFastReleaseNotes;
+
+// Returned by HSVoice::render when the voice is still sounding
+static const uint32_t kVoiceNotEnded = 0xFFFFFFFF;
+
+// Voices render into a mono bus that is spread to the output channels once per
+// render cycle. The side bus holds the same voices read at an offset phase for
+// the right channel, and is NULL when the stereo width is zero.
+//
+// The buses aren't cleared before the voices render. A voice calls beginWrite
+// with the frames that it is about to render, and it returns true if the voice
+// is the first to render them, in which case the voice should store its output
+// instead of adding it. Voices render whole sub-blocks in order, so the frames
+// that have been written are always a prefix of the buses.
+struct HSBus
+{
+    float* mono;
+    float* side;
+    uint32_t frames_written;
+
+    bool beginWrite(uint32_t offset, uint32_t num_frames);
+    // Adds the frames of another bus to this one, if a voice rendered them
+    void mixFrom(const HSBus& other, uint32_t offset, uint32_t num_frames);
+    // Writes the first num_frames frames to the output channels. The left
+    // channel is the mono bus, and the right channel fades from the mono bus
+    // towards the side bus by the stereo width, which ramps from start_width to
+    // end_width over the frames. right is NULL for mono output.
+    void spread(float* left, float* right, uint32_t num_frames, float start_width, float end_width);
+};
+
+// The stage of the envelope of a voice. The host keeps track of the keys and
+// pedals and tells the voice which stage it is in.
+enum HSEnvelopeStage {
+    kEnvelope_Held,          // Attacks, and then holds the level
+    kEnvelope_Released,      // Falls exponentially by the release time
+    kEnvelope_FastReleased,  // Falls linearly in 5 ms, to make room for another voice
+    kEnvelope_Off            // Renders silence
+};
+
+// The synthesis of one note: the wavetable oscillator with its unison taps and
+// mip level crossfading, and the envelope. It doesn't know about any plug-in
+// API; HSNote plays it in the AudioUnit, and HSEngine plays it elsewhere.
+class HSVoice
+{
+public:
+    // Starts the voice. frequency is the frequency of the note in Hz without
+    // pitch bend, and pitch_bend is in semitones. start_offset is the frame of
+    // the first render cycle that the voice renders in where it starts.
+    //
+    // The unison taps start at random phases, drawn from random, so that a
+    // host that seeds it can render the same notes the same way every time.
+    void start(HSWavetable* wavetable, const HSParameters& params, double sample_rate,
+               double frequency, int velocity, float pitch_bend, uint32_t start_offset,
+               HSRandom& random);
+
+    // Renders num_frames frames from the sample time frame into bus, where the
+    // first frame of the bus is the sample time cycle_start. Returns the frame
+    // of the bus where the voice ended, or kVoiceNotEnded.
+    //
+    // It only touches the voice and the frames of the bus, so voices can render
+    // on different threads into different buses, as long as the wavetables are
+    // locked while they do.
+    uint32_t render(HSBus& bus, int64_t cycle_start, int64_t frame, uint32_t num_frames,
+                    HSEnvelopeStage stage, float pitch_bend, const HSParameters& params);
+
+    // The envelope level; the quietest voice is the one to steal
+    float getAmplitude() const { return amp; }
+    // The lower of the two tables that the previous block read
+    int getWavetableIndex() const { return wavetable_idx; }
+
+private:
+    // Renders num_frames frames with the envelope of the stage, and returns the
+    // frame where the envelope reached zero, or kVoiceNotEnded. kWrite stores
+    // the output in the buses instead of adding it to them.
+    template <bool kWrite>
+    uint32_t renderFrames(HSOscillator& osc, HSEnvelopeStage stage, float* mono, float* side, uint32_t num_frames);
+    template <bool kWrite>
+    inline void renderFrame(HSOscillator& osc, float* mono, float* side, uint32_t frame);
+
+    double sample_rate;
+
+    // Instance variables related to wavetable
+    int wavetable_num_samples;
+    int wavetable_sample_rate;
+    HSWavetable* wavetable;
+
+    // The fractional wavetable index that matches the timbre of the note. The
+    // rendered level can be higher than this to avoid aliasing.
+    float wavetable_level;
+    // The level that was rendered in the previous block, or -1 before the first block.
+    float mip_level;
+    // The lower of the two tables that are currently crossfaded.
+    int wavetable_idx;
+
+    // Unison taps. The detune ratio is relative to the note frequency, and the
+    // pan is from -1 (left) to 1 (right).
+    int num_taps;
+    double tap_ratios[kMaxUnisonTaps];
+    float tap_pans[kMaxUnisonTaps];
+
+    // Each tap has its own phase in each table, since the tables have different
+    // base frequencies
+    double phases[kMaxUnisonTaps][kNumWavetables];
+
+    // Control rate state. These are the values that the previous block ended
+    // with; each block ramps linearly from them to the new values.
+    double note_frequency; // Without pitch bend
+    float pitch_bend;
+    double bend_factor;    // pow(2, pitch_bend/12), only recomputed when the bend changes
+    double frequency;      // -1 before the first block
+    float volume;          // -1 before the first block
+
+    // The sample time of the first frame of the voice, or -1 before the first
+    // block. The voice can start in the middle of a block.
+    int64_t start_frame;
+    uint32_t start_offset;
+
+    // Instance variables related to attack envelope
+    double amp, maxamp;
+    double up_slope, dn_slope, fast_dn_slope;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ *  HSWavWriter.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#include "HSWavWriter.h"
+
+#include <string.h>
+
+static const int kFormatTag_PCM = 1;
+static const int kFormatTag_Float = 3;
+
+// The size of the buffer that the file is written from
+static const size_t kBufferSize = 1 << 20;
+// The frames that are converted at a time
+static const uint32_t kChunkFrames = 1024;
+
+// WAV files are little endian, whatever the machine is
+static uint8_t* put16(uint8_t* p, uint32_t value) {
+    p[0] = value; p[1] = value >> 8;
+    return p+2;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t value) {
+    p[0] = value; p[1] = value >> 8; p[2] = value >> 16; p[3] = value >> 24;
+    return p+4;
+}
+
+static uint8_t* putTag(uint8_t* p, const char* tag) {
+    memcpy(p, tag, 4);
+    return p+4;
+}
+
+HSWavWriter::HSWavWriter() {
+    f = 0;
+}
+
+HSWavWriter::~HSWavWriter() {
+    close();
+}
+
+bool HSWavWriter::open(const char* path, int sample_rate_, int num_channels_, Format format_, Dither dither_) {
+    close();
+
+    sample_rate = sample_rate_;
+    num_channels = num_channels_;
+    format = format_;
+    dither = dither_;
+    num_frames = 0;
+    num_clipped = 0;
+    failed = false;
+    noise_index = 0;
+
+    buffer.resize(kBufferSize);
+    buffer_used = 0;
+    samples.resize(kChunkFrames);
+
+    f = fopen(path, "wb");
+    if (!f) return false;
+    // Everything is written from the buffer, so stdio doesn't need one
+    setvbuf(f, 0, _IONBF, 0);
+
+    // The sizes are written as 0 for now
+    if (!writeHeader()) {
+        fclose(f);
+        f = 0;
+        return false;
+    }
+    return true;
+}
+
+int HSWavWriter::bytesPerSample() const {
+    switch (format) {
+        case kFormat_PCM16: return 2;
+        case kFormat_PCM24: return 3;
+        default: return 4;
+    }
+}
+
+bool HSWavWriter::writeHeader() {
+    bool is_float = format == kFormat_Float32;
+    int bytes_per_sample = bytesPerSample();
+    uint64_t data_size = num_frames*num_channels*bytes_per_sample;
+    // RIFF sizes are 32 bit; a longer file gets a header that says as much as fits
+    if (data_size > 0xFFFFFFFF-64) data_size = 0xFFFFFFFF-64;
+
+    // Non-PCM formats need the extension size in the format chunk, and a fact
+    // chunk with the number of frames
+    uint32_t fmt_size = is_float ? 18 : 16;
+    uint32_t fact_size = is_float ? 12 : 0;
+
+    // Chunks have an even size; an odd data chunk is followed by a pad byte
+    uint32_t pad = data_size & 1;
+
+    uint8_t header[64];
+    uint8_t* p = header;
+    p = putTag(p, "RIFF");
+    p = put32(p, 4 + 8+fmt_size + fact_size + 8+data_size+pad);
+    p = putTag(p, "WAVE");
+
+    p = putTag(p, "fmt ");
+    p = put32(p, fmt_size);
+    p = put16(p, is_float ? kFormatTag_Float : kFormatTag_PCM);
+    p = put16(p, num_channels);
+    p = put32(p, sample_rate);
+    p = put32(p, sample_rate*num_channels*bytes_per_sample);  // Bytes per second
+    p = put16(p, num_channels*bytes_per_sample);              // Bytes per frame
+    p = put16(p, 8*bytes_per_sample);
+    if (is_float) {
+        p = put16(p, 0);
+        p = putTag(p, "fact");
+        p = put32(p, 4);
+        p = put32(p, num_frames > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) num_frames);
+    }
+
+    p = putTag(p, "data");
+    p = put32(p, data_size);
+
+    return fwrite(header, 1, p-header, f) == (size_t) (p-header);
+}
+
+// The dither noise of a sample: the difference of two uniform variables, which
+// has a triangular distribution, in LSBs. Both come from a hash of the index of
+// the sample, the two halves of its output, so that there is no state carried
+// from one sample to the next and the loop below vectorizes.
+static inline float ditherNoise(uint32_t index) {
+    uint32_t x = index;
+    x ^= x >> 16; x *= 0x7feb352d; x ^= x >> 15; x *= 0x846ca68b; x ^= x >> 16;
+    return ((int32_t) (x & 0xFFFF) - (int32_t) (x >> 16))*(1.f/65536);
+}
+
+template <bool kDither>
+static uint32_t quantize(const float* __restrict in, int32_t* __restrict out, uint32_t num_samples,
+                         float full_scale, uint32_t noise_index) {
+    uint32_t clipped = 0;
+    for (uint32_t i=0; i<num_samples; i++) {
+        float value = in[i];
+        clipped += (value > 1.f) | (value < -1.f);
+        float x = value*full_scale;
+        if (kDither) x += ditherNoise(noise_index+i);
+        x = x > full_scale ? full_scale : x;
+        x = x < -full_scale ? -full_scale : x;
+        // Round half away from zero; the conversion truncates
+        float half = x < 0 ? -0.5f : 0.5f;
+        out[i] = (int32_t) (x+half);
+    }
+    return clipped;
+}
+
+void HSWavWriter::convert(const float* const* channels, uint32_t offset, uint32_t frames, uint8_t* out) {
+    const int frame_bytes = num_channels*bytesPerSample();
+    const float full_scale = format == kFormat_PCM16 ? 32767.f : 8388607.f;
+
+    for (int channel=0; channel<num_channels; channel++) {
+        const float* in = channels[channel]+offset;
+        uint8_t* p = out + channel*bytesPerSample();
+
+        if (format == kFormat_Float32) {
+            for (uint32_t i=0; i<frames; i++, p+=frame_bytes) {
+                uint32_t bits;
+                memcpy(&bits, &in[i], 4);
+                put32(p, bits);
+            }
+            continue;
+        }
+
+        int32_t* s = &samples[0];
+        if (dither == kDither_TPDF) {
+            num_clipped += quantize<true>(in, s, frames, full_scale, noise_index);
+            noise_index += frames;
+        }
+        else {
+            num_clipped += quantize<false>(in, s, frames, full_scale, 0);
+        }
+
+        if (format == kFormat_PCM16) {
+            for (uint32_t i=0; i<frames; i++, p+=frame_bytes) put16(p, s[i]);
+        }
+        else {
+            for (uint32_t i=0; i<frames; i++, p+=frame_bytes) {
+                p[0] = s[i]; p[1] = s[i] >> 8; p[2] = s[i] >> 16;
+            }
+        }
+    }
+}
+
+bool HSWavWriter::flush() {
+    if (buffer_used && fwrite(&buffer[0], 1, buffer_used, f) != buffer_used) failed = true;
+    buffer_used = 0;
+    return !failed;
+}
+
+bool HSWavWriter::write(const float* const* channels, uint32_t frames) {
+    if (!f) return false;
+
+    const size_t frame_bytes = num_channels*bytesPerSample();
+    uint32_t done = 0;
+    while (done < frames) {
+        size_t room = (buffer.size()-buffer_used)/frame_bytes;
+        if (room == 0) {
+            flush();
+            continue;
+        }
+        uint32_t n = frames-done;
+        if (n > kChunkFrames) n = kChunkFrames;
+        if (n > room) n = room;
+
+        convert(channels, done, n, &buffer[buffer_used]);
+        buffer_used += n*frame_bytes;
+        done += n;
+    }
+
+    num_frames += frames;
+    return !failed;
+}
+
+bool HSWavWriter::close() {
+    if (!f) return true;
+
+    bool ok = flush();
+    if ((num_frames*num_channels*bytesPerSample()) & 1) {
+        if (fputc(0, f) == EOF) ok = false;
+    }
+    if (fseek(f, 0, SEEK_SET) != 0 || !writeHeader()) ok = false;
+    if (fclose(f) != 0) ok = false;
+    f = 0;
+    return ok;
+}
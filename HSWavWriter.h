@@ -0,0 +1,82 @@
+/*
+ *  HSWavWriter.h
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+#ifndef __HSWavWriter_h__
+#define __HSWavWriter_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+// Writes a WAV file as it is rendered. The sizes in the header aren't known
+// until the end, so they are filled in when the file is closed.
+//
+// Samples are converted a chunk at a time into a large buffer, which is
+// written to the file in one call when it is full, bypassing the buffering of
+// stdio. The scaling, dithering and clipping of a chunk is a plain loop that
+// the compiler vectorizes; only packing the samples into the file's byte
+// layout is done a sample at a time.
+class HSWavWriter
+{
+public:
+    enum Format {
+        kFormat_PCM16,   // 16 bit integer, clipped to full scale
+        kFormat_PCM24,   // 24 bit integer, clipped to full scale
+        kFormat_Float32  // 32 bit IEEE float, not clipped
+    };
+
+    enum Dither {
+        kDither_None,    // Rounds to the nearest integer
+        kDither_TPDF     // Adds triangular noise of +-1 LSB before rounding
+    };
+
+    HSWavWriter();
+    // Closes the file if it is open
+    ~HSWavWriter();
+
+    // The dither only applies to the integer formats. The noise is the same
+    // every time a file is written.
+    bool open(const char* path, int sample_rate, int num_channels, Format format,
+              Dither dither = kDither_None);
+    // Appends num_frames frames; channels holds one buffer per channel
+    bool write(const float* const* channels, uint32_t num_frames);
+    // Fills in the header and closes the file. Returns false if anything
+    // failed to be written since the file was opened.
+    bool close();
+
+    uint64_t getNumFrames() const { return num_frames; }
+    // The number of samples that were outside of full scale, and were clipped
+    uint64_t getNumClipped() const { return num_clipped; }
+
+private:
+    bool writeHeader();
+    bool flush();
+    int bytesPerSample() const;
+    // Converts num_frames frames from the channels to the bytes of the file at out
+    void convert(const float* const* channels, uint32_t offset, uint32_t num_frames, uint8_t* out);
+
+    FILE* f;
+    int sample_rate;
+    int num_channels;
+    Format format;
+    Dither dither;
+    uint64_t num_frames;
+    uint64_t num_clipped;
+    bool failed;
+    // The dither noise is a function of this, which counts the samples
+    uint32_t noise_index;
+
+    // The bytes that haven't been written to the file yet
+    std::vector<uint8_t> buffer;
+    size_t buffer_used;
+
+    // The integer samples of a chunk of one channel
+    std::vector<int32_t> samples;
+};
+
+#endif
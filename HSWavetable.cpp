@@ -12,28 +12,36 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
+#include "HSLog.h"
 #include "PADsynth.h"
 
-// AFAIK this doesn't even work; there is no output (because of lack of fflush?)
-//#define DEBUG_OUTPUT 1
+// Partials that are quieter than this relative to the loudest one (-80dB) are
+// allowed to alias.
+static const float kAliasingThreshold = 0.0001;
 
-#ifdef DEBUG_OUTPUT
-FILE* dbg_f;
-#endif
+// When a table is played close to the highest frequency it can be played at
+// without aliasing, it is crossfaded with the next table. The crossfade starts
+// at this fraction of that frequency.
+static const float kMipCrossfadeStart = 0.8;
 
 wavetables_data::wavetables_data(HSWavetable* hswt_, float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_) :
 hswt(hswt_), bw(bw_), bwscale(bwscale_), harmonics_amount(harmonics_amount_), harmonics_curve_steepness(harmonics_curve_steepness_), harmonics_balance(harmonics_balance_), harmonics_compensation(harmonics_compensation_) {
+    memset(&job, 0, sizeof(job));
     wavetables = 0;
     wavetable_frequencies = 0;
+    wavetable_highest_partials = 0;
 }
 
 wavetables_data::~wavetables_data() {
+    HSMemoryAccount& memory = hswt->getMemory();
     if (wavetables) {
-        for (int i=0; i<hswt->getNumWavetables(); i++) free(wavetables[i]);
-        free(wavetables);
+        for (int i=0; i<hswt->getNumWavetables(); i++) memory.release(wavetables[i]);
+        memory.release(wavetables);
     }
-    if (wavetable_frequencies) free(wavetable_frequencies);
+    memory.release(wavetable_frequencies);
+    memory.release(wavetable_highest_partials);
 }
 
 void wavetables_data::generate() {
@@ -42,16 +50,18 @@ void wavetables_data::generate() {
     const int num_wavetables = hswt->getNumWavetables();
     const int num_samples = hswt->getNumSamples();
     PADsynth* const padsynth = hswt->getPADsynth();
+    HSMemoryAccount& memory = hswt->getMemory();
     
     // Allocate memory for the wavetables
-    wavetables = (float**) malloc(sizeof(float*)*num_wavetables);
-    wavetable_frequencies = (float*) malloc(sizeof(float)*num_wavetables);
+    wavetables = (float**) memory.allocate(kMemory_Wavetables, sizeof(float*)*num_wavetables);
+    wavetable_frequencies = (float*) memory.allocate(kMemory_Wavetables, sizeof(float)*num_wavetables);
+    wavetable_highest_partials = (float*) memory.allocate(kMemory_Wavetables, sizeof(float)*num_wavetables);
     for (int i=0; i<num_wavetables; i++)
-        wavetables[i] = (float*) malloc(sizeof(float)*num_samples);
+        wavetables[i] = (float*) memory.allocate(kMemory_Wavetables, sizeof(float)*num_samples);
     
     // allocate stuff that is only used in this function
-    int* wavetable_num_harmonics = (int*) malloc(sizeof(int)*num_wavetables);
-    float** wavetable_harmonics = (float**) malloc(sizeof(float*)*num_wavetables);
+    int* wavetable_num_harmonics = (int*) memory.allocate(kMemory_Scratch, sizeof(int)*num_wavetables);
+    float** wavetable_harmonics = (float**) memory.allocate(kMemory_Scratch, sizeof(float*)*num_wavetables);
     
     
     static const double lowest_frequency = 55.0; // TODO Put these in a global constant?
@@ -71,7 +81,7 @@ void wavetables_data::generate() {
         float num_harmonics = harmonics_compensation*compensated_num_harmonics + (1-harmonics_compensation)*harmonics_amount;
         wavetable_num_harmonics[i] = (((int) num_harmonics)+1)*2; // +1 just to be sure
         
-        wavetable_harmonics[i] = (float*) malloc(sizeof(float)*wavetable_num_harmonics[i]);
+        wavetable_harmonics[i] = (float*) memory.allocate(kMemory_Scratch, sizeof(float)*wavetable_num_harmonics[i]);
         
         float harmonics_curve_pow = pow(harmonics_curve_steepness*2, 5);
         for (int j=0; j<wavetable_num_harmonics[i]; j++) {
@@ -80,7 +90,10 @@ void wavetables_data::generate() {
         }
     }
     
+    HSGeneratorTrace& trace = hswt->getTrace();
+    padsynth->seed(hswt->getSeed());
     for (int i=0; i<num_wavetables; i++) {
+        uint64_t synth_start = hsTraceNow();
         padsynth->synth(sample_rate,
                         wavetable_num_harmonics[i],
                         wavetable_harmonics[i],
@@ -88,12 +101,24 @@ void wavetables_data::generate() {
                         bw,
                         bwscale,
                         wavetables[i]);
+        uint64_t synth_end = hsTraceNow();
+        
+        wavetable_highest_partials[i] = padsynth->highestFrequency(sample_rate,
+                                                                   wavetable_num_harmonics[i],
+                                                                   wavetable_harmonics[i],
+                                                                   wavetable_frequencies[i],
+                                                                   bw,
+                                                                   bwscale,
+                                                                   kAliasingThreshold);
+        
+        trace.addEvent(job.id, kStage_Synth, i, synth_start, synth_end);
+        trace.addEvent(job.id, kStage_HighestPartial, i, synth_end, hsTraceNow());
     }
     
     // cleanup
-    free(wavetable_num_harmonics);
-    for (int i=0; i<num_wavetables; i++) free(wavetable_harmonics[i]);
-    free(wavetable_harmonics);
+    memory.release(wavetable_num_harmonics);
+    for (int i=0; i<num_wavetables; i++) memory.release(wavetable_harmonics[i]);
+    memory.release(wavetable_harmonics);
 }
 
 int wavetables_data::closestMatchingWavetable(float desired_frequency) const {
@@ -117,57 +142,95 @@ int wavetables_data::closestMatchingWavetable(float desired_frequency) const {
     return mid;
 }
 
-HSWavetable::HSWavetable(int num_wavetables_, int sample_rate_, int num_samples_, float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_) {
+float wavetables_data::closestMatchingLevel(float desired_frequency) const {
+    const int num_wavetables = hswt->getNumWavetables();
+    
+    if (desired_frequency <= wavetable_frequencies[0]) return 0;
+    
+    for (int i=0; i<num_wavetables-1; i++) {
+        if (desired_frequency < wavetable_frequencies[i+1]) {
+            // The tables are spaced geometrically, so interpolate on a log scale
+            return i + log(desired_frequency/wavetable_frequencies[i])/log(wavetable_frequencies[i+1]/wavetable_frequencies[i]);
+        }
+    }
+    
+    return num_wavetables-1;
+}
+
+float wavetables_data::aliasFreeLevel(float frequency, float output_sample_rate) const {
+    const int num_wavetables = hswt->getNumWavetables();
+    const float nyquist = output_sample_rate/2;
+    
+    // Table i aliases when its highest partial, transposed to frequency, ends up
+    // above nyquist. Higher tables have fewer harmonics relative to their base
+    // frequency, so the limit only grows with i.
+    float limit = wavetable_highest_partials[0] > 0 ? wavetable_frequencies[0]*nyquist/wavetable_highest_partials[0] : frequency;
+    for (int i=0; i<num_wavetables-1; i++) {
+        float next_limit = wavetable_highest_partials[i+1] > 0 ? wavetable_frequencies[i+1]*nyquist/wavetable_highest_partials[i+1] : frequency;
+        
+        if (frequency <= limit) {
+            float crossfade_start = limit*kMipCrossfadeStart;
+            if (frequency <= crossfade_start || frequency > next_limit) return i;
+            return i + (frequency-crossfade_start)/(limit-crossfade_start);
+        }
+        
+        limit = next_limit;
+    }
+    
+    // Even the last table aliases; it's the best there is.
+    return num_wavetables-1;
+}
+
+HSWavetable::HSWavetable(int num_wavetables_, int sample_rate_, int num_samples_, float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_, uint32_t seed_) {
     sample_rate = sample_rate_;
     num_samples = num_samples_;
     num_wavetables = num_wavetables_;
+    seed = seed_;
     
-    padsynth = new PADsynth(num_samples);
+    padsynth = new PADsynth(num_samples, &memory);
     
     pthread_mutex_init(&generator_thread_quit_flag, NULL);
     pthread_mutex_init(&to_be_generated_mutex, NULL);
-    pthread_mutex_init(&current_wavetable_mutex, NULL);
+    pthread_rwlock_init(&current_wavetable_lock, NULL);
     
     to_be_generated = 0;
     current_wavetable = 0;
     
     pthread_create(&generator_thread, NULL, &HSWavetable::generatorThread, this);
     
+    // The first tables are generated right away, as job 0
     current_wavetable = new wavetables_data(this, bw_, bwscale_, harmonics_amount_, harmonics_curve_steepness_, harmonics_balance_, harmonics_compensation_);
+    uint64_t start = hsTraceNow();
     current_wavetable->generate();
-    
-#ifdef DEBUG_OUTPUT
-    dbg_f = fopen("/tmp/synt.txt", "w+");
-#endif
+    trace.addEvent(0, kStage_Generate, -1, start, hsTraceNow());
 }
 
 HSWavetable::~HSWavetable() {
     // Signal to the generator thread to quit
     pthread_mutex_lock(&generator_thread_quit_flag);
     pthread_join(generator_thread, NULL);
+    pthread_mutex_unlock(&generator_thread_quit_flag);
     
     delete padsynth;
     if (to_be_generated) delete to_be_generated;
     delete current_wavetable;
     pthread_mutex_destroy(&generator_thread_quit_flag);
     pthread_mutex_destroy(&to_be_generated_mutex);
-    pthread_mutex_destroy(&current_wavetable_mutex);
-    
-#ifdef DEBUG_OUTPUT
-    fclose(dbg_f);
-#endif
+    pthread_rwlock_destroy(&current_wavetable_lock);
 }
 
 void HSWavetable::generateWavetables(float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_) {
-    
-#ifdef DEBUG_OUTPUT
-    fprintf(dbg_f, "Hej\n");
-#endif
-    
     wavetables_data* wtd = new wavetables_data(this, bw_, bwscale_, harmonics_amount_, harmonics_curve_steepness_, harmonics_balance_, harmonics_compensation_);
+    trace.beginJob(&wtd->job);
+    HS_LOG("Wavetables requested as job %llu, lushness %.1f, harmonics %.2f",
+           (unsigned long long) wtd->job.id, bw_, harmonics_amount_);
     
     pthread_mutex_lock(&to_be_generated_mutex);
-    if (to_be_generated) delete to_be_generated;
+    if (to_be_generated) {
+        HS_LOG("Job %llu superseded before it was started", (unsigned long long) to_be_generated->job.id);
+        trace.jobSuperseded(to_be_generated->job);
+        delete to_be_generated;
+    }
     to_be_generated = wtd;
     pthread_mutex_unlock(&to_be_generated_mutex);
     
@@ -176,7 +239,7 @@ void HSWavetable::generateWavetables(float bw_, float bwscale_, float harmonics_
 void* HSWavetable::generatorThread(void* data) {
     HSWavetable* wt = (HSWavetable*) data;
     pthread_mutex_t *to_be_generated_mutex = &wt->to_be_generated_mutex;
-    pthread_mutex_t *current_wavetable_mutex = &wt->current_wavetable_mutex;
+    pthread_rwlock_t *current_wavetable_lock = &wt->current_wavetable_lock;
     
     while (1) {
         // This code is a little bit odd. If the result of the trylock is that we succeeded
@@ -184,7 +247,7 @@ void* HSWavetable::generatorThread(void* data) {
         // failed with EBUSY, it means that the mutex was locked to we should quit. If trylock
         // fails with EINVAL, it means that something is wrong so we quit anyways.
         int result = pthread_mutex_trylock(&wt->generator_thread_quit_flag);
-        pthread_mutex_unlock(&wt->generator_thread_quit_flag);
+        if (!result) pthread_mutex_unlock(&wt->generator_thread_quit_flag);
         if (result) {
             // Quit
             pthread_exit(NULL);
@@ -197,21 +260,28 @@ void* HSWavetable::generatorThread(void* data) {
             
             tbg = wt->to_be_generated;
             if (!tbg) {
+                pthread_mutex_unlock(to_be_generated_mutex);
                 // sleep for 40ms. This is to avoid draining unnecessary CPU.
                 // This could be done with a condition variable instead, which
-                // might be better, but is also slightly more complex.
+                // might be better, but is also slightly more complex. The
+                // mutex must not be held while sleeping, or generateWavetables
+                // waits for the sleep.
                 usleep(40000);
-                pthread_mutex_unlock(to_be_generated_mutex);
                 continue;
             }
             wt->to_be_generated = 0;
             
         } pthread_mutex_unlock(to_be_generated_mutex);
         
+        HSGeneratorJob job = tbg->job;
+        job.taken = hsTraceNow();
+        
         // This is the heavy operation. It should be made without locks.
         tbg->generate();
+        job.generated = hsTraceNow();
         
-        pthread_mutex_lock(current_wavetable_mutex); {
+        pthread_rwlock_wrlock(current_wavetable_lock); {
+            job.locked = hsTraceNow();
             
             if (wt->current_wavetable) {
                 // wt->current_wavetable should never be null at this point, but why risk it
@@ -219,7 +289,13 @@ void* HSWavetable::generatorThread(void* data) {
             }
             wt->current_wavetable = tbg;
             
-        } pthread_mutex_unlock(current_wavetable_mutex);
+        } pthread_rwlock_unlock(current_wavetable_lock);
+        
+        job.swapped = hsTraceNow();
+        wt->trace.jobCompleted(job);
+        HS_LOG("Job %llu generated in %.1f ms, swapped in after waiting %.3f ms for the lock, which was held %.3f ms",
+               (unsigned long long) job.id, (job.generated-job.taken)*1e-6,
+               (job.locked-job.generated)*1e-6, (job.swapped-job.locked)*1e-6);
     }
     
     pthread_exit(NULL);
@@ -11,6 +11,8 @@
 #define __HSWavetable_h__
 
 #include <pthread.h>
+#include "HSGeneratorTrace.h"
+#include "HSMemory.h"
 
 class PADsynth;
 class HSWavetable;
@@ -21,6 +23,13 @@ struct wavetables_data {
     
     void generate();
 	int closestMatchingWavetable(float desired_frequency) const;
+    // Returns a fractional wavetable index, where i+t means that table i and
+    // i+1 should be crossfaded with t as the weight of table i+1.
+    float closestMatchingLevel(float desired_frequency) const;
+    // Returns the lowest fractional wavetable index that can be played at
+    // frequency without any partials ending up above the Nyquist frequency of
+    // output_sample_rate. Tables above the returned level are safe as well.
+    float aliasFreeLevel(float frequency, float output_sample_rate) const;
     
     // These are parameters that are used to generate the wavetables
     HSWavetable* hswt;
@@ -31,45 +40,74 @@ struct wavetables_data {
     float harmonics_balance;
     float harmonics_compensation;
     
+    // When the stages of generating these tables happened
+    HSGeneratorJob job;
+    
     // These are the actual wavetable data (and necessary info about which base frequency each table has)
     float** wavetables;
     float* wavetable_frequencies;
+    // The highest frequency in each table that is louder than -80dB relative to
+    // the loudest partial, in Hz when the table is played at its base frequency.
+    float* wavetable_highest_partials;
 };
 
 class HSWavetable {
 public:
-	HSWavetable(int num_wavetables_, int sample_rate_, int num_samples_, float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_);
+    // Every set of tables starts the random phases of PADsynth from seed_, so
+    // the same parameters always make the same tables.
+	HSWavetable(int num_wavetables_, int sample_rate_, int num_samples_, float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_, uint32_t seed_ = 1);
     
 	~HSWavetable();
     
     void generateWavetables(float bw_, float bwscale_, float harmonics_amount_, float harmonics_curve_steepness_, float harmonics_balance_, float harmonics_compensation_);
     
 	int closestMatchingWavetable(float desired_frequency) {
-        pthread_mutex_lock(&current_wavetable_mutex);
+        pthread_rwlock_rdlock(&current_wavetable_lock);
         int result = current_wavetable->closestMatchingWavetable(desired_frequency);
-        pthread_mutex_unlock(&current_wavetable_mutex);
+        pthread_rwlock_unlock(&current_wavetable_lock);
+        return result;
+    }
+    
+    float closestMatchingLevel(float desired_frequency) {
+        pthread_rwlock_rdlock(&current_wavetable_lock);
+        float result = current_wavetable->closestMatchingLevel(desired_frequency);
+        pthread_rwlock_unlock(&current_wavetable_lock);
         return result;
     }
     
     int getSampleRate() const { return sample_rate; }
     int getNumSamples() const { return num_samples; }
     int getNumWavetables() const { return num_wavetables; }
+    uint32_t getSeed() const { return seed; }
     PADsynth* getPADsynth() const { return padsynth; }
+    // Times each regeneration; tell it about parameter changes with
+    // parameterChanged() to include the time until generateWavetables is called.
+    HSGeneratorTrace& getTrace() { return trace; }
+    // Counts the tables, PADsynth and what generating the tables needs. While
+    // a new set of tables replaces the old, both are counted.
+    HSMemoryAccount& getMemory() { return memory; }
     
     
-    void lockWavetables() { pthread_mutex_lock(&current_wavetable_mutex); }
-    void unlockWavetables() { pthread_mutex_unlock(&current_wavetable_mutex); }
+    // Any number of threads can hold the lock at once; it only keeps the
+    // generator thread from replacing the tables while they are read.
+    void lockWavetables() { pthread_rwlock_rdlock(&current_wavetable_lock); }
+    void unlockWavetables() { pthread_rwlock_unlock(&current_wavetable_lock); }
     
     // Warning: These methods (getBaseFrequency and getWavetableData) are not safe to call without
     // first calling lockWavetables() and then unlockWavetables()!
     float getBaseFrequency(int wt_idx) const { return current_wavetable->wavetable_frequencies[wt_idx]; }
     // See the warning at the getBaseFrequency method!
     float* getWavetableData(int wt_idx) const { return current_wavetable->wavetables[wt_idx]; }
+    // See the warning at the getBaseFrequency method!
+    float aliasFreeLevel(float frequency, float output_sample_rate) const {
+        return current_wavetable->aliasFreeLevel(frequency, output_sample_rate);
+    }
     
 private:
     int num_wavetables;
 	int sample_rate;
     int num_samples;
+    uint32_t seed;
     PADsynth* padsynth;
     
     pthread_t generator_thread;
@@ -79,9 +117,12 @@ private:
     pthread_mutex_t to_be_generated_mutex;
     wavetables_data* to_be_generated; // This is usually NULL.
     
-    pthread_mutex_t current_wavetable_mutex;
+    pthread_rwlock_t current_wavetable_lock;
     wavetables_data* current_wavetable;
     
+    HSGeneratorTrace trace;
+    HSMemoryAccount memory;
+    
     static void* generatorThread(void* data);
 };
 
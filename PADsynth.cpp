@@ -11,17 +11,23 @@
 #include <stdlib.h>
 #include <math.h>
 #include "PADsynth.h"
+#include "HSMemory.h"
 
-PADsynth::PADsynth(int N_){
+PADsynth::PADsynth(int N_, HSMemoryAccount* memory_){
     N=N_;
+    memory=memory_;
     
-    fftr_cfg = kiss_fftr_alloc(N, true, 0, 0);
-    freq_amp=new REALTYPE[N/2];
+    // kiss_fftr_alloc says how much memory the plan needs when it isn't given enough
+    size_t fftr_size=0;
+    kiss_fftr_alloc(N, true, 0, &fftr_size);
+    void* fftr_mem=memory->allocate(kMemory_Synth, fftr_size);
+    fftr_cfg = kiss_fftr_alloc(N, true, fftr_mem, &fftr_size);
+    freq_amp=(REALTYPE*) memory->allocate(kMemory_Synth, sizeof(REALTYPE)*(N/2));
 };
 
 PADsynth::~PADsynth(){
-    free(fftr_cfg);
-    delete[] freq_amp;
+    memory->release(fftr_cfg);
+    memory->release(freq_amp);
 };
 
 REALTYPE PADsynth::relF(int N){
@@ -63,7 +69,7 @@ void PADsynth::synth(int samplerate, int number_harmonics, REALTYPE* harmonics,
         }
     }
     
-    kiss_fft_cpx* cx_in = (kiss_fft_cpx*) malloc(sizeof(kiss_fft_cpx)*N/2+1);
+    kiss_fft_cpx* cx_in = (kiss_fft_cpx*) memory->allocate(kMemory_Scratch, sizeof(kiss_fft_cpx)*(N/2+1));
     
     //Convert the freq_amp array to complex array (real/imaginary) by making the phases random
     for (i=0;i<N/2;i++){
@@ -71,10 +77,12 @@ void PADsynth::synth(int samplerate, int number_harmonics, REALTYPE* harmonics,
         cx_in[i].r = freq_amp[i]*cos(phase);
         cx_in[i].i = freq_amp[i]*sin(phase);
     }
+    // The inverse real FFT also reads the Nyquist bin
+    cx_in[N/2].r = cx_in[N/2].i = 0;
     
     kiss_fftri(fftr_cfg, cx_in, smp);
     
-    free(cx_in);
+    memory->release(cx_in);
     
     //normalize the output
     REALTYPE max=0.0;
@@ -84,8 +92,42 @@ void PADsynth::synth(int samplerate, int number_harmonics, REALTYPE* harmonics,
     
 };
 
+REALTYPE PADsynth::highestFrequency(int samplerate, int number_harmonics, REALTYPE* harmonics, REALTYPE f,REALTYPE bw,REALTYPE bwscale,REALTYPE threshold){
+    int nh;
+    
+    // The peak of each harmonic profile in synth() is harmonics[nh]/bwi, so
+    // find the loudest one first.
+    REALTYPE max_peak=0.0;
+    for (nh=1;nh<number_harmonics;nh++){
+        REALTYPE bw_Hz=(pow(2.0,bw/1200.0)-1.0)*f*pow(relF(nh),bwscale);
+        REALTYPE peak=harmonics[nh]/(bw_Hz/(2.0*samplerate));
+        if (peak>max_peak) max_peak=peak;
+    }
+    if (max_peak<=0.0) return 0.0;
+    
+    REALTYPE highest=0.0;
+    for (nh=1;nh<number_harmonics;nh++){
+        REALTYPE bw_Hz=(pow(2.0,bw/1200.0)-1.0)*f*pow(relF(nh),bwscale);
+        REALTYPE peak=harmonics[nh]/(bw_Hz/(2.0*samplerate));
+        if (peak<=threshold*max_peak) continue;
+        
+        // exp(-x*x) drops below the threshold at x=sqrt(log(peak/(threshold*max_peak))),
+        // where x is measured in units of half the bandwidth of the harmonic.
+        REALTYPE edge=f*relF(nh)+sqrt(log(peak/(threshold*max_peak)))*bw_Hz/2.0;
+        if (edge>highest) highest=edge;
+    }
+    
+    // synth() can't generate anything above the Nyquist frequency of the table
+    if (highest>samplerate/2.0) highest=samplerate/2.0;
+    return highest;
+};
+
+void PADsynth::seed(uint32_t seed_){
+    random.seed(seed_);
+};
+
 REALTYPE PADsynth::RND(){
-    return (rand()/(RAND_MAX+1.0));
+    return random.nextDouble();
 };
 
 
@@ -15,6 +15,9 @@
 #define PADSYNTH_H
 
 #include "kiss_fftr.h"
+#include "HSRandom.h"
+
+class HSMemoryAccount;
 
 #ifndef REALTYPE
 #define REALTYPE float
@@ -25,8 +28,9 @@ public:
 	/*  PADsynth:
      N                - is the samplesize (eg: 262144)
      samplerate 	 - samplerate (eg. 44100)
-     number_harmonics - the number of harmonics that are computed */
-	PADsynth(int N_);
+     number_harmonics - the number of harmonics that are computed
+     memory           - counts what PADsynth allocates */
+	PADsynth(int N_, HSMemoryAccount* memory_);
     
 	~PADsynth();
     
@@ -39,6 +43,19 @@ public:
                int number_harmonics, REALTYPE* harmonics,
                REALTYPE f,REALTYPE bw,
                REALTYPE bwscale, REALTYPE *smp);
+    
+	/*  highestFrequency() returns the highest frequency (in Hz) where the spectrum
+     that synth() would generate with the same parameters is louder than
+     threshold relative to its loudest peak (eg. 0.0001 for -80dB). It returns
+     0 if the spectrum is completely silent. */
+	REALTYPE highestFrequency(int samplerate,
+                              int number_harmonics, REALTYPE* harmonics,
+                              REALTYPE f,REALTYPE bw,
+                              REALTYPE bwscale, REALTYPE threshold);
+    
+	/*  seed() restarts the random phases that synth() gives the harmonics,
+     so that the same seed and parameters always make the same samples */
+	void seed(uint32_t seed_);
 protected:
 	int N;			//Size of the sample
     
@@ -56,6 +73,8 @@ protected:
 	REALTYPE RND();
     
 private:
+    HSMemoryAccount* memory;
+    HSRandom random;
     kiss_fftr_cfg fftr_cfg;
 	REALTYPE *freq_amp;	//Amplitude spectrum
 };
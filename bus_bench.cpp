@@ -0,0 +1,183 @@
+/*
+ *  bus_bench.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Measures what a render cycle costs with and without clearing the output
+// buffers and the mono and side buses before the notes render. Without the
+// clearing, the first note to render stores its output in the buses and the
+// others add to it, like HSNote does. The notes read wavetables the size of
+// the ones HSPad uses.
+//
+// Build with
+//   g++ -O2 -o bus_bench bus_bench.cpp
+//
+// Usage: bus_bench [frames] [cycles] [stereo]
+//
+// stereo is 1 to also render the side bus, like with a stereo width above 0.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "HSOscillator.h"
+
+static const int kNumTables = 10;
+static const int kTableSize = 262144;
+static const int kMaxVoices = 64;
+static const int kNumRounds = 5;
+
+struct Voice {
+    int table_idx;
+    double increment;
+    double phase;
+};
+
+struct Buffers {
+    float* left;
+    float* right;
+    float* mono;
+    float* side;
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+template <bool kWrite>
+static void renderVoice(float** tables, Voice& voice, float* mono, float* side, int num_frames) {
+    HSOscillator osc;
+    osc.lo_table = tables[voice.table_idx];
+    osc.hi_table = 0;
+    osc.num_samples = kTableSize;
+    osc.num_taps = 1;
+    osc.lo_phases[0] = voice.phase;
+    osc.tap_ratios[0] = 1;
+    osc.tap_gains[0] = osc.tap_side_gains[0] = 1;
+    osc.setGains(0.1, 0.1, 0, 0, num_frames);
+    osc.setIncrements(voice.increment, voice.increment, 0, 0, num_frames);
+
+    for (int frame=0; frame<num_frames; frame++) {
+        if (side) {
+            float side_out;
+            float mono_out = osc.next(side_out);
+            if (kWrite) { mono[frame] = mono_out; side[frame] = side_out; }
+            else { mono[frame] += mono_out; side[frame] += side_out; }
+        }
+        else {
+            if (kWrite) mono[frame] = osc.next();
+            else mono[frame] += osc.next();
+        }
+    }
+    voice.phase = osc.lo_phases[0];
+}
+
+static void spread(Buffers& buf, bool stereo, int num_frames) {
+    memcpy(buf.left, buf.mono, sizeof(float)*num_frames);
+    if (stereo) {
+        for (int frame=0; frame<num_frames; frame++) {
+            buf.right[frame] = buf.mono[frame] + 0.5f*(buf.side[frame]-buf.mono[frame]);
+        }
+    }
+    else {
+        memcpy(buf.right, buf.mono, sizeof(float)*num_frames);
+    }
+}
+
+// The previous scheme: everything is cleared, every note adds
+static void renderCleared(float** tables, Voice* voices, int num_voices, Buffers& buf, bool stereo, int num_frames) {
+    memset(buf.left, 0, sizeof(float)*num_frames);
+    memset(buf.right, 0, sizeof(float)*num_frames);
+    memset(buf.mono, 0, sizeof(float)*num_frames);
+    if (stereo) memset(buf.side, 0, sizeof(float)*num_frames);
+
+    for (int v=0; v<num_voices; v++) {
+        renderVoice<false>(tables, voices[v], buf.mono, stereo ? buf.side : 0, num_frames);
+    }
+    spread(buf, stereo, num_frames);
+}
+
+// The first note stores, the others add, and nothing is cleared
+static void renderWriteFirst(float** tables, Voice* voices, int num_voices, Buffers& buf, bool stereo, int num_frames) {
+    renderVoice<true>(tables, voices[0], buf.mono, stereo ? buf.side : 0, num_frames);
+    for (int v=1; v<num_voices; v++) {
+        renderVoice<false>(tables, voices[v], buf.mono, stereo ? buf.side : 0, num_frames);
+    }
+    spread(buf, stereo, num_frames);
+}
+
+int main(int argc, char** argv) {
+    int num_frames = argc > 1 ? atoi(argv[1]) : 256;
+    int num_cycles = argc > 2 ? atoi(argv[2]) : 400;
+    bool stereo = argc > 3 ? atoi(argv[3]) != 0 : true;
+
+    if (num_frames < 1 || num_cycles < 1) {
+        fprintf(stderr, "Usage: %s [frames] [cycles] [stereo]\n", argv[0]);
+        return 1;
+    }
+
+    float* tables[kNumTables];
+    for (int i=0; i<kNumTables; i++) {
+        tables[i] = (float*) malloc(sizeof(float)*kTableSize);
+        for (int j=0; j<kTableSize; j++) tables[i][j] = rand()/(RAND_MAX+1.0)*2-1;
+    }
+
+    Buffers buf;
+    buf.left = (float*) malloc(sizeof(float)*num_frames);
+    buf.right = (float*) malloc(sizeof(float)*num_frames);
+    buf.mono = (float*) malloc(sizeof(float)*num_frames);
+    buf.side = (float*) malloc(sizeof(float)*num_frames);
+
+    Voice initial_voices[kMaxVoices];
+    for (int v=0; v<kMaxVoices; v++) {
+        initial_voices[v].table_idx = rand() % kNumTables;
+        initial_voices[v].increment = pow(2., rand()/(RAND_MAX+1.0) - 0.5);
+        initial_voices[v].phase = rand()/(RAND_MAX+1.0)*kTableSize;
+    }
+
+    printf("frames %d, cycles %d, %s\n", num_frames, num_cycles, stereo ? "stereo" : "mono");
+    printf("%6s %16s %18s %8s\n", "voices", "cleared ns/cyc", "write-first ns/cyc", "saved");
+
+    // The modes take turns, and the fastest of the rounds counts, which keeps
+    // other load on the machine out of the comparison
+    float checksum = 0;
+    for (int num_voices=1; num_voices<=kMaxVoices; num_voices*=2) {
+        double best[2] = { 1e9, 1e9 };
+        for (int round=0; round<kNumRounds; round++) {
+            for (int mode=0; mode<2; mode++) {
+                Voice voices[kMaxVoices];
+                memcpy(voices, initial_voices, sizeof(voices));
+
+                double start = now();
+                for (int cycle=0; cycle<num_cycles; cycle++) {
+                    if (mode == 0) renderCleared(tables, voices, num_voices, buf, stereo, num_frames);
+                    else renderWriteFirst(tables, voices, num_voices, buf, stereo, num_frames);
+                }
+                double elapsed = now()-start;
+                if (elapsed < best[mode]) best[mode] = elapsed;
+                checksum += buf.left[num_frames-1] + buf.right[0];
+            }
+        }
+
+        printf("%6d %16.0f %18.0f %7.1f%%\n", num_voices,
+               best[0]*1e9/num_cycles, best[1]*1e9/num_cycles,
+               100*(best[0]-best[1])/best[0]);
+    }
+
+    // Keep the compiler from optimizing the rendering away
+    fprintf(stderr, "checksum %f\n", checksum);
+
+    for (int i=0; i<kNumTables; i++) free(tables[i]);
+    free(buf.left);
+    free(buf.right);
+    free(buf.mono);
+    free(buf.side);
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ *  fifo_bench.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Measures the throughput of the lock free queues that carry note events from
+// the MIDI threads to the render thread, and checks that every item arrives in
+// order. The single producer queues are run with one producer thread, and the
+// event queue with several. It also shows how the queues handle a burst of
+// events that is bigger than they are: the single producer queues drop what
+// doesn't fit, and the event queue grows, dropping only what is past its
+// maximum size.
+//
+// Build with
+//   g++ -std=c++11 -O2 -pthread -I. -I$AUIB -o fifo_bench fifo_bench.cpp
+// where $AUIB is CoreAudioUtilityClasses/CoreAudio/AudioUnits/AUPublic/AUInstrumentBase
+//
+// Usage: fifo_bench [items] [queue_size] [producers]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "LockFreeFIFO.h"
+#include "LockFreeMPSCQueue.h"
+#include "SynthEventQueueSize.h"
+
+// Roughly the size of a SynthEvent
+struct Item {
+    uint32_t sequence;
+    uint32_t producer;
+    uint32_t payload[6];
+
+    void Free() {}
+};
+
+template <class FIFO>
+static bool runThroughput(const char* name, uint32_t num_items, uint32_t queue_size) {
+    FIFO fifo(queue_size);
+    bool in_order = true;
+    uint64_t full_spins = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::thread consumer([&]() {
+        uint32_t expected = 0;
+        while (expected < num_items) {
+            Item* item = fifo.ReadItem();
+            if (!item) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (item->sequence != expected) in_order = false;
+            expected++;
+            fifo.AdvanceReadPtr();
+        }
+    });
+
+    for (uint32_t i=0; i<num_items; i++) {
+        Item* item;
+        while ((item = fifo.WriteItem()) == NULL) {
+            full_spins++;
+            std::this_thread::yield();
+        }
+        item->sequence = i;
+        fifo.AdvanceWritePtr();
+    }
+    consumer.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    printf("%-22s %10.2f Mitems/s %8.1f ns/item  full %llu  %s\n",
+           name, num_items/seconds/1e6, seconds*1e9/num_items,
+           (unsigned long long) full_spins, in_order ? "in order" : "OUT OF ORDER");
+
+    return in_order;
+}
+
+static bool runMultiProducer(uint32_t num_items, uint32_t queue_size, uint32_t num_producers) {
+    // Grows when the consumer falls behind
+    LockFreeMPSCQueue<Item> queue(queue_size, 16*queue_size);
+    uint32_t items_per_producer = num_items/num_producers;
+    uint32_t total = items_per_producer*num_producers;
+    bool in_order = true;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::thread consumer([&]() {
+        std::vector<uint32_t> expected(num_producers, 0);
+        uint32_t received = 0;
+        while (received < total) {
+            Item* item = queue.ReadItem();
+            if (!item) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (item->sequence != expected[item->producer]) in_order = false;
+            expected[item->producer] = item->sequence+1;
+            received++;
+            queue.AdvanceReadPtr();
+        }
+    });
+
+    std::vector<std::thread> producers;
+    for (uint32_t p=0; p<num_producers; p++) {
+        producers.push_back(std::thread([&, p]() {
+            for (uint32_t i=0; i<items_per_producer; i++) {
+                Item* item;
+                while ((item = queue.WriteItem()) == NULL) std::this_thread::yield();
+                item->sequence = i;
+                item->producer = p;
+                queue.AdvanceWritePtr(item);
+            }
+        }));
+    }
+    for (uint32_t p=0; p<num_producers; p++) producers[p].join();
+
+    consumer.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    printf("%-22s %10.2f Mitems/s %8.1f ns/item  producers %u  capacity %u  %s\n",
+           "LockFreeMPSCQueue", total/seconds/1e6, seconds*1e9/total,
+           num_producers, queue.GetCapacity(),
+           in_order ? "in order" : "OUT OF ORDER");
+
+    return in_order;
+}
+
+// Writes a burst of items with nobody reading, like a sequencer that sends
+// thousands of events at transport start before the next render cycle.
+static void publish(LockFreeFIFO<Item>& fifo, Item*) { fifo.AdvanceWritePtr(); }
+static void publish(LockFreeFIFOWithFree<Item>& fifo, Item*) { fifo.AdvanceWritePtr(); }
+static void publish(LockFreeMPSCQueue<Item>& queue, Item* item) { queue.AdvanceWritePtr(item); }
+
+// Returns false if the items that were written don't all come out in order,
+// or if the queue drops items when it shouldn't or doesn't when it should.
+template <class FIFO>
+static bool runBurst(const char* name, FIFO& fifo, uint32_t burst, bool expect_drops) {
+    uint32_t written = 0;
+    for (uint32_t i=0; i<burst; i++) {
+        Item* item = fifo.WriteItem();
+        if (!item) {
+            fifo.DropItem();
+            continue;
+        }
+        item->sequence = i;
+        publish(fifo, item);
+        written++;
+    }
+
+    uint32_t read = 0;
+    bool in_order = true;
+    int64_t last = -1;
+    Item* item;
+    while ((item = fifo.ReadItem()) != NULL) {
+        if ((int64_t) item->sequence <= last) in_order = false;
+        last = item->sequence;
+        read++;
+        fifo.AdvanceReadPtr();
+    }
+    if (read != written) in_order = false;
+
+    uint64_t dropped = fifo.GetDroppedItems();
+    printf("%-40s burst of %u: written %u  dropped %llu  %s\n",
+           name, burst, written, (unsigned long long) dropped,
+           in_order ? "in order" : "OUT OF ORDER");
+
+    return in_order && (dropped > 0) == expect_drops;
+}
+
+int main(int argc, char** argv) {
+    uint32_t num_items = argc > 1 ? atoi(argv[1]) : 10000000;
+    uint32_t queue_size = argc > 2 ? atoi(argv[2]) : 1024;
+    uint32_t num_producers = argc > 3 ? atoi(argv[3]) : 4;
+
+    if (num_items < 1 || queue_size < 2 || (queue_size & (queue_size-1)) || num_producers < 1) {
+        fprintf(stderr, "Usage: %s [items] [queue_size, a power of two] [producers]\n", argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    ok = runThroughput<LockFreeFIFO<Item> >("LockFreeFIFO", num_items, queue_size) && ok;
+    ok = runThroughput<LockFreeFIFOWithFree<Item> >("LockFreeFIFOWithFree", num_items, queue_size) && ok;
+    ok = runMultiProducer(num_items, queue_size, num_producers) && ok;
+
+    // A burst several times the size of the queues
+    uint32_t burst = 5*queue_size;
+    LockFreeFIFO<Item> fifo(queue_size);
+    ok = runBurst("LockFreeFIFO", fifo, burst, true) && ok;
+    LockFreeFIFOWithFree<Item> fifo_with_free(queue_size);
+    ok = runBurst("LockFreeFIFOWithFree", fifo_with_free, burst, true) && ok;
+    // The event queue grows to hold it, but not past its maximum size. The one
+    // of AUInstrumentBase holds a burst of twice what it has room for up front.
+    LockFreeMPSCQueue<Item> growing(queue_size, burst);
+    ok = runBurst("LockFreeMPSCQueue, growing", growing, burst, false) && ok;
+    LockFreeMPSCQueue<Item> events(kEventQueueSize, kMaxEventQueueSize);
+    ok = runBurst("LockFreeMPSCQueue, AUInstrumentBase size", events, 2*kEventQueueSize, false) && ok;
+    LockFreeMPSCQueue<Item> limited(queue_size, 2*queue_size);
+    ok = runBurst("LockFreeMPSCQueue, past its maximum", limited, burst, true) && ok;
+
+    return ok ? 0 : 1;
+}
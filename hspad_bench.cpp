@@ -0,0 +1,588 @@
+/*
+ *  hspad_bench.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// The benchmark suite: times the hot paths of wavetable generation and
+// rendering with fixed inputs, and writes the results as JSON so that runs can
+// be compared over time. The random number generators are seeded the same way
+// before each case, so two runs render the same data.
+//
+// Build with CMake, or with
+//   g++ -std=c++11 -O2 -pthread -I. -I$AUIB -o hspad_bench hspad_bench.cpp $CORE
+// where $AUIB is CoreAudioUtilityClasses/CoreAudio/AudioUnits/AUPublic/AUInstrumentBase
+// and $CORE is HSGeneratorTrace.cpp HSLog.cpp HSMemory.cpp HSParameters.cpp HSVoice.cpp
+// HSWavetable.cpp HSWavWriter.cpp PADsynth.cpp kiss_fft.c kiss_fftr.c
+//
+// Usage: hspad_bench [--json file] [--quick] [--baseline file] [--max-slowdown percent] [filter]
+//
+// Only the cases whose name contains filter are run. --quick runs fewer
+// repetitions and skips the largest sizes, for a smoke test. --json - writes
+// the JSON to stdout instead of the table.
+//
+// --baseline compares the fastest repetition of each case with the JSON of an
+// earlier run on the same machine, and fails if any case got slower by more
+// than --max-slowdown, 10% by default. A case that looks slower is measured
+// again a few times first, and its fastest repetition counts. Cases that the
+// baseline doesn't have are listed but don't count. Timings vary between machines, so the baseline
+// is made on the machine that runs the comparison, from a build that is known
+// to be good.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "HSMemory.h"
+#include "HSParameters.h"
+#include "HSVoice.h"
+#include "HSWavetable.h"
+#include "HSWavWriter.h"
+#include "PADsynth.h"
+#include "kiss_fftr.h"
+#include "LockFreeFIFO.h"
+
+static const unsigned kSeed = 1;
+static const int kSampleRate = 44100;
+
+// Each repetition runs the case enough times to take at least this long
+static const double kMinRepetitionSeconds = 0.02;
+
+struct Result {
+    std::string name;
+    std::string params;    // "key": value pairs, ready to go in a JSON object
+    const char* unit;      // What one item is
+    double items;          // Items per iteration
+    long iterations;       // Per repetition
+    std::vector<double> ns_per_iteration;
+};
+
+struct Options {
+    const char* json_path;
+    bool quick;
+    const char* baseline_path;
+    double max_slowdown;   // In percent
+    const char* filter;
+};
+
+static Options options;
+static std::vector<Result> results;
+// The fastest repetition of each case in the baseline
+static std::vector<std::pair<std::string, double> > baseline;
+
+// A case that looks slower than the baseline allows is measured this many more
+// times before it counts, since one slow run is more often the machine than
+// the code
+static const int kMaxConfirmations = 3;
+
+// The key that a case is matched with in a baseline
+static std::string baselineKey(const std::string& name, const std::string& params) {
+    return name + " {" + params + "}";
+}
+
+// The fastest time of the case in the baseline, or 0
+static double baselineNs(const std::string& key) {
+    for (size_t i=0; i<baseline.size(); i++) {
+        if (baseline[i].first == key) return baseline[i].second;
+    }
+    return 0;
+}
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool selected(const char* name) {
+    return !options.filter || strstr(name, options.filter);
+}
+
+static int numRepetitions() {
+    return options.quick ? 3 : 10;
+}
+
+// Times fn(iterations), and records the time per iteration of each repetition.
+// The first call is a warm-up that also finds how many iterations fill
+// kMinRepetitionSeconds.
+template <class Fn>
+static void measure(const char* name, const std::string& params, const char* unit, double items, Fn fn) {
+    srand(kSeed);
+
+    long iterations = 1;
+    for (;;) {
+        double start = now();
+        fn(iterations);
+        double seconds = now()-start;
+        if (seconds >= kMinRepetitionSeconds || iterations >= (1L<<30)) break;
+        iterations = seconds > 0 ? (long) (iterations*1.2*kMinRepetitionSeconds/seconds)+1 : iterations*10;
+    }
+
+    Result r;
+    r.name = name;
+    r.params = params;
+    r.unit = unit;
+    r.items = items;
+    r.iterations = iterations;
+    for (int rep=0; rep<numRepetitions(); rep++) {
+        srand(kSeed);
+        double start = now();
+        fn(iterations);
+        r.ns_per_iteration.push_back((now()-start)*1e9/iterations);
+    }
+    double before = baselineNs(baselineKey(name, params));
+    for (int i=0; i<kMaxConfirmations && before > 0; i++) {
+        double ns_min = *std::min_element(r.ns_per_iteration.begin(), r.ns_per_iteration.end());
+        if ((ns_min/before-1)*100 <= options.max_slowdown) break;
+        for (int rep=0; rep<numRepetitions(); rep++) {
+            srand(kSeed);
+            double start = now();
+            fn(iterations);
+            r.ns_per_iteration.push_back((now()-start)*1e9/iterations);
+        }
+    }
+    results.push_back(r);
+
+    std::vector<double> sorted = r.ns_per_iteration;
+    std::sort(sorted.begin(), sorted.end());
+    double median = sorted[sorted.size()/2];
+    if (options.json_path && !strcmp(options.json_path, "-")) return;
+    printf("%-26s %-34s %14.0f ns %10.2f ns/%s\n",
+           name, params.c_str(), median, median/items, unit);
+    fflush(stdout);
+}
+
+static std::string format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static std::string format(const char* fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+// The harmonics of the lowest table that wavetables_data::generate makes with
+// the default parameters
+static std::vector<float> defaultHarmonics(float* base_frequency) {
+    *base_frequency = 55.0;
+    float num_harmonics = kHarmonicsCompensation*440.0/55.0*kDefaultValue_HarmonicsAmount +
+                          (1-kHarmonicsCompensation)*kDefaultValue_HarmonicsAmount;
+    std::vector<float> harmonics((((int) num_harmonics)+1)*2);
+    float curve_pow = pow(kDefaultValue_HarmonicsCurveSteepness*2, 5);
+    for (size_t j=0; j<harmonics.size(); j++) {
+        float balance = (j%2) ? kDefaultValue_HarmonicsBalance : 1-kDefaultValue_HarmonicsBalance;
+        harmonics[j] = pow(1-((float)j)/(harmonics.size()-1), curve_pow)*balance;
+    }
+    return harmonics;
+}
+
+static HSWavetable* newDefaultWavetable(int num_samples) {
+    return new HSWavetable(kNumWavetables, kSampleRate, num_samples,
+                           kDefaultValue_HarmonicBandwidth, kDefaultValue_HarmonicProfile,
+                           kDefaultValue_HarmonicsAmount, kDefaultValue_HarmonicsCurveSteepness,
+                           kDefaultValue_HarmonicsBalance, kHarmonicsCompensation);
+}
+
+static void benchFFT() {
+    if (!selected("kiss_fftri")) return;
+
+    int max_log2 = options.quick ? 18 : 20;
+    for (int log2 = 14; log2 <= max_log2; log2 += 2) {
+        int n = 1 << log2;
+        kiss_fftr_cfg cfg = kiss_fftr_alloc(n, 1, 0, 0);
+        std::vector<kiss_fft_cpx> in(n/2+1);
+        std::vector<kiss_fft_scalar> out(n);
+        srand(kSeed);
+        for (size_t i=0; i<in.size(); i++) {
+            in[i].r = rand()/(RAND_MAX+1.0)-0.5;
+            in[i].i = rand()/(RAND_MAX+1.0)-0.5;
+        }
+
+        measure("kiss_fftri", format("\"n\": %d", n), "sample", n, [&](long iterations) {
+            for (long i=0; i<iterations; i++) kiss_fftri(cfg, &in[0], &out[0]);
+        });
+        kiss_fftr_free(cfg);
+    }
+}
+
+static void benchPADsynth() {
+    if (!selected("padsynth_synth")) return;
+
+    float base_frequency;
+    std::vector<float> harmonics = defaultHarmonics(&base_frequency);
+
+    int max_log2 = options.quick ? 16 : 18;
+    for (int log2 = 14; log2 <= max_log2; log2 += 2) {
+        int n = 1 << log2;
+        HSMemoryAccount memory;
+        PADsynth padsynth(n, &memory);
+        std::vector<float> table(n);
+
+        measure("padsynth_synth", format("\"n\": %d, \"harmonics\": %d", n, (int) harmonics.size()),
+                "sample", n, [&](long iterations) {
+            padsynth.seed(kSeed);
+            for (long i=0; i<iterations; i++) {
+                padsynth.synth(kSampleRate, harmonics.size(), &harmonics[0], base_frequency,
+                               kDefaultValue_HarmonicBandwidth, kDefaultValue_HarmonicProfile, &table[0]);
+            }
+        });
+    }
+}
+
+static void benchGenerate() {
+    if (!selected("wavetables_generate")) return;
+
+    // The HSWavetable is only there for its sizes and its PADsynth; the tables
+    // that it generates in its constructor aren't part of the measurement.
+    int n = options.quick ? kNumSamplesPerWavetable/4 : kNumSamplesPerWavetable;
+    HSWavetable* wavetable = newDefaultWavetable(n);
+
+    measure("wavetables_generate", format("\"tables\": %d, \"n\": %d", kNumWavetables, n),
+            "table", kNumWavetables, [&](long iterations) {
+        for (long i=0; i<iterations; i++) {
+            wavetables_data data(wavetable, kDefaultValue_HarmonicBandwidth, kDefaultValue_HarmonicProfile,
+                                 kDefaultValue_HarmonicsAmount, kDefaultValue_HarmonicsCurveSteepness,
+                                 kDefaultValue_HarmonicsBalance, kHarmonicsCompensation);
+            data.generate();
+        }
+    });
+    delete wavetable;
+}
+
+static void benchTableLookup(HSWavetable* wavetable) {
+    // Frequencies across the range of a keyboard, in a fixed order
+    static const int kNumFrequencies = 1024;
+    float frequencies[kNumFrequencies];
+    srand(kSeed);
+    for (int i=0; i<kNumFrequencies; i++) {
+        frequencies[i] = 27.5*pow(2., rand()/(RAND_MAX+1.0)*88/12);
+    }
+
+    // The sum keeps the compiler from dropping the calls
+    volatile float sink = 0;
+    if (selected("closest_matching_wavetable")) {
+        measure("closest_matching_wavetable", format("\"tables\": %d", kNumWavetables), "call", kNumFrequencies,
+                [&](long iterations) {
+            int sum = 0;
+            for (long i=0; i<iterations; i++) {
+                for (int j=0; j<kNumFrequencies; j++) sum += wavetable->closestMatchingWavetable(frequencies[j]);
+            }
+            sink = sum;
+        });
+    }
+    if (selected("closest_matching_level")) {
+        measure("closest_matching_level", format("\"tables\": %d", kNumWavetables), "call", kNumFrequencies,
+                [&](long iterations) {
+            float sum = 0;
+            for (long i=0; i<iterations; i++) {
+                for (int j=0; j<kNumFrequencies; j++) sum += wavetable->closestMatchingLevel(frequencies[j]);
+            }
+            sink = sum;
+        });
+    }
+    (void) sink;
+}
+
+// The inner loop of HSNote::Render: a number of held voices that render blocks
+// into a stereo bus, the way the AudioUnit renders them, without the note
+// bookkeeping of AUInstrumentBase
+static void benchVoices(HSWavetable* wavetable) {
+    if (!selected("voice_render")) return;
+
+    static const int kVoiceCounts[] = { 1, 8, 32, 128 };
+    static const uint32_t kBlockSizes[] = { 64, 256, 1024 };
+
+    HSParameters params;
+    params.setDefaults();
+    params.values[kParameter_StereoWidth] = 1.0;
+    params.derive(kSampleRate, 2);
+
+    std::vector<float> mono(1024), side(1024), left(1024), right(1024);
+
+    for (size_t v=0; v<sizeof(kVoiceCounts)/sizeof(kVoiceCounts[0]); v++) {
+        int num_voices = kVoiceCounts[v];
+        if (options.quick && num_voices > 32) continue;
+
+        std::vector<HSVoice> voices(num_voices);
+        HSRandom random(kSeed);
+        for (int i=0; i<num_voices; i++) {
+            int key = 36 + (i*7)%48;
+            voices[i].start(wavetable, params, kSampleRate, 440.0*pow(2., (key-69)/12.), 100, 0, 0, random);
+        }
+
+        for (size_t b=0; b<sizeof(kBlockSizes)/sizeof(kBlockSizes[0]); b++) {
+            uint32_t num_frames = kBlockSizes[b];
+            int64_t sample_time = 0;
+
+            measure("voice_render", format("\"voices\": %d, \"frames\": %u", num_voices, num_frames),
+                    "voice-frame", (double) num_voices*num_frames, [&](long iterations) {
+                for (long i=0; i<iterations; i++) {
+                    HSBus bus;
+                    bus.mono = &mono[0];
+                    bus.side = &side[0];
+                    bus.frames_written = 0;
+
+                    wavetable->lockWavetables();
+                    for (int j=0; j<num_voices; j++) {
+                        voices[j].render(bus, sample_time, sample_time, num_frames, kEnvelope_Held, 0, params);
+                    }
+                    wavetable->unlockWavetables();
+
+                    bus.spread(&left[0], &right[0], num_frames, 1.0, 1.0);
+                    sample_time += num_frames;
+                }
+            });
+        }
+    }
+}
+
+// Roughly the size of a SynthEvent
+struct Event {
+    uint32_t sequence;
+    uint32_t payload[7];
+
+    void Free() {}
+};
+
+// Converting and writing a stereo file, to /dev/null so that the disk doesn't
+// count
+static void benchWavWriter() {
+    if (!selected("wav_write")) return;
+
+    static const uint32_t kFrames = 1 << 18;
+    std::vector<float> left(kFrames), right(kFrames);
+    srand(kSeed);
+    for (uint32_t i=0; i<kFrames; i++) {
+        left[i] = rand()/(RAND_MAX+1.0)*2-1;
+        right[i] = rand()/(RAND_MAX+1.0)*2-1;
+    }
+    const float* channels[2] = { &left[0], &right[0] };
+
+    static const struct { HSWavWriter::Format format; HSWavWriter::Dither dither; const char* name; } kCases[] = {
+        { HSWavWriter::kFormat_PCM16, HSWavWriter::kDither_TPDF, "16 tpdf" },
+        { HSWavWriter::kFormat_PCM24, HSWavWriter::kDither_None, "24" },
+        { HSWavWriter::kFormat_Float32, HSWavWriter::kDither_None, "float" }
+    };
+    for (size_t c=0; c<sizeof(kCases)/sizeof(kCases[0]); c++) {
+        measure("wav_write", format("\"format\": \"%s\", \"frames\": %u", kCases[c].name, kFrames),
+                "frame", kFrames, [&](long iterations) {
+            for (long i=0; i<iterations; i++) {
+                HSWavWriter wav;
+                wav.open("/dev/null", kSampleRate, 2, kCases[c].format, kCases[c].dither);
+                wav.write(channels, kFrames);
+                wav.close();
+            }
+        });
+    }
+}
+
+static void benchFIFO() {
+    static const uint32_t kQueueSize = 64;
+
+    // Writing and reading an item on the same thread; the cost of the queue
+    // operations themselves
+    if (selected("fifo_round_trip")) {
+        LockFreeFIFO<Event> fifo(kQueueSize);
+        volatile uint32_t sink = 0;
+        measure("fifo_round_trip", format("\"threads\": 1, \"size\": %u", kQueueSize), "item", 1,
+                [&](long iterations) {
+            for (long i=0; i<iterations; i++) {
+                Event* event = fifo.WriteItem();
+                event->sequence = (uint32_t) i;
+                fifo.AdvanceWritePtr();
+                sink = fifo.ReadItem()->sequence;
+                fifo.AdvanceReadPtr();
+            }
+        });
+        (void) sink;
+    }
+
+    // An item sent to another thread and back, which is how long it takes for
+    // an event to be seen by the other side, twice. With a single core this
+    // measures the scheduler more than the queue.
+    if (selected("fifo_ping_pong") && std::thread::hardware_concurrency() > 1) {
+        LockFreeFIFO<Event> ping(kQueueSize), pong(kQueueSize);
+        measure("fifo_ping_pong", format("\"threads\": 2, \"size\": %u", kQueueSize), "round trip", 1,
+                [&](long iterations) {
+            std::thread echo([&]() {
+                for (long i=0; i<iterations; i++) {
+                    Event* in;
+                    while ((in = ping.ReadItem()) == NULL) {}
+                    Event* out = pong.WriteItem();
+                    *out = *in;
+                    ping.AdvanceReadPtr();
+                    pong.AdvanceWritePtr();
+                }
+            });
+            for (long i=0; i<iterations; i++) {
+                Event* out = ping.WriteItem();
+                out->sequence = (uint32_t) i;
+                ping.AdvanceWritePtr();
+                while (pong.ReadItem() == NULL) {}
+                pong.AdvanceReadPtr();
+            }
+            echo.join();
+        });
+    }
+}
+
+static bool writeJSON(FILE* f) {
+    char date[32];
+    time_t t = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"suite\": \"hspad_bench\",\n");
+    fprintf(f, "  \"version\": 1,\n");
+    fprintf(f, "  \"date\": \"%s\",\n", date);
+#if defined(__VERSION__)
+    fprintf(f, "  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+    fprintf(f, "  \"threads\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(f, "  \"quick\": %s,\n", options.quick ? "true" : "false");
+    fprintf(f, "  \"seed\": %u,\n", kSeed);
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i=0; i<results.size(); i++) {
+        const Result& r = results[i];
+        std::vector<double> sorted = r.ns_per_iteration;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = 0;
+        for (size_t j=0; j<sorted.size(); j++) mean += sorted[j];
+        mean /= sorted.size();
+        double median = sorted[sorted.size()/2];
+
+        fprintf(f, "    {\"name\": \"%s\", \"params\": {%s}, \"unit\": \"%s\", \"items\": %.0f, "
+                   "\"iterations\": %ld, \"repetitions\": %d, "
+                   "\"ns_min\": %.1f, \"ns_median\": %.1f, \"ns_mean\": %.1f, \"ns_max\": %.1f, "
+                   "\"ns_per_item\": %.3f}%s\n",
+                r.name.c_str(), r.params.c_str(), r.unit, r.items,
+                r.iterations, (int) sorted.size(),
+                sorted.front(), median, mean, sorted.back(),
+                median/r.items, i+1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+    return !ferror(f);
+}
+
+// Reads the fastest repetition of each case from JSON that writeJSON wrote,
+// which has one result per line
+static bool readBaseline(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        const char* name = strstr(line, "{\"name\": \"");
+        const char* params = strstr(line, "\"params\": {");
+        const char* ns_min = strstr(line, "\"ns_min\": ");
+        if (!name || !params || !ns_min) continue;
+        name += strlen("{\"name\": \"");
+        params += strlen("\"params\": {");
+        const char* name_end = strchr(name, '"');
+        const char* params_end = strchr(params, '}');
+        if (!name_end || !params_end) continue;
+        std::string key = baselineKey(std::string(name, name_end), std::string(params, params_end));
+        baseline.push_back(std::make_pair(key, atof(ns_min + strlen("\"ns_min\": "))));
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+// Returns the number of cases that got slower than allowed
+static int compareWithBaseline(FILE* out) {
+    int num_slower = 0;
+    fprintf(out, "\nCompared with %s, allowing %.0f%% slower:\n", options.baseline_path, options.max_slowdown);
+    for (size_t i=0; i<results.size(); i++) {
+        const Result& r = results[i];
+        std::string key = baselineKey(r.name, r.params);
+        double ns_min = *std::min_element(r.ns_per_iteration.begin(), r.ns_per_iteration.end());
+        double before = baselineNs(key);
+        if (before <= 0) {
+            fprintf(out, "%-61s %14.0f ns   not in the baseline\n", key.c_str(), ns_min);
+            continue;
+        }
+        double change = (ns_min/before-1)*100;
+        bool slower = change > options.max_slowdown;
+        if (slower) num_slower++;
+        fprintf(out, "%-61s %14.0f ns %+7.1f%%%s\n", key.c_str(), ns_min, change, slower ? "  SLOWER" : "");
+    }
+    return num_slower;
+}
+
+int main(int argc, char** argv) {
+    options.json_path = 0;
+    options.quick = false;
+    options.baseline_path = 0;
+    options.max_slowdown = 10;
+    options.filter = 0;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--json") && i+1 < argc) options.json_path = argv[++i];
+        else if (!strcmp(argv[i], "--quick")) options.quick = true;
+        else if (!strcmp(argv[i], "--baseline") && i+1 < argc) options.baseline_path = argv[++i];
+        else if (!strcmp(argv[i], "--max-slowdown") && i+1 < argc) options.max_slowdown = atof(argv[++i]);
+        else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [--json file] [--quick] [--baseline file] [--max-slowdown percent] [filter]\n",
+                    argv[0]);
+            return 1;
+        }
+        else options.filter = argv[i];
+    }
+
+    // Read the baseline first, so that a missing one doesn't wait for the run
+    if (options.baseline_path && !readBaseline(options.baseline_path)) {
+        fprintf(stderr, "Could not read %s\n", options.baseline_path);
+        return 1;
+    }
+
+    benchFFT();
+    benchPADsynth();
+    benchGenerate();
+
+    if (selected("closest_matching") || selected("voice_render")) {
+        HSWavetable* wavetable = newDefaultWavetable(kNumSamplesPerWavetable);
+        benchTableLookup(wavetable);
+        benchVoices(wavetable);
+        delete wavetable;
+    }
+
+    benchWavWriter();
+    benchFIFO();
+
+    if (options.json_path) {
+        bool to_stdout = !strcmp(options.json_path, "-");
+        FILE* f = to_stdout ? stdout : fopen(options.json_path, "w");
+        if (!f) {
+            fprintf(stderr, "Could not open %s\n", options.json_path);
+            return 1;
+        }
+        bool ok = writeJSON(f);
+        if (!to_stdout) ok = fclose(f) == 0 && ok;
+        if (!ok) {
+            fprintf(stderr, "Could not write %s\n", options.json_path);
+            return 1;
+        }
+    }
+
+    if (options.baseline_path) {
+        bool to_stdout = options.json_path && !strcmp(options.json_path, "-");
+        int num_slower = compareWithBaseline(to_stdout ? stderr : stdout);
+        if (num_slower) {
+            fflush(stdout);
+            fprintf(stderr, "%d of %d cases got more than %.0f%% slower\n",
+                    num_slower, (int) results.size(), options.max_slowdown);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,552 @@
+/*
+ *  hspad_golden.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Renders scripted notes through the HSPad engine and compares the result with
+// stored golden WAV files, so that changes to the synthesis can be checked for
+// changes in the sound. The random phases are seeded, so a build that renders
+// the same as the one that made the golden files matches them exactly. The
+// comparison is made on the level and the spectrum rather than on the samples,
+// so that it tolerates the rounding of another compiler or other optimization
+// flags, which lets the phases drift apart over a note: an engine built with
+// -ffast-math differs from the golden files by about 0.1 dB.
+//
+// Build with CMake, which also runs it on tests/golden as a test, or with
+//   g++ -std=c++11 -O2 -pthread -I. -o hspad_golden hspad_golden.cpp $CORE
+// where $CORE is HSEngine.cpp HSGeneratorTrace.cpp HSLog.cpp HSMemory.cpp
+// HSParameters.cpp HSRenderStats.cpp HSVoice.cpp HSWavetable.cpp HSWavWriter.cpp
+// PADsynth.cpp kiss_fft.c kiss_fftr.c
+//
+// Usage: hspad_golden [options] script.txt|directory...
+//   --update         Write the golden files instead of comparing with them
+//   --level-tol dB   The largest difference in level allowed; 0.5 by default
+//   --bias-tol dB    The largest average difference in level allowed; 0.1 by default
+//   --spectrum-tol dB  The largest difference in a third octave band allowed; 0.5 by default
+//   --seed n         Seeds the random phases of the wavetables and the voices; 1 by default
+//
+// The golden file of a script is the WAV file next to it with the same name.
+// A directory stands for the .txt files in it.
+//
+// The level is compared over blocks of about 50 ms, in each channel; blocks
+// where both files are below -70 dBFS are skipped. The spectrum is the
+// average power over the whole file in third octave bands, and bands more
+// than 60 dB below the loudest are skipped.
+//
+// Scripts are text files. Lines up to the first event set up the render, and
+// the events follow in time order:
+//   # Comments start with a hash
+//   rate 44100                 The sample rate; 44100 by default
+//   channels 2                 1 or 2; 2 by default
+//   polyphony 10               10 by default
+//   seconds 2                  The length; 2 by default
+//   set Lushness = 40          A parameter, named like in the AudioUnit
+//   0.0 on 60 100              At 0 s, key 60 is played with velocity 100
+//   1.0 off 60
+//   0.5 bend -1.5              Pitch bend in semitones
+//   0.5 sustain on             The sustain pedal, on or off
+//   1.2 set Release time = 200 Parameters that the wavetables depend on can
+//                              only be set before the first event, since the
+//                              wavetables are regenerated in the background
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "HSEngine.h"
+#include "HSParameters.h"
+#include "HSWavWriter.h"
+#include "kiss_fftr.h"
+
+typedef std::vector<std::vector<float> > Channels;
+
+static const uint32_t kBlockFrames = 256;
+static const double kEnvelopeSeconds = 0.05;
+static const double kEnvelopeFloor = -70;   // dBFS
+static const int kSpectrumSize = 4096;
+static const double kSpectrumRange = 60;    // dB below the loudest band
+static const double kSilence = -200;        // dB, for levels of nothing
+
+struct Options {
+    bool update;
+    double level_tolerance;
+    double bias_tolerance;
+    double spectrum_tolerance;
+    unsigned seed;
+};
+
+static Options options;
+
+struct ScriptEvent {
+    enum Type { kOn, kOff, kBend, kSustain, kSet };
+
+    double time;
+    Type type;
+    int key;
+    int velocity;
+    int parameter;
+    float value;
+};
+
+struct Script {
+    int sample_rate;
+    int num_channels;
+    int polyphony;
+    double seconds;
+    HSParameters params;
+    std::vector<ScriptEvent> events;
+};
+
+static std::string trim(const std::string& s) {
+    size_t start = 0, end = s.size();
+    while (start < end && isspace((unsigned char) s[start])) start++;
+    while (end > start && isspace((unsigned char) s[end-1])) end--;
+    return s.substr(start, end-start);
+}
+
+static bool isWavetableParameter(int id) {
+    for (int i=0; i<kNumParametersThatAreRelevantToWavetable; i++) {
+        if (kParametersThatAreRelevantToWavetable[i] == id) return true;
+    }
+    return false;
+}
+
+// Parses "name = value" into a parameter id and value
+static const char* parseSetting(const std::string& text, int* id, float* value) {
+    size_t equals = text.find('=');
+    if (equals == std::string::npos) return "expected set name = value";
+    std::string name = trim(text.substr(0, equals));
+    std::string value_text = trim(text.substr(equals+1));
+
+    *id = parameterWithName(name.c_str());
+    if (*id < 0) return "unknown parameter";
+    char* end;
+    *value = strtof(value_text.c_str(), &end);
+    float min, max;
+    parameterRange(*id, &min, &max);
+    if (value_text.empty() || *end || *value < min || *value > max) return "value out of range";
+    return 0;
+}
+
+static const char* parseEvent(const char* text, ScriptEvent* event) {
+    char verb[16];
+    int n = 0;
+    memset(event, 0, sizeof(*event));
+    if (sscanf(text, "%lf %15s %n", &event->time, verb, &n) < 2 || event->time < 0) return "expected time and event";
+    const char* rest = text+n;
+
+    if (!strcmp(verb, "on")) {
+        event->type = ScriptEvent::kOn;
+        if (sscanf(rest, "%d %d", &event->key, &event->velocity) != 2 ||
+            event->key < 0 || event->key > 127 || event->velocity < 1 || event->velocity > 127) {
+            return "expected on key velocity";
+        }
+    }
+    else if (!strcmp(verb, "off")) {
+        event->type = ScriptEvent::kOff;
+        if (sscanf(rest, "%d", &event->key) != 1 || event->key < 0 || event->key > 127) return "expected off key";
+    }
+    else if (!strcmp(verb, "bend")) {
+        event->type = ScriptEvent::kBend;
+        if (sscanf(rest, "%f", &event->value) != 1) return "expected bend semitones";
+    }
+    else if (!strcmp(verb, "sustain")) {
+        event->type = ScriptEvent::kSustain;
+        std::string state = trim(rest);
+        if (state == "on") event->value = 1;
+        else if (state != "off") return "expected sustain on or off";
+    }
+    else if (!strcmp(verb, "set")) {
+        event->type = ScriptEvent::kSet;
+        const char* error = parseSetting(rest, &event->parameter, &event->value);
+        if (error) return error;
+        if (isWavetableParameter(event->parameter)) return "wavetable parameters can only be set before the events";
+    }
+    else {
+        return "unknown event";
+    }
+    return 0;
+}
+
+static bool readScript(const char* path, Script* script) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: could not open the file\n", path);
+        return false;
+    }
+
+    script->sample_rate = 44100;
+    script->num_channels = 2;
+    script->polyphony = kDefaultPolyphony;
+    script->seconds = 2;
+    script->params.setDefaults();
+    script->events.clear();
+
+    bool ok = true;
+    char line[1024];
+    for (int line_number=1; fgets(line, sizeof(line), f); line_number++) {
+        std::string text = line;
+        size_t comment = text.find('#');
+        if (comment != std::string::npos) text.erase(comment);
+        text = trim(text);
+        if (text.empty()) continue;
+
+        const char* error = 0;
+        if (isdigit((unsigned char) text[0]) || text[0] == '.') {
+            ScriptEvent event;
+            error = parseEvent(text.c_str(), &event);
+            if (!error && !script->events.empty() && event.time < script->events.back().time) {
+                error = "events must be in time order";
+            }
+            if (!error) script->events.push_back(event);
+        }
+        else if (!script->events.empty()) {
+            error = "settings must come before the events";
+        }
+        else if (text.compare(0, 4, "set ") == 0) {
+            int id;
+            float value;
+            error = parseSetting(text.substr(4), &id, &value);
+            if (!error) script->params.values[id] = value;
+        }
+        else {
+            char name[16];
+            double value;
+            if (sscanf(text.c_str(), "%15s %lf", name, &value) != 2) error = "expected a setting";
+            else if (!strcmp(name, "rate") && value >= 8000 && value <= 384000) script->sample_rate = (int) value;
+            else if (!strcmp(name, "channels") && (value == 1 || value == 2)) script->num_channels = (int) value;
+            else if (!strcmp(name, "polyphony") && value >= 1 && value <= kMaxPolyphony) script->polyphony = (int) value;
+            else if (!strcmp(name, "seconds") && value > 0 && value <= 60) script->seconds = value;
+            else error = "unknown setting or value out of range";
+        }
+
+        if (error) {
+            fprintf(stderr, "%s:%d: %s\n", path, line_number, error);
+            ok = false;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+static void performEvent(HSEngine& engine, const ScriptEvent& event, uint32_t offset) {
+    switch (event.type) {
+        case ScriptEvent::kOn: engine.noteOn(event.key, event.velocity, offset); break;
+        case ScriptEvent::kOff: engine.noteOff(event.key, offset); break;
+        case ScriptEvent::kBend: engine.setPitchBend(event.value, offset); break;
+        case ScriptEvent::kSustain: engine.setSustain(event.value != 0, offset); break;
+        // Parameters take effect at the start of a block
+        case ScriptEvent::kSet: engine.setParameter(event.parameter, event.value); break;
+    }
+}
+
+static void render(const Script& script, Channels* out) {
+    HSEngine engine(script.sample_rate, script.polyphony, kBlockFrames);
+    for (int id=0; id<kNumberOfParameters; id++) {
+        engine.setParameter(id, script.params.values[id]);
+    }
+    // Before the first render, which generates the wavetables
+    engine.setSeed(options.seed);
+
+    const uint32_t num_frames = (uint32_t) llround(script.seconds*script.sample_rate);
+    out->assign(script.num_channels, std::vector<float>(num_frames));
+
+    size_t next_event = 0;
+    for (uint32_t frame=0; frame<num_frames; frame+=kBlockFrames) {
+        uint32_t block = std::min(kBlockFrames, num_frames-frame);
+        while (next_event < script.events.size()) {
+            int64_t event_frame = llround(script.events[next_event].time*script.sample_rate);
+            if (event_frame >= frame+block) break;
+            uint32_t offset = event_frame > frame ? (uint32_t) (event_frame-frame) : 0;
+            performEvent(engine, script.events[next_event++], offset);
+        }
+        engine.render(&(*out)[0][frame], script.num_channels == 2 ? &(*out)[1][frame] : 0, block);
+    }
+}
+
+static uint32_t get16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; }
+
+// Reads 16 and 24 bit integer and 32 bit float WAV files
+static bool readWav(const char* path, int* sample_rate, Channels* channels) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    std::vector<uint8_t> data;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf+n);
+    fclose(f);
+
+    if (data.size() < 12 || memcmp(&data[0], "RIFF", 4) || memcmp(&data[8], "WAVE", 4)) return false;
+    int format = 0, num_channels = 0, bits = 0;
+    size_t pos = 12;
+    while (pos+8 <= data.size()) {
+        const uint8_t* chunk = &data[pos];
+        uint32_t size = get32(chunk+4);
+        if (size > data.size()-pos-8) return false;
+        if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+            format = get16(chunk+8);
+            num_channels = get16(chunk+10);
+            *sample_rate = get32(chunk+12);
+            bits = get16(chunk+22);
+        }
+        else if (!memcmp(chunk, "data", 4)) {
+            int bytes = bits/8;
+            bool supported = (format == 1 && (bits == 16 || bits == 24)) || (format == 3 && bits == 32);
+            if (!supported || num_channels < 1) return false;
+            uint32_t num_frames = size/(bytes*num_channels);
+            channels->assign(num_channels, std::vector<float>(num_frames));
+            const uint8_t* p = chunk+8;
+            for (uint32_t i=0; i<num_frames; i++) {
+                for (int c=0; c<num_channels; c++, p+=bytes) {
+                    float value;
+                    if (format == 3) {
+                        uint32_t word = get32(p);
+                        memcpy(&value, &word, 4);
+                    }
+                    else if (bits == 16) value = (int16_t) get16(p)/32767.f;
+                    else value = ((int32_t) (get32(p-1) & 0xFFFFFF00) >> 8)/8388607.f;
+                    (*channels)[c][i] = value;
+                }
+            }
+            return true;
+        }
+        pos += 8 + size + (size & 1);
+    }
+    return false;
+}
+
+static bool writeWav(const char* path, int sample_rate, const Channels& channels) {
+    HSWavWriter wav;
+    if (!wav.open(path, sample_rate, (int) channels.size(), HSWavWriter::kFormat_PCM24)) return false;
+    const float* buffers[2] = { &channels[0][0], channels.size() > 1 ? &channels[1][0] : 0 };
+    bool ok = wav.write(buffers, (uint32_t) channels[0].size());
+    if (wav.getNumClipped()) fprintf(stderr, "%s: %llu samples clipped\n", path, (unsigned long long) wav.getNumClipped());
+    return wav.close() && ok;
+}
+
+static double toDB(double power) {
+    return power > 0 ? 10*log10(power) : kSilence;
+}
+
+struct Difference {
+    double level_max;      // The largest difference of a block, in dB
+    double level_bias;     // The average difference, in dB
+    double spectrum_max;   // The largest difference of a band, in dB
+    double residual;       // The level of the difference of the samples, relative to the golden file, in dB
+};
+
+static void compareLevels(const std::vector<float>& golden, const std::vector<float>& rendered, int sample_rate,
+                          Difference* diff, double* bias_sum, int* bias_count) {
+    const size_t block = (size_t) (kEnvelopeSeconds*sample_rate);
+    for (size_t start=0; start+block <= golden.size(); start+=block) {
+        double golden_power = 0, rendered_power = 0;
+        for (size_t i=start; i<start+block; i++) {
+            golden_power += (double) golden[i]*golden[i];
+            rendered_power += (double) rendered[i]*rendered[i];
+        }
+        double golden_db = toDB(golden_power/block);
+        double rendered_db = toDB(rendered_power/block);
+        if (golden_db < kEnvelopeFloor && rendered_db < kEnvelopeFloor) continue;
+        double d = rendered_db-golden_db;
+        diff->level_max = std::max(diff->level_max, fabs(d));
+        *bias_sum += d;
+        (*bias_count)++;
+    }
+}
+
+// The average power spectrum, in third octave bands from 25 Hz up
+static std::vector<double> bandSpectrum(const std::vector<float>& samples, int sample_rate) {
+    const int n = kSpectrumSize;
+    kiss_fftr_cfg cfg = kiss_fftr_alloc(n, 0, 0, 0);
+    std::vector<float> frame(n);
+    std::vector<kiss_fft_cpx> bins(n/2+1);
+    std::vector<double> power(n/2+1, 0);
+    for (size_t start=0; start+n <= samples.size(); start+=n/2) {
+        for (int i=0; i<n; i++) {
+            float window = 0.5f - 0.5f*cosf(2*M_PI*i/n);
+            frame[i] = samples[start+i]*window;
+        }
+        kiss_fftr(cfg, &frame[0], &bins[0]);
+        for (int i=0; i<=n/2; i++) power[i] += (double) bins[i].r*bins[i].r + (double) bins[i].i*bins[i].i;
+    }
+    kiss_fftr_free(cfg);
+
+    std::vector<double> bands;
+    const double bin_width = (double) sample_rate/n;
+    for (double low=25; low < sample_rate/2.; low *= pow(2., 1/3.)) {
+        double high = low*pow(2., 1/3.);
+        double sum = 0;
+        int count = 0;
+        for (int i=(int) ceil(low/bin_width); i<=n/2 && i*bin_width < high; i++, count++) sum += power[i];
+        if (count) bands.push_back(toDB(sum));
+    }
+    return bands;
+}
+
+static void compareSpectra(const std::vector<float>& golden, const std::vector<float>& rendered, int sample_rate,
+                           Difference* diff) {
+    std::vector<double> golden_bands = bandSpectrum(golden, sample_rate);
+    std::vector<double> rendered_bands = bandSpectrum(rendered, sample_rate);
+    double loudest = kSilence;
+    for (size_t i=0; i<golden_bands.size(); i++) {
+        loudest = std::max(loudest, std::max(golden_bands[i], rendered_bands[i]));
+    }
+    for (size_t i=0; i<golden_bands.size(); i++) {
+        if (golden_bands[i] < loudest-kSpectrumRange && rendered_bands[i] < loudest-kSpectrumRange) continue;
+        diff->spectrum_max = std::max(diff->spectrum_max, fabs(rendered_bands[i]-golden_bands[i]));
+    }
+}
+
+static Difference compare(const Channels& golden, const Channels& rendered, int sample_rate) {
+    Difference diff = { 0, 0, 0, kSilence };
+    double bias_sum = 0;
+    int bias_count = 0;
+    double golden_power = 0, residual_power = 0;
+    for (size_t c=0; c<golden.size(); c++) {
+        compareLevels(golden[c], rendered[c], sample_rate, &diff, &bias_sum, &bias_count);
+        compareSpectra(golden[c], rendered[c], sample_rate, &diff);
+        for (size_t i=0; i<golden[c].size(); i++) {
+            double d = rendered[c][i]-golden[c][i];
+            golden_power += (double) golden[c][i]*golden[c][i];
+            residual_power += d*d;
+        }
+    }
+    diff.level_bias = bias_count ? bias_sum/bias_count : 0;
+    if (golden_power > 0) diff.residual = toDB(residual_power/golden_power);
+    return diff;
+}
+
+// Returns 0 if the script rendered like its golden file, 1 if it didn't and 2
+// if it couldn't be checked
+static int check(const std::string& script_path) {
+    std::string name = script_path;
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos) name.erase(0, slash+1);
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos) name.erase(dot);
+    std::string wav_path = script_path.substr(0, script_path.rfind('.')) + ".wav";
+
+    Script script;
+    if (!readScript(script_path.c_str(), &script)) return 2;
+    Channels rendered;
+    render(script, &rendered);
+    uint64_t not_finite = 0;
+    for (size_t c=0; c<rendered.size(); c++) {
+        for (size_t i=0; i<rendered[c].size(); i++) {
+            if (!isfinite(rendered[c][i])) not_finite++;
+        }
+    }
+    if (not_finite) {
+        printf("%-20s FAILED: %llu samples are not finite\n", name.c_str(), (unsigned long long) not_finite);
+        return 1;
+    }
+
+    if (options.update) {
+        if (!writeWav(wav_path.c_str(), script.sample_rate, rendered)) {
+            fprintf(stderr, "%s: could not write the file\n", wav_path.c_str());
+            return 2;
+        }
+        printf("%-20s updated %s\n", name.c_str(), wav_path.c_str());
+        return 0;
+    }
+
+    int sample_rate;
+    Channels golden;
+    if (!readWav(wav_path.c_str(), &sample_rate, &golden)) {
+        fprintf(stderr, "%s: could not read the golden file; run with --update to make it\n", wav_path.c_str());
+        return 2;
+    }
+    if (sample_rate != script.sample_rate || golden.size() != rendered.size() ||
+        golden[0].size() != rendered[0].size()) {
+        printf("%-20s FAILED: the golden file has %d Hz, %d channels and %d frames, the render %d Hz, %d and %d\n",
+               name.c_str(), sample_rate, (int) golden.size(), (int) golden[0].size(),
+               script.sample_rate, (int) rendered.size(), (int) rendered[0].size());
+        return 1;
+    }
+
+    Difference diff = compare(golden, rendered, sample_rate);
+    bool ok = diff.level_max <= options.level_tolerance &&
+              fabs(diff.level_bias) <= options.bias_tolerance &&
+              diff.spectrum_max <= options.spectrum_tolerance;
+    printf("%-20s level %.2f dB (bias %+.2f dB), spectrum %.2f dB, residual %.0f dB: %s\n",
+           name.c_str(), diff.level_max, diff.level_bias, diff.spectrum_max, diff.residual, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--update] [--level-tol dB] [--bias-tol dB] [--spectrum-tol dB] [--seed n]\n"
+                    "       script.txt|directory...\n", program);
+}
+
+int main(int argc, char** argv) {
+    options.update = false;
+    options.level_tolerance = 0.5;
+    options.bias_tolerance = 0.1;
+    options.spectrum_tolerance = 0.5;
+    options.seed = 1;
+
+    std::vector<std::string> scripts;
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "--update")) {
+            options.update = true;
+            continue;
+        }
+        if (arg[0] == '-') {
+            if (i+1 >= argc) {
+                usage(argv[0]);
+                return 2;
+            }
+            double value = atof(argv[++i]);
+            if (!strcmp(arg, "--level-tol")) options.level_tolerance = value;
+            else if (!strcmp(arg, "--bias-tol")) options.bias_tolerance = value;
+            else if (!strcmp(arg, "--spectrum-tol")) options.spectrum_tolerance = value;
+            else if (!strcmp(arg, "--seed")) options.seed = (unsigned) value;
+            else {
+                usage(argv[0]);
+                return 2;
+            }
+            continue;
+        }
+
+        struct stat st;
+        if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+            std::vector<std::string> found;
+            DIR* dir = opendir(arg);
+            for (struct dirent* entry; dir && (entry = readdir(dir)); ) {
+                size_t length = strlen(entry->d_name);
+                if (length > 4 && !strcmp(entry->d_name+length-4, ".txt")) {
+                    found.push_back(std::string(arg) + "/" + entry->d_name);
+                }
+            }
+            if (dir) closedir(dir);
+            std::sort(found.begin(), found.end());
+            scripts.insert(scripts.end(), found.begin(), found.end());
+        }
+        else {
+            scripts.push_back(arg);
+        }
+    }
+    if (scripts.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int result = 0;
+    for (size_t i=0; i<scripts.size(); i++) {
+        result = std::max(result, check(scripts[i]));
+        fflush(stdout);
+    }
+    return result;
+}
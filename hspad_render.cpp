@@ -0,0 +1,332 @@
+/*
+ *  hspad_render.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Renders MIDI files to WAV files with the HSPad engine, as fast as it can.
+// Several files are rendered at once, and they all play from one set of
+// wavetables, which is generated once from the preset.
+//
+// Build with CMake, or with
+//   g++ -std=c++11 -O2 -pthread -I. -o hspad_render hspad_render.cpp $CORE
+// where $CORE is HSEngine.cpp HSGeneratorTrace.cpp HSLog.cpp HSMemory.cpp HSMidiFile.cpp
+// HSParameters.cpp HSRenderStats.cpp HSVoice.cpp HSWavetable.cpp HSWavWriter.cpp
+// PADsynth.cpp kiss_fft.c kiss_fftr.c
+//
+// Usage: hspad_render [options] file.mid...
+//   -p preset   Parameter values, see below
+//   -o dir      Where the WAV files go; next to the MIDI files by default
+//   -f format   16, 24 or float; 24 by default
+//   -d dither   none or tpdf, for 16 and 24 bit; tpdf by default
+//   -r rate     The sample rate; 44100 by default
+//   -c channels 1 or 2; 2 by default
+//   -n notes    The polyphony; 10 by default
+//   -b frames   The frames rendered at a time; 4096 by default
+//   -j jobs     The files rendered at once; one per core by default
+//   -t seconds  The longest that notes may ring after the end of the file; 10 by default
+//
+// The preset is a text file with one parameter per line, named like in the
+// AudioUnit:
+//   # Comments start with a hash
+//   Lushness = 60
+//   Release time = 1200
+// Parameters that aren't in the preset keep their default values.
+//
+// All channels of the MIDI file play the same instrument. Note on and off,
+// the sustain pedal and pitch bend (+-2 semitones) are played; everything else
+// is ignored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HSEngine.h"
+#include "HSMidiFile.h"
+#include "HSParameters.h"
+#include "HSWavetable.h"
+#include "HSWavWriter.h"
+
+static const float kPitchBendRange = 2;  // Semitones
+
+struct Options {
+    const char* preset_path;
+    const char* output_dir;
+    HSWavWriter::Format format;
+    HSWavWriter::Dither dither;
+    int sample_rate;
+    int num_channels;
+    int polyphony;
+    uint32_t block_frames;
+    int num_jobs;
+    double max_tail;
+};
+
+static Options options;
+static HSParameters preset;
+static std::mutex output_mutex;
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-p preset] [-o dir] [-f 16|24|float] [-d none|tpdf] [-r rate]\n"
+                    "       [-c channels] [-n notes] [-b frames] [-j jobs] [-t seconds] file.mid...\n", program);
+}
+
+static std::string trim(const std::string& s) {
+    size_t start = 0, end = s.size();
+    while (start < end && isspace((unsigned char) s[start])) start++;
+    while (end > start && isspace((unsigned char) s[end-1])) end--;
+    return s.substr(start, end-start);
+}
+
+static bool readPreset(const char* path, HSParameters* params) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: could not open the file\n", path);
+        return false;
+    }
+
+    bool ok = true;
+    char line[1024];
+    for (int line_number=1; fgets(line, sizeof(line), f); line_number++) {
+        std::string text = line;
+        size_t comment = text.find('#');
+        if (comment != std::string::npos) text.erase(comment);
+        text = trim(text);
+        if (text.empty()) continue;
+
+        size_t equals = text.find('=');
+        if (equals == std::string::npos) {
+            fprintf(stderr, "%s:%d: expected name = value\n", path, line_number);
+            ok = false;
+            continue;
+        }
+        std::string name = trim(text.substr(0, equals));
+        std::string value_text = trim(text.substr(equals+1));
+
+        int id = parameterWithName(name.c_str());
+        if (id < 0) {
+            fprintf(stderr, "%s:%d: unknown parameter \"%s\"\n", path, line_number, name.c_str());
+            ok = false;
+            continue;
+        }
+        char* end;
+        float value = strtof(value_text.c_str(), &end);
+        float min, max;
+        parameterRange(id, &min, &max);
+        if (value_text.empty() || *end || value < min || value > max) {
+            fprintf(stderr, "%s:%d: %s must be a number from %g to %g\n",
+                    path, line_number, parameterName(id), min, max);
+            ok = false;
+            continue;
+        }
+        params->values[id] = value;
+    }
+    fclose(f);
+    return ok;
+}
+
+static std::string outputPath(const char* midi_path) {
+    std::string path = midi_path;
+    size_t slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash+1);
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos && dot > 0) name.erase(dot);
+    name += ".wav";
+
+    if (options.output_dir) return std::string(options.output_dir) + "/" + name;
+    return slash == std::string::npos ? name : path.substr(0, slash+1) + name;
+}
+
+static void performEvent(HSEngine& engine, const HSMidiEvent& event, uint32_t offset) {
+    switch (event.type()) {
+        case 0x80:
+        case 0x90:
+            // Note on with velocity 0 is a note off
+            if (event.type() == 0x90 && event.data2) engine.noteOn(event.data1, event.data2, offset);
+            else engine.noteOff(event.data1, offset);
+            break;
+
+        case 0xB0:
+            if (event.data1 == 64) engine.setSustain(event.data2 >= 64, offset);
+            break;
+
+        case 0xE0: {
+            int bend = (event.data2 << 7 | event.data1) - 8192;
+            engine.setPitchBend(bend/8192.f*kPitchBendRange, offset);
+            break;
+        }
+    }
+}
+
+static bool render(const char* midi_path, HSWavetable* wavetable) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    HSMidiFile midi;
+    if (!midi.read(midi_path)) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        fprintf(stderr, "%s: %s\n", midi_path, midi.getError().c_str());
+        return false;
+    }
+
+    std::string wav_path = outputPath(midi_path);
+    HSWavWriter wav;
+    if (!wav.open(wav_path.c_str(), options.sample_rate, options.num_channels, options.format, options.dither)) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        fprintf(stderr, "%s: could not create the file\n", wav_path.c_str());
+        return false;
+    }
+
+    HSEngine engine(options.sample_rate, options.polyphony, options.block_frames, wavetable);
+    for (int id=0; id<kNumberOfParameters; id++) {
+        engine.setParameter(id, preset.values[id]);
+    }
+
+    const uint32_t block = options.block_frames;
+    std::vector<float> left(block), right(block);
+    const float* channels[2] = { &left[0], &right[0] };
+
+    // Render until the end of the file, and then until the notes have rung out
+    const std::vector<HSMidiEvent>& events = midi.getEvents();
+    const int64_t end_frame = (int64_t) ceil(midi.getDuration()*options.sample_rate);
+    const int64_t max_end_frame = end_frame + (int64_t) (options.max_tail*options.sample_rate);
+    size_t next_event = 0;
+    int64_t frame = 0;
+    bool ok = true;
+    while (ok) {
+        if (frame >= end_frame && next_event == events.size()) {
+            if (engine.getNumSoundingVoices() == 0 || frame >= max_end_frame) break;
+        }
+
+        while (next_event < events.size()) {
+            int64_t event_frame = llround(events[next_event].time*options.sample_rate);
+            if (event_frame >= frame+block) break;
+            uint32_t offset = event_frame > frame ? (uint32_t) (event_frame-frame) : 0;
+            performEvent(engine, events[next_event++], offset);
+        }
+
+        engine.render(&left[0], options.num_channels == 2 ? &right[0] : 0, block);
+        ok = wav.write(channels, block);
+        frame += block;
+    }
+    if (!wav.close()) ok = false;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    double rendered = (double) frame/options.sample_rate;
+    std::lock_guard<std::mutex> lock(output_mutex);
+    if (!ok) {
+        fprintf(stderr, "%s: could not write the file\n", wav_path.c_str());
+        return false;
+    }
+    printf("%s: %.1f s in %.2f s (%.0fx realtime)",
+           wav_path.c_str(), rendered, seconds, seconds > 0 ? rendered/seconds : 0);
+    if (wav.getNumClipped()) printf(", %llu samples clipped", (unsigned long long) wav.getNumClipped());
+    printf("\n");
+    fflush(stdout);
+    return true;
+}
+
+static bool parseInt(const char* text, int min, int max, int* value) {
+    char* end;
+    long n = strtol(text, &end, 10);
+    if (!*text || *end || n < min || n > max) return false;
+    *value = (int) n;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    options.preset_path = 0;
+    options.output_dir = 0;
+    options.format = HSWavWriter::kFormat_PCM24;
+    options.dither = HSWavWriter::kDither_TPDF;
+    options.sample_rate = 44100;
+    options.num_channels = 2;
+    options.polyphony = kDefaultPolyphony;
+    options.block_frames = 4096;
+    options.num_jobs = std::thread::hardware_concurrency();
+    if (options.num_jobs < 1) options.num_jobs = 1;
+    options.max_tail = 10;
+
+    std::vector<const char*> files;
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-' || !arg[1]) {
+            files.push_back(arg);
+            continue;
+        }
+        if (arg[2] || i+1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        int n;
+        bool valid = true;
+        switch (arg[1]) {
+            case 'p': options.preset_path = value; break;
+            case 'o': options.output_dir = value; break;
+            case 'f':
+                if (!strcmp(value, "16")) options.format = HSWavWriter::kFormat_PCM16;
+                else if (!strcmp(value, "24")) options.format = HSWavWriter::kFormat_PCM24;
+                else if (!strcmp(value, "float")) options.format = HSWavWriter::kFormat_Float32;
+                else valid = false;
+                break;
+            case 'd':
+                if (!strcmp(value, "none")) options.dither = HSWavWriter::kDither_None;
+                else if (!strcmp(value, "tpdf")) options.dither = HSWavWriter::kDither_TPDF;
+                else valid = false;
+                break;
+            case 'r': valid = parseInt(value, 8000, 384000, &options.sample_rate); break;
+            case 'c': valid = parseInt(value, 1, 2, &options.num_channels); break;
+            case 'n': valid = parseInt(value, 1, kMaxPolyphony, &options.polyphony); break;
+            case 'b': valid = parseInt(value, 1, 1<<20, &n); options.block_frames = n; break;
+            case 'j': valid = parseInt(value, 1, 1024, &options.num_jobs); break;
+            case 't': options.max_tail = atof(value); valid = options.max_tail >= 0; break;
+            default: valid = false; break;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (files.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    preset.setDefaults();
+    if (options.preset_path && !readPreset(options.preset_path, &preset)) return 1;
+
+    // The wavetables are the slow part to set up, so all the jobs share them
+    HSWavetable wavetable(kNumWavetables, options.sample_rate, kNumSamplesPerWavetable,
+                          preset.values[kParameter_HarmonicBandwidth],
+                          preset.values[kParameter_HarmonicProfile],
+                          preset.values[kParameter_HarmonicsAmount],
+                          preset.values[kParameter_HarmonicsCurveSteepness],
+                          preset.values[kParameter_HarmonicsBalance],
+                          kHarmonicsCompensation);
+
+    std::atomic<size_t> next_file(0);
+    std::atomic<int> num_failed(0);
+    int num_jobs = options.num_jobs < (int) files.size() ? options.num_jobs : (int) files.size();
+    std::vector<std::thread> jobs;
+    for (int i=0; i<num_jobs; i++) {
+        jobs.push_back(std::thread([&]() {
+            size_t file;
+            while ((file = next_file++) < files.size()) {
+                if (!render(files[file], &wavetable)) num_failed++;
+            }
+        }));
+    }
+    for (size_t i=0; i<jobs.size(); i++) jobs[i].join();
+
+    return num_failed ? 1 : 0;
+}
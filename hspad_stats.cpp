@@ -0,0 +1,260 @@
+/*
+ *  hspad_stats.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Plays chords through the HSPad engine in real time, the way a host would
+// call the AudioUnit, and writes the render statistics (see HSRenderStats.h)
+// as JSON. This shows how close a machine comes to the deadline with a given
+// polyphony and buffer size, without a plug-in host.
+//
+// The engine renders on a thread of its own, paced by the buffer duration,
+// while the main thread reads the statistics once a second and prints a
+// summary, like a host reading kHSPadProperty_RenderStats would.
+//
+// With -g, the render thread also changes Lushness every so often, which
+// regenerates the wavetables while the chords play. The JSON then sums up how
+// long the regenerations took (see HSGeneratorTrace.h), and -t writes the
+// stages of each one as a Chrome trace.
+//
+// The JSON also has the memory that the engine allocated, with the peak while
+// new tables replaced the old ones (see HSMemory.h).
+//
+// Build with CMake, or with
+//   g++ -std=c++11 -O2 -pthread -I. -o hspad_stats hspad_stats.cpp $CORE
+// where $CORE is HSEngine.cpp HSGeneratorTrace.cpp HSLog.cpp HSMemory.cpp
+// HSParameters.cpp HSRenderStats.cpp HSVoice.cpp HSWavetable.cpp PADsynth.cpp
+// kiss_fft.c kiss_fftr.c
+//
+// Usage: hspad_stats [options]
+//   -r rate     The sample rate; 44100 by default
+//   -b frames   The buffer size; 256 by default
+//   -n notes    The polyphony; 10 by default
+//   -k notes    The notes of each chord; 4 by default
+//   -u voices   Unison voices per note; the default of the parameter by default
+//   -s seconds  How long to play; 20 by default
+//   -x          Render as fast as possible instead of in real time
+//   -g seconds  Change a parameter that the wavetables depend on this often
+//   -t file     Write the stages of regenerating the wavetables as a Chrome trace
+//   -o file     Where the JSON goes; stdout by default
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "HSEngine.h"
+#include "HSMemory.h"
+#include "HSParameters.h"
+#include "HSRenderStats.h"
+#include "HSWavetable.h"
+
+// A new chord starts this often, and the previous one is released
+static const double kChordSeconds = 0.5;
+
+struct Options {
+    int sample_rate;
+    int buffer_frames;
+    int polyphony;
+    int chord_notes;
+    int unison_voices;
+    double seconds;
+    bool realtime;
+    double regenerate_seconds;
+    const char* trace_path;
+    const char* output_path;
+};
+
+static Options options;
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-r rate] [-b frames] [-n notes] [-k notes] [-u voices] [-s seconds] [-x]\n"
+                    "       [-g seconds] [-t file] [-o file]\n", program);
+}
+
+static bool parseInt(const char* text, int min, int max, int* value) {
+    char* end;
+    long n = strtol(text, &end, 10);
+    if (!*text || *end || n < min || n > max) return false;
+    *value = (int) n;
+    return true;
+}
+
+// The keys of chord number index: a few triads with added notes on top, so
+// that chords share few keys with the chord before
+static int chordKey(int index, int note) {
+    static const int kRoots[] = { 48, 53, 55, 50 };
+    static const int kIntervals[] = { 0, 7, 12, 16, 19, 23, 26, 28, 31, 35, 38, 40 };
+    const int num_intervals = sizeof(kIntervals)/sizeof(kIntervals[0]);
+    return kRoots[index % 4] + kIntervals[note % num_intervals] + 12*(note/num_intervals);
+}
+
+static void play(HSEngine* engine, std::atomic<bool>* done) {
+    const uint32_t frames = options.buffer_frames;
+    const int64_t chord_frames = (int64_t) (kChordSeconds*options.sample_rate);
+    const int64_t end_frame = (int64_t) (options.seconds*options.sample_rate);
+    const int64_t regenerate_frames = (int64_t) (options.regenerate_seconds*options.sample_rate);
+    int64_t next_regenerate = regenerate_frames;
+    const float lushness = engine->getParameter(kParameter_HarmonicBandwidth);
+    std::vector<float> left(frames), right(frames);
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>((double) frames/options.sample_rate));
+    Clock::time_point deadline = Clock::now();
+
+    int chord = -1;
+    for (int64_t frame=0; frame<end_frame; frame+=frames) {
+        // Chords change at the start of the buffer that they fall in
+        int next_chord = (int) ((frame+frames-1)/chord_frames);
+        if (next_chord != chord) {
+            uint32_t offset = next_chord*chord_frames > frame ? (uint32_t) (next_chord*chord_frames-frame) : 0;
+            for (int i=0; chord >= 0 && i<options.chord_notes; i++) engine->noteOff(chordKey(chord, i), offset);
+            for (int i=0; i<options.chord_notes; i++) engine->noteOn(chordKey(next_chord, i), 100, offset);
+            chord = next_chord;
+        }
+        if (regenerate_frames > 0 && frame >= next_regenerate) {
+            // Alternate between two values, so that each change is a change
+            bool odd = (next_regenerate/regenerate_frames) % 2;
+            engine->setParameter(kParameter_HarmonicBandwidth, odd ? lushness*0.75f : lushness);
+            next_regenerate += regenerate_frames;
+        }
+
+        engine->render(&left[0], &right[0], frames);
+
+        if (options.realtime) {
+            // Like an audio device, don't catch up on cycles that were late
+            deadline += period;
+            Clock::time_point now = Clock::now();
+            if (deadline < now) deadline = now;
+            else std::this_thread::sleep_until(deadline);
+        }
+    }
+    done->store(true);
+}
+
+int main(int argc, char** argv) {
+    options.sample_rate = 44100;
+    options.buffer_frames = 256;
+    options.polyphony = kDefaultPolyphony;
+    options.chord_notes = 4;
+    options.unison_voices = 0;
+    options.seconds = 20;
+    options.realtime = true;
+    options.regenerate_seconds = 0;
+    options.trace_path = 0;
+    options.output_path = 0;
+
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-' || !arg[1] || arg[2]) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg[1] == 'x') {
+            options.realtime = false;
+            continue;
+        }
+        if (i+1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        bool valid = true;
+        switch (arg[1]) {
+            case 'r': valid = parseInt(value, 8000, 384000, &options.sample_rate); break;
+            case 'b': valid = parseInt(value, 1, 1<<16, &options.buffer_frames); break;
+            case 'n': valid = parseInt(value, 1, kMaxPolyphony, &options.polyphony); break;
+            case 'k': valid = parseInt(value, 1, kMaxNumNotes, &options.chord_notes); break;
+            case 'u': valid = parseInt(value, (int) kMinimumValue_UnisonVoices, (int) kMaximumValue_UnisonVoices,
+                                       &options.unison_voices); break;
+            case 's': options.seconds = atof(value); valid = options.seconds > 0; break;
+            case 'g': options.regenerate_seconds = atof(value); valid = options.regenerate_seconds > 0; break;
+            case 't': options.trace_path = value; break;
+            case 'o': options.output_path = value; break;
+            default: valid = false; break;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    HSEngine engine(options.sample_rate, options.polyphony, options.buffer_frames);
+    if (options.unison_voices) engine.setParameter(kParameter_UnisonVoices, options.unison_voices);
+
+    // Render once to generate the wavetables, which takes long enough to spoil
+    // the statistics
+    std::vector<float> scratch(options.buffer_frames);
+    engine.render(&scratch[0], 0, options.buffer_frames);
+    engine.getRenderStats().reset();
+    HSGeneratorTrace& trace = engine.getWavetable()->getTrace();
+    trace.reset();
+
+    std::atomic<bool> done(false);
+    std::thread render_thread(play, &engine, &done);
+
+    HSRenderStatsSnapshot stats;
+    int tenths = 0;
+    while (!done.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (!options.realtime || ++tenths % 10) continue;
+        engine.getRenderStats().read(&stats);
+        fprintf(stderr, "%3d s: %llu cycles, max load %.2f, %llu missed, %llu stolen\n", tenths/10,
+                (unsigned long long) stats.cycles, stats.max_load,
+                (unsigned long long) stats.deadline_misses, (unsigned long long) stats.stolen_voices);
+    }
+    render_thread.join();
+    engine.getRenderStats().read(&stats);
+
+    // Let the last regeneration finish, so that it is counted
+    HSGeneratorStats generator;
+    for (int i=0; i<1000; i++) {
+        trace.getStats(&generator);
+        if (generator.jobs_completed+generator.jobs_superseded >= generator.jobs_requested) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (options.trace_path) {
+        FILE* trace_file = fopen(options.trace_path, "w");
+        std::string json = trace.chromeTraceJSON();
+        if (!trace_file || fwrite(json.data(), 1, json.size(), trace_file) != json.size() || fclose(trace_file) != 0) {
+            fprintf(stderr, "%s: could not write the file\n", options.trace_path);
+            return 1;
+        }
+    }
+
+    HSMemoryStats memory;
+    engine.getMemoryStats(&memory);
+
+    FILE* f = options.output_path ? fopen(options.output_path, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "%s: could not create the file\n", options.output_path);
+        return 1;
+    }
+    fprintf(f, "{\n");
+    fprintf(f, "  \"sample_rate\": %d,\n", options.sample_rate);
+    fprintf(f, "  \"buffer_frames\": %d,\n", options.buffer_frames);
+    fprintf(f, "  \"polyphony\": %d,\n", options.polyphony);
+    fprintf(f, "  \"chord_notes\": %d,\n", options.chord_notes);
+    fprintf(f, "  \"unison_voices\": %g,\n", engine.getParameter(kParameter_UnisonVoices));
+    fprintf(f, "  \"realtime\": %s,\n", options.realtime ? "true" : "false");
+    fprintf(f, "  \"stats\": ");
+    writeRenderStatsJSON(f, stats, 4);
+    fprintf(f, ",\n  \"generator\": ");
+    writeGeneratorStatsJSON(f, generator, 4);
+    fprintf(f, ",\n  \"memory\": ");
+    writeMemoryStatsJSON(f, memory, 4);
+    fprintf(f, "\n}\n");
+    if (f != stdout && fclose(f) != 0) {
+        fprintf(stderr, "%s: could not write the file\n", options.output_path);
+        return 1;
+    }
+    return 0;
+}
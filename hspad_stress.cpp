@@ -0,0 +1,446 @@
+/*
+ *  hspad_stress.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Hammers the wavetables from several threads at once, the way the AudioUnit
+// does in a busy session, to find races and to measure how long the render
+// threads are held up by the generator thread:
+//
+//  - A parameter thread changes the parameters that the wavetables depend on
+//    and calls HSWavetable::generateWavetables, like the AudioUnit's parameter
+//    listener does, sometimes several times in a row so that requests
+//    supersede each other.
+//  - The generator thread of HSWavetable generates the tables and swaps them
+//    in under the write lock.
+//  - Render threads each run an HSEngine on the same wavetables, starting
+//    notes, which look up tables with closestMatchingLevel, and rendering
+//    them under the read lock.
+//  - A MIDI thread sends notes, pitch bends, the sustain pedal and the
+//    parameters that the voices read to the render threads, through the
+//    event queue that AUInstrumentBase uses.
+//
+// Build it with -DHSPAD_SANITIZE=thread to run it under ThreadSanitizer.
+// Without it, the render statistics show the worst cycles; the generator
+// statistics show how long the tables were locked for each swap, and the
+// memory statistics (see HSMemory.h) how much the two sets of tables that
+// coexist during a swap add to the peak.
+//
+// The rendered audio is checked for samples that aren't finite or are far
+// above full scale. It exits with 1 if any were found, if events were
+// dropped, or if the memory that only generating tables needs wasn't freed.
+//
+// Build with CMake, or with
+//   g++ -std=c++11 -O2 -pthread -I. -I$AUIB -o hspad_stress hspad_stress.cpp $CORE
+// where $AUIB is CoreAudioUtilityClasses/CoreAudio/AudioUnits/AUPublic/AUInstrumentBase
+// and $CORE is HSEngine.cpp HSGeneratorTrace.cpp HSLog.cpp HSMemory.cpp
+// HSParameters.cpp HSRenderStats.cpp HSVoice.cpp HSWavetable.cpp PADsynth.cpp
+// kiss_fft.c kiss_fftr.c
+//
+// Usage: hspad_stress [options]
+//   -e engines  Render threads, each with an engine; 2 by default
+//   -r rate     The sample rate; 44100 by default
+//   -b frames   The buffer size; 256 by default
+//   -n notes    The polyphony of each engine; 10 by default
+//   -w samples  The size of the wavetables, a power of two; 262144 by default.
+//               Smaller tables are generated faster, which gives more swaps
+//               under a sanitizer.
+//   -s seconds  How long to run; 10 by default
+//   -p ms       The average time between wavetable parameter changes; 20 by default
+//   -m ms       The average time between MIDI events; 2 by default
+//   -x          Render as fast as possible instead of in real time
+//   -l file     Write the diagnostics of the threads to the file (see HSLog.h)
+//   -o file     Where the JSON goes; stdout by default
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "HSEngine.h"
+#include "HSLog.h"
+#include "HSMemory.h"
+#include "HSParameters.h"
+#include "HSRenderStats.h"
+#include "HSWavetable.h"
+#include "LockFreeMPSCQueue.h"
+
+// Samples above this are taken to be garbage rather than loud notes
+static const float kMaxSample = 16;
+// The most events the MIDI thread sends in one go
+static const int kMaxBurst = 8;
+// The most regenerations the parameter thread requests in a row
+static const int kMaxRegenerateBurst = 4;
+
+struct Options {
+    int num_engines;
+    int sample_rate;
+    int buffer_frames;
+    int polyphony;
+    int wavetable_samples;
+    double seconds;
+    double parameter_ms;
+    double midi_ms;
+    bool realtime;
+    const char* log_path;
+    const char* output_path;
+};
+
+static Options options;
+
+struct Event {
+    enum Type { kNoteOn, kNoteOff, kPitchBend, kSustain, kParameter };
+
+    Type type;
+    uint32_t offset;
+    int key;
+    int velocity;   // The parameter id, for kParameter
+    float value;
+
+    // LockFreeMPSCQueue frees items when their slot is reused
+    void Free() {}
+};
+
+typedef LockFreeMPSCQueue<Event> EventQueue;
+
+struct Engine {
+    Engine(HSWavetable* wavetable) :
+        engine(options.sample_rate, options.polyphony, options.buffer_frames, wavetable),
+        queue(256, 4096), bad_samples(0) {}
+
+    HSEngine engine;
+    EventQueue queue;
+    std::atomic<uint64_t> bad_samples;
+};
+
+static std::atomic<bool> done(false);
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-e engines] [-r rate] [-b frames] [-n notes] [-w samples] [-s seconds] [-p ms] [-m ms] [-x]\n"
+                    "       [-l file] [-o file]\n", program);
+}
+
+static bool parseInt(const char* text, int min, int max, int* value) {
+    char* end;
+    long n = strtol(text, &end, 10);
+    if (!*text || *end || n < min || n > max) return false;
+    *value = (int) n;
+    return true;
+}
+
+static float randomFloat(unsigned* state, float min, float max) {
+    return min + (max-min)*(rand_r(state)/(RAND_MAX+1.0f));
+}
+
+// Sleeps for a random time with the given average, so that the threads meet at
+// different points each time
+static void randomSleep(unsigned* state, double mean_ms) {
+    double ms = -log(1-rand_r(state)/(RAND_MAX+1.0))*mean_ms;
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ms));
+}
+
+static void render(Engine* e) {
+    const uint32_t frames = options.buffer_frames;
+    std::vector<float> left(frames), right(frames);
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>((double) frames/options.sample_rate));
+    Clock::time_point deadline = Clock::now();
+
+    while (!done.load(std::memory_order_relaxed)) {
+        Event* event;
+        while ((event = e->queue.ReadItem()) != NULL) {
+            switch (event->type) {
+                case Event::kNoteOn: e->engine.noteOn(event->key, event->velocity, event->offset); break;
+                case Event::kNoteOff: e->engine.noteOff(event->key, event->offset); break;
+                case Event::kPitchBend: e->engine.setPitchBend(event->value, event->offset); break;
+                case Event::kSustain: e->engine.setSustain(event->value != 0, event->offset); break;
+                case Event::kParameter: e->engine.setParameter(event->velocity, event->value); break;
+            }
+            e->queue.AdvanceReadPtr();
+        }
+
+        e->engine.render(&left[0], &right[0], frames);
+
+        uint64_t bad = 0;
+        for (uint32_t i=0; i<frames; i++) {
+            if (!(fabsf(left[i]) <= kMaxSample)) bad++;
+            if (!(fabsf(right[i]) <= kMaxSample)) bad++;
+        }
+        if (bad) e->bad_samples.fetch_add(bad, std::memory_order_relaxed);
+
+        if (options.realtime) {
+            deadline += period;
+            Clock::time_point now = Clock::now();
+            if (deadline < now) deadline = now;
+            else std::this_thread::sleep_until(deadline);
+        }
+    }
+}
+
+static void send(Engine* e, const Event& event) {
+    Event* item = e->queue.WriteItem();
+    if (!item) {
+        e->queue.DropItem();
+        return;
+    }
+    *item = event;
+    e->queue.AdvanceWritePtr(item);
+}
+
+static void midi(std::vector<Engine*>* engines) {
+    // The parameters that the voices read every cycle
+    static const int kVoiceParameters[] = {
+        kParameter_Volume, kParameter_TouchSensitivity, kParameter_AttackTime, kParameter_ReleaseTime,
+        kParameter_StereoWidth, kParameter_UnisonVoices, kParameter_UnisonDetune, kParameter_UnisonSpread
+    };
+    const int num_voice_parameters = sizeof(kVoiceParameters)/sizeof(kVoiceParameters[0]);
+    unsigned state = 2;
+    // The keys that are held on each engine, so that most notes are let go
+    std::vector<std::vector<int> > held(engines->size());
+
+    while (!done.load(std::memory_order_relaxed)) {
+        int burst = 1 + rand_r(&state) % kMaxBurst;
+        for (int i=0; i<burst; i++) {
+            size_t index = rand_r(&state) % engines->size();
+            Event event;
+            memset(&event, 0, sizeof(event));
+            event.offset = rand_r(&state) % options.buffer_frames;
+
+            int choice = rand_r(&state) % 100;
+            if (choice < 40) {
+                event.type = Event::kNoteOn;
+                event.key = 24 + rand_r(&state) % 84;
+                event.velocity = 1 + rand_r(&state) % 127;
+                held[index].push_back(event.key);
+            }
+            else if (choice < 80) {
+                if (held[index].empty()) continue;
+                size_t which = rand_r(&state) % held[index].size();
+                event.type = Event::kNoteOff;
+                event.key = held[index][which];
+                held[index].erase(held[index].begin()+which);
+            }
+            else if (choice < 88) {
+                event.type = Event::kPitchBend;
+                event.value = randomFloat(&state, -2, 2);
+            }
+            else if (choice < 92) {
+                event.type = Event::kSustain;
+                event.value = rand_r(&state) % 2;
+            }
+            else {
+                event.type = Event::kParameter;
+                event.velocity = kVoiceParameters[rand_r(&state) % num_voice_parameters];
+                float min, max;
+                parameterRange(event.velocity, &min, &max);
+                event.value = randomFloat(&state, min, max);
+                if (event.velocity == kParameter_UnisonVoices) event.value = floorf(event.value);
+                // Long envelopes would let the notes pile up
+                if (event.velocity == kParameter_AttackTime || event.velocity == kParameter_ReleaseTime) {
+                    event.value = fminf(event.value, 1000);
+                }
+            }
+            send((*engines)[index], event);
+        }
+        randomSleep(&state, options.midi_ms);
+    }
+}
+
+static void parameters(HSWavetable* wavetable) {
+    unsigned state = 3;
+    while (!done.load(std::memory_order_relaxed)) {
+        int burst = 1 + rand_r(&state) % kMaxRegenerateBurst;
+        for (int i=0; i<burst; i++) {
+            wavetable->getTrace().parameterChanged();
+            // Kept small enough that a table is generated in a few tens of
+            // milliseconds, so that there are many swaps
+            wavetable->generateWavetables(randomFloat(&state, kMinimumValue_HarmonicBandwidth, 100),
+                                          randomFloat(&state, kMinimumValue_HarmonicProfile, kMaximumValue_HarmonicProfile),
+                                          randomFloat(&state, kMinimumValue_HarmonicsAmount, 8),
+                                          randomFloat(&state, kMinimumValue_HarmonicsCurveSteepness,
+                                                      kMaximumValue_HarmonicsCurveSteepness),
+                                          randomFloat(&state, kMinimumValue_HarmonicsBalance, kMaximumValue_HarmonicsBalance),
+                                          kHarmonicsCompensation);
+        }
+        randomSleep(&state, options.parameter_ms);
+    }
+}
+
+int main(int argc, char** argv) {
+    options.num_engines = 2;
+    options.sample_rate = 44100;
+    options.buffer_frames = 256;
+    options.polyphony = kDefaultPolyphony;
+    options.wavetable_samples = kNumSamplesPerWavetable;
+    options.seconds = 10;
+    options.parameter_ms = 20;
+    options.midi_ms = 2;
+    options.realtime = true;
+    options.log_path = 0;
+    options.output_path = 0;
+
+    for (int i=1; i<argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-' || !arg[1] || arg[2]) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg[1] == 'x') {
+            options.realtime = false;
+            continue;
+        }
+        if (i+1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        bool valid = true;
+        switch (arg[1]) {
+            case 'e': valid = parseInt(value, 1, 64, &options.num_engines); break;
+            case 'r': valid = parseInt(value, 8000, 384000, &options.sample_rate); break;
+            case 'b': valid = parseInt(value, 1, 1<<16, &options.buffer_frames); break;
+            case 'n': valid = parseInt(value, 1, kMaxPolyphony, &options.polyphony); break;
+            case 'w':
+                valid = parseInt(value, 1024, 1<<22, &options.wavetable_samples) &&
+                        !(options.wavetable_samples & (options.wavetable_samples-1));
+                break;
+            case 's': options.seconds = atof(value); valid = options.seconds > 0; break;
+            case 'p': options.parameter_ms = atof(value); valid = options.parameter_ms >= 0; break;
+            case 'm': options.midi_ms = atof(value); valid = options.midi_ms >= 0; break;
+            case 'l': options.log_path = value; break;
+            case 'o': options.output_path = value; break;
+            default: valid = false; break;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.log_path && !hsLog().start(options.log_path)) {
+        fprintf(stderr, "%s: could not create the file\n", options.log_path);
+        return 1;
+    }
+
+    HSWavetable* wavetable = new HSWavetable(kNumWavetables, options.sample_rate, options.wavetable_samples,
+                                             kDefaultValue_HarmonicBandwidth, kDefaultValue_HarmonicProfile,
+                                             kDefaultValue_HarmonicsAmount, kDefaultValue_HarmonicsCurveSteepness,
+                                             kDefaultValue_HarmonicsBalance, kHarmonicsCompensation);
+    wavetable->getTrace().reset();
+    std::vector<Engine*> engines;
+    for (int i=0; i<options.num_engines; i++) engines.push_back(new Engine(wavetable));
+
+    std::vector<std::thread> threads;
+    for (int i=0; i<options.num_engines; i++) threads.push_back(std::thread(render, engines[i]));
+    threads.push_back(std::thread(midi, &engines));
+    threads.push_back(std::thread(parameters, wavetable));
+
+    // Read the statistics while the threads run, like a host reading the
+    // property would
+    HSRenderStatsSnapshot stats;
+    HSGeneratorStats generator;
+    for (int tenths=1; tenths <= (int) (options.seconds*10); tenths++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (tenths % 10) continue;
+        double max_load = 0;
+        uint64_t bad_samples = 0;
+        for (int i=0; i<options.num_engines; i++) {
+            engines[i]->engine.getRenderStats().read(&stats);
+            if (stats.max_load > max_load) max_load = stats.max_load;
+            bad_samples += engines[i]->bad_samples.load(std::memory_order_relaxed);
+        }
+        wavetable->getTrace().getStats(&generator);
+        fprintf(stderr, "%3d s: %llu swaps, max load %.2f, %llu bad samples\n", tenths/10,
+                (unsigned long long) generator.jobs_completed, max_load, (unsigned long long) bad_samples);
+    }
+    done.store(true);
+    for (size_t i=0; i<threads.size(); i++) threads[i].join();
+
+    // Let the last regeneration finish, so that it is counted
+    for (int i=0; i<1000; i++) {
+        wavetable->getTrace().getStats(&generator);
+        if (generator.jobs_completed+generator.jobs_superseded >= generator.jobs_requested) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    FILE* f = options.output_path ? fopen(options.output_path, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "%s: could not create the file\n", options.output_path);
+        return 1;
+    }
+    // The tables of the engines are shared, so each engine only adds its voices
+    HSMemoryStats memory;
+    wavetable->getMemory().read(&memory);
+    bool scratch_leaked = memory.subsystems[kMemory_Scratch].current != 0;
+    for (int i=0; i<options.num_engines; i++) {
+        HSMemoryStats voices;
+        engines[i]->engine.getMemoryStats(&voices);
+        addMemoryStats(&memory, voices);
+    }
+
+    uint64_t bad_samples = 0, dropped_events = 0;
+    double max_cycle = 0;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"engines\": %d,\n", options.num_engines);
+    fprintf(f, "  \"sample_rate\": %d,\n", options.sample_rate);
+    fprintf(f, "  \"buffer_frames\": %d,\n", options.buffer_frames);
+    fprintf(f, "  \"polyphony\": %d,\n", options.polyphony);
+    fprintf(f, "  \"wavetable_samples\": %d,\n", options.wavetable_samples);
+    fprintf(f, "  \"seconds\": %g,\n", options.seconds);
+    fprintf(f, "  \"realtime\": %s,\n", options.realtime ? "true" : "false");
+    fprintf(f, "  \"stats\": [\n");
+    for (int i=0; i<options.num_engines; i++) {
+        engines[i]->engine.getRenderStats().read(&stats);
+        if (stats.max_seconds > max_cycle) max_cycle = stats.max_seconds;
+        bad_samples += engines[i]->bad_samples.load();
+        dropped_events += engines[i]->queue.GetDroppedItems();
+        fprintf(f, "    ");
+        writeRenderStatsJSON(f, stats, 6);
+        fprintf(f, "%s\n", i+1 < options.num_engines ? "," : "");
+    }
+    fprintf(f, "  ],\n");
+    fprintf(f, "  \"generator\": ");
+    writeGeneratorStatsJSON(f, generator, 4);
+    fprintf(f, ",\n");
+    fprintf(f, "  \"memory\": ");
+    writeMemoryStatsJSON(f, memory, 4);
+    fprintf(f, ",\n");
+    fprintf(f, "  \"max_cycle_us\": %.3f,\n", max_cycle*1e6);
+    fprintf(f, "  \"bad_samples\": %llu,\n", (unsigned long long) bad_samples);
+    fprintf(f, "  \"dropped_events\": %llu\n", (unsigned long long) dropped_events);
+    fprintf(f, "}\n");
+    if (f != stdout && fclose(f) != 0) {
+        fprintf(stderr, "%s: could not write the file\n", options.output_path);
+        return 1;
+    }
+
+    for (int i=0; i<options.num_engines; i++) delete engines[i];
+    delete wavetable;
+    if (options.log_path) {
+        if (hsLog().getDropped()) {
+            fprintf(stderr, "%llu log messages were dropped\n", (unsigned long long) hsLog().getDropped());
+        }
+        hsLog().stop();
+    }
+
+    if (bad_samples || dropped_events) {
+        fprintf(stderr, "%llu bad samples, %llu dropped events\n",
+                (unsigned long long) bad_samples, (unsigned long long) dropped_events);
+        return 1;
+    }
+    if (scratch_leaked) {
+        fprintf(stderr, "%llu bytes of scratch memory were not freed\n",
+                (unsigned long long) memory.subsystems[kMemory_Scratch].current);
+        return 1;
+    }
+    return 0;
+}
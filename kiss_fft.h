@@ -5,7 +5,11 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#if defined(__APPLE__)
 #include <sys/malloc.h>
+#else
+#include <malloc.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -0,0 +1,211 @@
+/*
+ *  parallel_bench.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Measures how much of the render deadline is left when the notes are split
+// across the threads of an HSRenderPool, like HSGroupElement does with the
+// render threads property, compared to rendering them all on one thread. Each
+// thread renders a run of voices into buses of its own, and the buses are
+// added together when the threads are done. The voices read wavetables the
+// size of the ones HSPad uses.
+//
+// The slack is the share of the buffer duration that is left after the cycle,
+// for the mean and for the slowest cycle; a negative slack is a drop out.
+//
+// The join time is what handing out tasks that do nothing and waiting for them
+// costs. Divided by the time that one note takes, it is the number of notes
+// that a thread must render to pay for itself, which is what
+// kMinNotesPerRenderThread in HSPad.h is based on. The results only mean
+// something with at least as many cores as threads; with fewer, the bench says
+// so.
+//
+// Build with
+//   g++ -std=c++11 -O2 -pthread -o parallel_bench parallel_bench.cpp HSRenderPool.cpp
+//
+// Usage: parallel_bench [voices] [frames] [cycles] [max_threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "HSOscillator.h"
+#include "HSRenderPool.h"
+
+static const int kNumTables = 10;
+static const int kTableSize = 262144;
+static const int kMaxVoices = 64;
+static const int kMaxThreads = 8;
+static const double kSampleRate = 44100;
+
+struct Voice {
+    int table_idx;
+    double increment;
+    double phase;
+};
+
+struct Bus {
+    float* mono;
+    float* side;
+};
+
+struct Cycle {
+    float** tables;
+    Voice* voices;
+    int num_voices;
+    int num_threads;
+    Bus buses[kMaxThreads];
+    int num_frames;
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static void renderVoice(float** tables, Voice& voice, Bus& bus, bool write, int num_frames) {
+    HSOscillator osc;
+    osc.lo_table = tables[voice.table_idx];
+    osc.hi_table = 0;
+    osc.num_samples = kTableSize;
+    osc.num_taps = 1;
+    osc.lo_phases[0] = voice.phase;
+    osc.tap_ratios[0] = 1;
+    osc.tap_gains[0] = osc.tap_side_gains[0] = 1;
+    osc.setGains(0.1, 0.1, 0, 0, num_frames);
+    osc.setIncrements(voice.increment, voice.increment, 0, 0, num_frames);
+
+    for (int frame=0; frame<num_frames; frame++) {
+        float side_out;
+        float mono_out = osc.next(side_out);
+        if (write) { bus.mono[frame] = mono_out; bus.side[frame] = side_out; }
+        else { bus.mono[frame] += mono_out; bus.side[frame] += side_out; }
+    }
+    voice.phase = osc.lo_phases[0];
+}
+
+static void renderTask(void* context, int thread) {
+    Cycle* c = (Cycle*) context;
+    int begin = c->num_voices*thread/c->num_threads;
+    int end = c->num_voices*(thread+1)/c->num_threads;
+    for (int v=begin; v<end; v++) {
+        renderVoice(c->tables, c->voices[v], c->buses[thread], v == begin, c->num_frames);
+    }
+}
+
+static void emptyTask(void*, int) {}
+
+static void renderCycle(HSRenderPool* pool, Cycle& c) {
+    if (c.num_threads == 1) renderTask(&c, 0);
+    else pool->run(renderTask, &c, c.num_threads);
+
+    for (int t=1; t<c.num_threads; t++) {
+        float* __restrict mono = c.buses[0].mono;
+        float* __restrict side = c.buses[0].side;
+        const float* __restrict src_mono = c.buses[t].mono;
+        const float* __restrict src_side = c.buses[t].side;
+        for (int frame=0; frame<c.num_frames; frame++) mono[frame] += src_mono[frame];
+        for (int frame=0; frame<c.num_frames; frame++) side[frame] += src_side[frame];
+    }
+}
+
+int main(int argc, char** argv) {
+    int num_voices = argc > 1 ? atoi(argv[1]) : 32;
+    int num_frames = argc > 2 ? atoi(argv[2]) : 256;
+    int num_cycles = argc > 3 ? atoi(argv[3]) : 2000;
+    int max_threads = argc > 4 ? atoi(argv[4]) : 4;
+
+    if (num_voices < 1 || num_voices > kMaxVoices || num_frames < 1 || num_cycles < 1 ||
+        max_threads < 1 || max_threads > kMaxThreads) {
+        fprintf(stderr, "Usage: %s [voices 1-%d] [frames] [cycles] [max_threads 1-%d]\n",
+                argv[0], kMaxVoices, kMaxThreads);
+        return 1;
+    }
+
+    float* tables[kNumTables];
+    for (int i=0; i<kNumTables; i++) {
+        tables[i] = (float*) malloc(sizeof(float)*kTableSize);
+        for (int j=0; j<kTableSize; j++) tables[i][j] = rand()/(RAND_MAX+1.0)*2-1;
+    }
+
+    Voice voices[kMaxVoices];
+    for (int v=0; v<num_voices; v++) {
+        voices[v].table_idx = rand() % kNumTables;
+        voices[v].increment = pow(2., rand()/(RAND_MAX+1.0) - 0.5);
+        voices[v].phase = rand()/(RAND_MAX+1.0)*kTableSize;
+    }
+
+    Cycle c;
+    c.tables = tables;
+    c.voices = voices;
+    c.num_voices = num_voices;
+    c.num_frames = num_frames;
+    for (int t=0; t<kMaxThreads; t++) {
+        c.buses[t].mono = (float*) malloc(sizeof(float)*num_frames);
+        c.buses[t].side = (float*) malloc(sizeof(float)*num_frames);
+    }
+
+    double deadline = num_frames/kSampleRate;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("voices %d, frames %d, cycles %d, deadline %.0f us, cpus %ld\n",
+           num_voices, num_frames, num_cycles, deadline*1e6, num_cpus);
+    printf("%7s %12s %12s %11s %11s %9s %11s\n", "threads", "mean us/cyc", "max us/cyc",
+           "mean slack", "min slack", "join us", "join notes");
+
+    float checksum = 0;
+    double note_seconds = 0;
+    for (int num_threads=1; num_threads<=max_threads; num_threads*=2) {
+        HSRenderPool* pool = num_threads > 1 ? new HSRenderPool(num_threads-1, deadline) : 0;
+        c.num_threads = num_threads;
+
+        // Let the workers start and the caches warm up before measuring
+        for (int cycle=0; cycle<num_cycles/10+1; cycle++) renderCycle(pool, c);
+
+        double total = 0, slowest = 0;
+        for (int cycle=0; cycle<num_cycles; cycle++) {
+            double start = now();
+            renderCycle(pool, c);
+            double elapsed = now()-start;
+            total += elapsed;
+            if (elapsed > slowest) slowest = elapsed;
+            checksum += c.buses[0].mono[num_frames-1];
+        }
+
+        // The fork and join alone, with the workers as warm as when rendering
+        double join = 0;
+        if (pool) {
+            double start = now();
+            for (int cycle=0; cycle<num_cycles; cycle++) pool->run(emptyTask, 0, num_threads);
+            join = (now()-start)/num_cycles;
+        }
+        delete pool;
+
+        double mean = total/num_cycles;
+        if (num_threads == 1) note_seconds = mean/num_voices;
+        printf("%7d %12.1f %12.1f %10.1f%% %10.1f%%", num_threads,
+               mean*1e6, slowest*1e6, 100*(1-mean/deadline), 100*(1-slowest/deadline));
+        if (pool) printf(" %9.1f %11.1f\n", join*1e6, join/note_seconds);
+        else printf(" %9s %11s\n", "-", "-");
+    }
+    if (num_cpus < max_threads) {
+        printf("Only %ld cpus for %d threads; the threads take turns, so this doesn't show the gain\n",
+               num_cpus, max_threads);
+    }
+
+    // Keep the compiler from optimizing the rendering away
+    fprintf(stderr, "checksum %f\n", checksum);
+
+    for (int i=0; i<kNumTables; i++) free(tables[i]);
+    for (int t=0; t<kMaxThreads; t++) {
+        free(c.buses[t].mono);
+        free(c.buses[t].side);
+    }
+
+    return 0;
+}
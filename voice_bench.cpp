@@ -0,0 +1,224 @@
+/*
+ *  voice_bench.cpp
+ *  HSPad
+ *
+ *  Copyright 2010 Per Eckerdal. All rights reserved.
+ *
+ */
+
+// Measures how fast HSOscillator renders a set of voices that read from
+// wavetables the size of the ones HSPad uses, with and without ordering the
+// voices by wavetable and prefetching the next block. On Linux, cache misses
+// are counted with the same hardware counters that perf uses.
+//
+// Build with
+//   g++ -O2 -o voice_bench voice_bench.cpp
+//
+// Usage: voice_bench [voices] [taps] [frames] [blocks] [evict_kb]
+//
+// evict_kb is the size of a buffer that is written between render cycles to
+// simulate the host and other plugins using the caches.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "HSOscillator.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#else
+// The counters aren't available, but the code that sets them up still compiles
+enum { PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_MISSES,
+       PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS };
+#endif
+
+static const int kNumTables = 10;
+static const int kTableSize = 262144;
+
+struct Voice {
+    int table_idx;
+    double increment;
+    double phases[kMaxUnisonTaps];
+};
+
+// A hardware event counter. It reads as -1 if the counter isn't available,
+// which is common in virtual machines and with a high perf_event_paranoid.
+struct Counter {
+    int fd;
+
+    Counter(unsigned type, unsigned long long config) : fd(-1) {
+#if defined(__linux__)
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~Counter() {
+#if defined(__linux__)
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    void start() {
+#if defined(__linux__)
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    long long stop() {
+#if defined(__linux__)
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        long long count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+        return count;
+#else
+        return -1;
+#endif
+    }
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static int compareVoices(const void* a, const void* b) {
+    return ((const Voice*)a)->table_idx - ((const Voice*)b)->table_idx;
+}
+
+static void renderBlock(float** tables, Voice* voices, int num_voices, int num_taps,
+                        float* out, int num_frames, bool prefetch) {
+    for (int v=0; v<num_voices; v++) {
+        Voice& voice = voices[v];
+
+        HSOscillator osc;
+        osc.lo_table = tables[voice.table_idx];
+        osc.hi_table = 0;
+        osc.num_samples = kTableSize;
+        osc.num_taps = num_taps;
+        for (int tap=0; tap<num_taps; tap++) {
+            osc.lo_phases[tap] = voice.phases[tap];
+            osc.tap_ratios[tap] = pow(2., unisonTapPosition(tap, num_taps)*12/1200.);
+            osc.tap_gains[tap] = osc.tap_side_gains[tap] = 1/sqrtf(num_taps);
+        }
+        osc.setGains(0.1, 0.1, 0, 0, num_frames);
+        osc.setIncrements(voice.increment, voice.increment, 0, 0, num_frames);
+
+        for (int frame=0; frame<num_frames; frame++) {
+            out[frame] += osc.next();
+        }
+
+        if (prefetch) osc.prefetchNextBlock(num_frames, false);
+
+        for (int tap=0; tap<num_taps; tap++) {
+            voice.phases[tap] = osc.lo_phases[tap];
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int num_voices = argc > 1 ? atoi(argv[1]) : 10;
+    int num_taps = argc > 2 ? atoi(argv[2]) : 1;
+    int num_frames = argc > 3 ? atoi(argv[3]) : 256;
+    int num_blocks = argc > 4 ? atoi(argv[4]) : 2000;
+    int evict_kb = argc > 5 ? atoi(argv[5]) : 0;
+
+    if (num_voices < 1 || num_taps < 1 || num_taps > kMaxUnisonTaps || num_frames < 1 || num_blocks < 1 || evict_kb < 0) {
+        fprintf(stderr, "Usage: %s [voices] [taps 1-%d] [frames] [blocks] [evict_kb]\n", argv[0], kMaxUnisonTaps);
+        return 1;
+    }
+
+    float* tables[kNumTables];
+    for (int i=0; i<kNumTables; i++) {
+        tables[i] = (float*) malloc(sizeof(float)*kTableSize);
+        for (int j=0; j<kTableSize; j++) tables[i][j] = rand()/(RAND_MAX+1.0)*2-1;
+    }
+    float* out = (float*) malloc(sizeof(float)*num_frames);
+    char* evict = evict_kb ? (char*) malloc(evict_kb*1024) : 0;
+
+    Voice* initial_voices = (Voice*) malloc(sizeof(Voice)*num_voices);
+    Voice* voices = (Voice*) malloc(sizeof(Voice)*num_voices);
+    for (int v=0; v<num_voices; v++) {
+        initial_voices[v].table_idx = rand() % kNumTables;
+        initial_voices[v].increment = pow(2., rand()/(RAND_MAX+1.0) - 0.5);
+        for (int tap=0; tap<kMaxUnisonTaps; tap++) {
+            initial_voices[v].phases[tap] = rand()/(RAND_MAX+1.0)*kTableSize;
+        }
+    }
+
+    Counter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    Counter l1_misses(PERF_TYPE_HW_CACHE,
+                      PERF_COUNT_HW_CACHE_L1D |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    printf("voices %d, taps %d, frames %d, blocks %d, evict %d kB\n",
+           num_voices, num_taps, num_frames, num_blocks, evict_kb);
+    printf("%-10s %-9s %14s %16s %16s\n", "order", "prefetch", "ns/voice-frame", "LLC misses/block", "L1D misses/block");
+
+    for (int mode=0; mode<4; mode++) {
+        bool ordered = mode & 1;
+        bool prefetch = mode & 2;
+
+        memcpy(voices, initial_voices, sizeof(Voice)*num_voices);
+        if (ordered) qsort(voices, num_voices, sizeof(Voice), compareVoices);
+
+        double elapsed = 0;
+        long long llc_total = 0, l1_total = 0;
+        for (int block=0; block<num_blocks; block++) {
+            if (evict) {
+                for (int i=0; i<evict_kb*1024; i+=64) evict[i] = (char) block;
+            }
+            memset(out, 0, sizeof(float)*num_frames);
+
+            misses.start();
+            l1_misses.start();
+            double start = now();
+            renderBlock(tables, voices, num_voices, num_taps, out, num_frames, prefetch);
+            elapsed += now()-start;
+            long long l1 = l1_misses.stop();
+            long long llc = misses.stop();
+            llc_total = (llc < 0 || llc_total < 0) ? -1 : llc_total+llc;
+            l1_total = (l1 < 0 || l1_total < 0) ? -1 : l1_total+l1;
+        }
+
+        char llc_str[32], l1_str[32];
+        if (llc_total < 0) strcpy(llc_str, "n/a");
+        else snprintf(llc_str, sizeof(llc_str), "%.1f", (double)llc_total/num_blocks);
+        if (l1_total < 0) strcpy(l1_str, "n/a");
+        else snprintf(l1_str, sizeof(l1_str), "%.1f", (double)l1_total/num_blocks);
+
+        printf("%-10s %-9s %14.2f %16s %16s\n",
+               ordered ? "by table" : "unordered",
+               prefetch ? "yes" : "no",
+               elapsed*1e9/((double)num_blocks*num_frames*num_voices),
+               llc_str, l1_str);
+    }
+
+    // Keep the compiler from optimizing the rendering away
+    float sum = 0;
+    for (int frame=0; frame<num_frames; frame++) sum += out[frame];
+    fprintf(stderr, "checksum %f\n", sum);
+
+    for (int i=0; i<kNumTables; i++) free(tables[i]);
+    free(out);
+    free(evict);
+    free(initial_voices);
+    free(voices);
+
+    return 0;
+}